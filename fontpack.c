@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+extern uint8_t* pack_build(const uint8_t *ttf, uint32_t *out_len);
+extern int ascii_table_write(FILE *out, const uint8_t *ttf, uint32_t len, const char *name,
+    const char *ranges);
+extern uint32_t wasm_subset_font(void *font_ptr, uint32_t font_len, uint32_t face,
+    void *ranges_ptr, void *out_ptr, uint32_t out_max);
+
+static uint8_t* read_file(const char *path, long *size) {
+    FILE *in = fopen(path, "rb");
+    if (!in) return NULL;
+    fseek(in, 0, SEEK_END);
+    *size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    uint8_t *data = (uint8_t*)malloc(*size);
+    fread(data, 1, *size, in);
+    fclose(in);
+    return data;
+}
+
+// "public/fonts/Alfa-Slab.ttf" -> "Alfa_Slab"
+static void font_name(const char *path, char *name, size_t max) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t n = 0;
+    for (; *base && *base != '.' && n + 1 < max; base++)
+        name[n++] = (isalnum((unsigned char)*base)) ? *base : '_';
+    name[n] = 0;
+}
+
+// Writes the printable ASCII fast path tables for the given fonts as C,
+// matching each font's subset to ranges as well unless ranges is NULL.
+static int write_ascii_tables(int count, char **paths, const char *ranges) {
+    char names[16][64];
+    if (count > 16) count = 16;
+
+    printf("// Generated by `fontpack -c`, do not edit.\n\n");
+    for (int i = 0; i < count; i++) {
+        long size;
+        uint8_t *ttf = read_file(paths[i], &size);
+        font_name(paths[i], names[i], sizeof(names[i]));
+        if (!ttf || !ascii_table_write(stdout, ttf, (uint32_t)size, names[i], ranges)) {
+            fprintf(stderr, "Failed to read or subset font %s\n", paths[i]);
+            return 1;
+        }
+        free(ttf);
+    }
+
+    printf("static const ascii_table *const ascii_tables[] = {\n");
+    for (int i = 0; i < count; i++)
+        printf("    &ascii_table_%s,\n", names[i]);
+    printf("};\n#define NUM_ASCII_TABLES %d\n", count);
+    return 0;
+}
+
+// Writes a TTF holding only the glyphs for the given Unicode ranges.
+static int write_subset(const char *ranges, const char *in_path, const char *out_path) {
+    long size;
+    uint8_t *ttf = read_file(in_path, &size);
+    if (!ttf) {
+        printf("Failed to open font file\n");
+        return 1;
+    }
+
+    // a subset only outgrows its source by long loca offsets and glyph
+    // padding, at most 6 bytes per glyph
+    uint32_t max = (uint32_t)size + 65536 * 6;
+    uint8_t *subset = (uint8_t*)malloc(max);
+    uint32_t subset_size = wasm_subset_font(ttf, (uint32_t)size, 0, (void*)ranges, subset, max);
+    free(ttf);
+    if (!subset_size) {
+        printf("Failed to subset font (bad range spec or unsupported font)\n");
+        return 1;
+    }
+
+    FILE *out = fopen(out_path, "wb");
+    if (!out) {
+        printf("Failed to open output file\n");
+        return 1;
+    }
+    fwrite(subset, 1, subset_size, out);
+    fclose(out);
+    free(subset);
+    return 0;
+}
+
+// Converts a TTF into a prebaked txt2svg font pack. With -c it generates
+// the ASCII glyph tables compiled into txt2svg.c, with -s a subset TTF.
+int main(int argc, char **argv) {
+    if (argc >= 5 && !strcmp(argv[1], "-c") && !strcmp(argv[2], "-s"))
+        return write_ascii_tables(argc - 4, argv + 4, argv[3]);
+    if (argc >= 3 && !strcmp(argv[1], "-c"))
+        return write_ascii_tables(argc - 2, argv + 2, NULL);
+    if (argc == 5 && !strcmp(argv[1], "-s"))
+        return write_subset(argv[2], argv[3], argv[4]);
+
+    if (argc != 3) {
+        printf("usage: fontpack input.ttf output.pack\n"
+               "       fontpack -c [-s U+0020-007E,...] font.ttf... > ascii_tables.h\n"
+               "       fontpack -s U+0020-007E,U+00A0-00FF input.ttf output.ttf\n");
+        return 1;
+    }
+
+    long ttf_size;
+    uint8_t *ttf = read_file(argv[1], &ttf_size);
+    if (!ttf) {
+        printf("Failed to open font file\n");
+        return 1;
+    }
+
+    uint32_t pack_size;
+    uint8_t *pack = pack_build(ttf, &pack_size);
+    free(ttf);
+    if (!pack) {
+        printf("Unsupported font (TrueType glyf outlines only)\n");
+        return 1;
+    }
+
+    FILE *out = fopen(argv[2], "wb");
+    if (!out) {
+        printf("Failed to open output file\n");
+        return 1;
+    }
+    fwrite(pack, 1, pack_size, out);
+    fclose(out);
+    free(pack);
+    return 0;
+}
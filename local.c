@@ -2,29 +2,61 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-extern unsigned int wasm_generate_svg(void* textPtr, void* fontPtr, unsigned int fontLen,
-    void* colorPtr, void* outPtr, unsigned int outSize);
+typedef struct {
+    const void *data;
+    uint32_t len;
+    uint32_t face;
+    const char *variations;
+} font_ref;
 
-int main() {
-    FILE *font_file = fopen("public/fonts/Roboto.ttf", "rb");
-    if (!font_file) {
-        printf("Failed to open font file\n");
-        return 1;
+extern unsigned int wasm_generate_svg(void* textPtr, void* fontsPtr, unsigned int numFonts,
+    void* colorPtr, void* optionsPtr, void* outPtr, unsigned int outSize);
+
+// usage: ./local [font.ttf[,fallback.ttf...]] [text] [face index] [variations]
+// face and variations apply to the first font
+int main(int argc, char **argv) {
+    const char *font_paths = argc > 1 ? argv[1] : "public/fonts/Roboto.ttf";
+    const char *text = argc > 2 ? argv[2] : "Hello World";
+    unsigned int face = argc > 3 ? (unsigned int)atoi(argv[3]) : 0;
+    const char *variations = argc > 4 ? argv[4] : "";
+
+    font_ref fonts[8];
+    unsigned int num_fonts = 0;
+    char *paths = strdup(font_paths);
+    for (char *path = strtok(paths, ","); path && num_fonts < 8; path = strtok(NULL, ",")) {
+        // fonts and packs are used straight from the mapping, no copy
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            printf("Failed to open font file %s\n", path);
+            return 1;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        void *font = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (font == MAP_FAILED) {
+            printf("Failed to map font file %s\n", path);
+            return 1;
+        }
+        fonts[num_fonts].data = font;
+        fonts[num_fonts].len = (uint32_t)st.st_size;
+        fonts[num_fonts].face = num_fonts ? 0 : face;
+        fonts[num_fonts].variations = num_fonts ? "" : variations;
+        num_fonts++;
     }
-    fseek(font_file, 0, SEEK_END);
-    long font_size = ftell(font_file);
-    fseek(font_file, 0, SEEK_SET);
-    char *font = (char*)malloc(font_size);
-    fread(font, 1, font_size, font_file);
-    fclose(font_file);
-    
-    char text[] = "Hello World";
+    free(paths);
+
     char bg[] = "#000000";
     char color[] = "#ffffff";
     char out[32*1024];
-    wasm_generate_svg((void*)text, (void*)font, font_size, (void*)color, (void*)out, sizeof(out));
+    wasm_generate_svg((void*)text, fonts, num_fonts, (void*)color, NULL, (void*)out, sizeof(out));
     printf("%s\n", out);
-    free(font);
+    for (unsigned int i = 0; i < num_fonts; i++)
+        munmap((void*)fonts[i].data, fonts[i].len);
     return 0;
 }
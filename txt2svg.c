@@ -6,6 +6,15 @@
     #define STBTT_malloc(x,u)  (malloc(x))
     #define STBTT_free(x,u)    (free(x))
     #define WASM_EXPORT
+
+// Caches that outlive a single request live on the regular heap natively.
+static void* persist_alloc(uint32_t sz) {
+    return calloc(1, sz);
+}
+
+static void persist_release(void *p, uint32_t sz) {
+    free(p);
+}
 #else
 // Basic type definitions to avoid standard library dependencies
 #ifndef NULL
@@ -188,6 +197,11 @@ static unsigned int stbtt_strlen(const char* str) {
 extern uint8_t __heap_base;
 static uint32_t heap_ptr = 0;
 
+// Persistent allocations (caches that outlive a request) are carved from
+// the top of linear memory downwards, so wasm_reset_heap never reclaims
+// them and the per-request heap can't grow into them.
+static uint32_t persist_ptr = 0;
+
 WASM_EXPORT
 void wasm_reset_heap() {
     heap_ptr = (uint32_t)&__heap_base;
@@ -195,11 +209,28 @@ void wasm_reset_heap() {
 
 WASM_EXPORT
 uint32_t wasm_alloc(uint32_t sz) {
-    uint32_t p = heap_ptr;
-    heap_ptr += sz;
+    // 8-byte aligned so font packs and structs can be read in place
+    uint32_t p = (heap_ptr + 7) & ~7u;
+    if (persist_ptr && p + sz > persist_ptr) return 0;
+    heap_ptr = p + sz;
     return p;
 }
 
+static void* persist_alloc(uint32_t sz) {
+    if (!persist_ptr) persist_ptr = __builtin_wasm_memory_size(0) * 65536;
+    sz = (sz + 7) & ~7u;
+    if (persist_ptr - sz < heap_ptr) return NULL;
+    persist_ptr -= sz;
+    // may overlap memory a previous request used as scratch
+    return stbtt_memset((void*)persist_ptr, 0, sz);
+}
+
+// Gives back the most recent persist_alloc of sz bytes, for callers that
+// fail after allocating; anything older stays allocated.
+static void persist_release(void *p, uint32_t sz) {
+    if ((uint32_t)p == persist_ptr) persist_ptr += (sz + 7) & ~7u;
+}
+
 #endif // __wasm__
 
 
@@ -264,165 +295,5863 @@ static uint32_t write_int(char *o, uint32_t n, int v) {
     return n;
 }
 
-static uint32_t write_float(char *o, uint32_t n, float f) {
+static void put16(uint8_t *p, uint32_t v) { p[0] = v >> 8; p[1] = v; }
+static void put32(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static uint32_t get16(const uint8_t *p) { return (uint32_t)p[0] << 8 | p[1]; }
+static uint32_t get32(const uint8_t *p) { return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+static uint32_t table_checksum(const uint8_t *p, uint32_t len) {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < len; i += 4)
+        sum += ttULONG((stbtt_uint8*)p + i);
+    return sum;
+}
+
+// FNV-1a, continuing from h; hash_bytes starts a new hash
+static uint32_t hash_update(uint32_t h, const uint8_t *p, uint32_t n) {
+    while (n--) h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+static uint32_t hash_bytes(const uint8_t *p, uint32_t n) {
+    return hash_update(2166136261u, p, n);
+}
+
+// Fixed-point with an explicit number of decimals, truncated
+static uint32_t write_fixed(char *o, uint32_t n, float f, int decimals) {
+    int mul = 1;
+    for (int i = 0; i < decimals; i++) mul *= 10;
+    if (f < 0) { o[n++]='-'; f=-f; }
     int i = (int)f;
     n = write_int(o, n, i);
+    if (!decimals) return n;
     o[n++]='.';
-    int frac = (int)((f - i) * 1000);
-    if (frac < 0) frac = -frac;
-    if (frac < 100) o[n++]='0';
-    if (frac < 10)  o[n++]='0';
+    int frac = (int)((f - i) * mul);
+    for (int d = mul / 10; d > 1 && frac < d; d /= 10) o[n++]='0';
     return write_int(o, n, frac);
 }
 
-// ---------------- main ----------------
+// xxHash32 (seed 0) of a buffer still being written: update consumes the
+// 16-byte stripes completed so far, while they're in cache, and digest
+// finishes off the rest
+typedef struct {
+    uint32_t v[4];
+    uint32_t pos; // bytes consumed, whole stripes
+} xxh32_state;
+
+#define XXH_P1 2654435761u
+#define XXH_P2 2246822519u
+#define XXH_P3 3266489917u
+#define XXH_P4 668265263u
+#define XXH_P5 374761393u
+
+static uint32_t rotl32(uint32_t x, int r) { return x << r | x >> (32 - r); }
+static uint32_t get32le(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static void xxh32_init(xxh32_state *s) {
+    s->v[0] = XXH_P1 + XXH_P2;
+    s->v[1] = XXH_P2;
+    s->v[2] = 0;
+    s->v[3] = 0 - XXH_P1;
+    s->pos = 0;
+}
+
+static void xxh32_update(xxh32_state *s, const uint8_t *p, uint32_t len) {
+    for (; s->pos + 16 <= len; s->pos += 16)
+        for (int k = 0; k < 4; k++)
+            s->v[k] = rotl32(s->v[k] + get32le(p + s->pos + 4 * k) * XXH_P2, 13) * XXH_P1;
+}
+
+static uint32_t xxh32_digest(xxh32_state *s, const uint8_t *p, uint32_t len) {
+    xxh32_update(s, p, len);
+    uint32_t h = len < 16 ? XXH_P5
+               : rotl32(s->v[0], 1) + rotl32(s->v[1], 7) + rotl32(s->v[2], 12) + rotl32(s->v[3], 18);
+    h += len;
+    uint32_t i = s->pos;
+    for (; i + 4 <= len; i += 4) h = rotl32(h + get32le(p + i) * XXH_P3, 17) * XXH_P4;
+    for (; i < len; i++) h = rotl32(h + p[i] * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 15;
+    h *= XXH_P2;
+    h ^= h >> 13;
+    h *= XXH_P3;
+    return h ^ h >> 16;
+}
+
+// ---------------- lazy fonts ----------------
+// Large fonts (CJK faces run to tens of megabytes) don't have to be copied
+// into WASM memory to be used. A lazily opened font reads its table
+// directory and the tables layout needs up front through a synchronous
+// random-access reader supplied by the host, and builds a sparse TTF from
+// them in persistent memory. glyf stays in the source: glyph records are
+// fetched one at a time on first use and kept for later requests.
+
+#ifdef __wasm__
+// Provided by the host: copies up to len bytes at offset of source into
+// dst and returns how many were copied.
+__attribute__((import_module("env"), import_name("txt2svg_read")))
+uint32_t txt2svg_read(uint32_t source, uint32_t offset, uint32_t len, void *dst);
+#else
+static uint32_t (*lazy_reader)(uint32_t source, uint32_t offset, uint32_t len, void *dst);
+
+void txt2svg_set_reader(uint32_t (*fn)(uint32_t source, uint32_t offset, uint32_t len, void *dst)) {
+    lazy_reader = fn;
+}
+
+static uint32_t txt2svg_read(uint32_t source, uint32_t offset, uint32_t len, void *dst) {
+    return lazy_reader ? lazy_reader(source, offset, len, dst) : 0;
+}
+#endif
+
+#define MAX_LAZY_FONTS 8
+#define LAZY_GLYPH_BITS 10
+#define LAZY_GLYPH_SLOTS (1 << LAZY_GLYPH_BITS)
+
+typedef struct {
+    const uint8_t *data; // NULL marks an unused slot
+    uint32_t glyph;
+} lazy_glyph;
+
+typedef struct {
+    uint32_t source;
+    uint32_t glyf_off, glyf_len; // glyf table in the source
+    uint8_t *font;               // sparse TTF
+    uint32_t font_len;
+    lazy_glyph *glyphs;
+} lazy_font;
+
+static lazy_font lazy_fonts[MAX_LAZY_FONTS];
+static int num_lazy_fonts = 0;
+
+// Must be called after every stbtt_InitFont: points userdata at the lazy
+// font the data belongs to, or clears it.
+static void lazy_attach(stbtt_fontinfo *font) {
+    font->userdata = NULL;
+    for (int i = 0; i < num_lazy_fonts; i++)
+        if (lazy_fonts[i].font == font->data) font->userdata = &lazy_fonts[i];
+}
+
+static const uint8_t* lazy_fetch(lazy_font *lf, int glyph, uint32_t start, uint32_t len) {
+    if (start > lf->glyf_len || len > lf->glyf_len - start) return NULL;
+
+    uint32_t i = ((uint32_t)glyph * 2654435761u) >> (32 - LAZY_GLYPH_BITS);
+    lazy_glyph *slot = NULL;
+    for (int probe = 0; probe < LAZY_GLYPH_SLOTS; probe++, i = (i + 1) & (LAZY_GLYPH_SLOTS - 1)) {
+        lazy_glyph *e = &lf->glyphs[i];
+        if (e->data && e->glyph == (uint32_t)glyph) return e->data;
+        if (!e->data) { slot = e; break; }
+    }
+
+    // once the cache or persistent memory is full, glyphs are fetched into
+    // per-request scratch instead
+    uint8_t *p = slot ? persist_alloc(len) : NULL;
+    if (!p) {
+        slot = NULL;
+        p = (uint8_t*)STBTT_malloc(len, 0);
+        if (!p) return NULL;
+    }
+    if (txt2svg_read(lf->source, lf->glyf_off + start, len, p) != len) {
+        if (slot) persist_release(p, len);
+        else STBTT_free(p, 0);
+        return NULL;
+    }
+    if (slot) {
+        slot->data = p;
+        slot->glyph = (uint32_t)glyph;
+    }
+    return p;
+}
+
+// A glyph's record in the glyf table and its length, or NULL for glyphs
+// with no outline.
+static const uint8_t* glyf_data(const stbtt_fontinfo *font, int glyph, uint32_t *len) {
+    int g = stbtt__GetGlyfOffset(font, glyph);
+    if (g < 0) return NULL;
+    uint32_t start = (uint32_t)g - font->glyf;
+    uint32_t end = font->indexToLocFormat == 0
+        ? ttUSHORT(font->data + font->loca + glyph*2 + 2) * 2
+        : ttULONG(font->data + font->loca + glyph*4 + 4);
+    if (end <= start) return NULL;
+    *len = end - start;
+    if (font->userdata)
+        return lazy_fetch((lazy_font*)font->userdata, glyph, start, *len);
+    return font->data + font->glyf + start;
+}
+
+// Opens a font through the host reader. source is the host's handle for
+// it and size its length in bytes. Returns the sparse TTF, which is then
+// passed to wasm_generate_svg like any other font, or NULL if the font is
+// not a glyf-flavoured TrueType font or memory ran out. Opening the same
+// source again returns the font already built for it.
 WASM_EXPORT
-uint32_t wasm_generate_svg(
-    void* text_ptr,
-    void* font_ptr,
-    uint32_t font_size,
-    void* color_ptr,
-    void* out_ptr,
-    uint32_t out_max
-) {
-    char *text = (char*)text_ptr;
-    unsigned char *font_data = (unsigned char*)font_ptr;
-    char *color = (char*)color_ptr;
-    char *out = (char*)out_ptr;
+void* wasm_lazy_font_open(uint32_t source, uint32_t size) {
+    // glyf must stay last: it is the one table left in the source
+    static const char tags[][5] = { "cmap", "head", "hhea", "hmtx", "loca", "maxp", "kern", "GPOS",
+                                    "GSUB", "GDEF", "glyf" };
+    enum { NUM_TAGS = sizeof(tags) / sizeof(tags[0]), NUM_REQUIRED = 6 };
+    uint32_t off[NUM_TAGS], len[NUM_TAGS], sum[NUM_TAGS];
 
-    char *drawBuf = out + 256;
-    uint32_t drawBufSize = out_max - 256;
-    uint32_t drawOff = 0;
+    for (int i = 0; i < num_lazy_fonts; i++)
+        if (lazy_fonts[i].source == source) return lazy_fonts[i].font;
+    if (num_lazy_fonts == MAX_LAZY_FONTS) return NULL;
 
-    stbtt_fontinfo font;
-    if (!stbtt_InitFont(&font, font_data, 0))
-        return 0;
+    uint8_t head[12];
+    if (txt2svg_read(source, 0, 12, head) != 12 || ttULONG(head) != 0x00010000) return NULL;
+    uint32_t num_tables = ttUSHORT(head + 4);
+    uint8_t *dir = (uint8_t*)STBTT_malloc(16 * num_tables, 0);
+    if (!dir) return NULL;
+    if (txt2svg_read(source, 12, 16 * num_tables, dir) != 16 * num_tables) goto fail;
+
+    uint32_t kept = 0, font_len = 12;
+    for (int t = 0; t < NUM_TAGS; t++) {
+        off[t] = len[t] = sum[t] = 0;
+        for (uint32_t i = 0; i < num_tables; i++) {
+            uint8_t *e = dir + 16 * i;
+            if (!stbtt_tag(e, tags[t])) continue;
+            sum[t] = ttULONG(e + 4);
+            off[t] = ttULONG(e + 8);
+            len[t] = ttULONG(e + 12);
+            break;
+        }
+        if (off[t] > size || len[t] > size - off[t]) goto fail;
+        if (!off[t]) {
+            if (t < NUM_REQUIRED || t == NUM_TAGS - 1) goto fail;
+            continue;
+        }
+        kept++;
+        if (t < NUM_TAGS - 1) font_len += (len[t] + 3) & ~3u;
+    }
+    STBTT_free(dir, 0);
+    // glyf gets an empty table at the very end; stb_truetype only needs
+    // its offset to be non-zero
+    font_len += 16 * kept + 4;
 
-    float scale = stbtt_ScaleForPixelHeight(&font, 64);
+    // the font and its glyph cache are one allocation, given back whole
+    // if the font turns out unreadable
+    uint32_t glyphs_at = (font_len + 7) & ~7u;
+    uint32_t block_len = glyphs_at + LAZY_GLYPH_SLOTS * sizeof(lazy_glyph);
+    uint8_t *font = persist_alloc(block_len);
+    if (!font) return NULL;
+    lazy_glyph *glyphs = (lazy_glyph*)(font + glyphs_at);
 
-    int ascent, descent, gap;
-    stbtt_GetFontVMetrics(&font, &ascent, &descent, &gap);
+    put32(font, 0x00010000);
+    put16(font + 4, kept);
+    uint8_t *e = font + 12;
+    uint32_t at = 12 + 16 * kept;
+    for (int t = 0; t < NUM_TAGS; t++) {
+        if (!off[t]) continue;
+        STBTT_memcpy(e, tags[t], 4);
+        put32(e + 4, sum[t]);
+        if (t == NUM_TAGS - 1) {
+            put32(e + 8, font_len - 4);
+        } else {
+            if (txt2svg_read(source, off[t], len[t], font + at) != len[t]) goto release;
+            put32(e + 8, at);
+            put32(e + 12, len[t]);
+            at += (len[t] + 3) & ~3u;
+        }
+        e += 16;
+    }
 
-    int baseline = (int)(ascent * scale);
+    stbtt_fontinfo info;
+    if (!stbtt_InitFont(&info, font, 0)) goto release;
+
+    lazy_font *lf = &lazy_fonts[num_lazy_fonts++];
+    lf->source = source;
+    lf->glyf_off = off[NUM_TAGS - 1];
+    lf->glyf_len = len[NUM_TAGS - 1];
+    lf->font = font;
+    lf->font_len = font_len;
+    lf->glyphs = glyphs;
+    return font;
 
-    // Track bounding box
-    float min_x = 1e30f, max_x = -1e30f;
-    float min_y = 1e30f, max_y = -1e30f;
+fail:
+    STBTT_free(dir, 0);
+    return NULL;
+release:
+    persist_release(font, block_len);
+    return NULL;
+}
 
-    int pen_x = 10;
+WASM_EXPORT
+uint32_t wasm_lazy_font_len(void *font) {
+    for (int i = 0; i < num_lazy_fonts; i++)
+        if (lazy_fonts[i].font == font) return lazy_fonts[i].font_len;
+    return 0;
+}
 
-    const char *p = text;
-    int prev_glyph = 0;
+// ---------------- variations ----------------
+// Variable TrueType fonts. A var_instance is a point in the font's design
+// space given as normalized axis coordinates (fvar, then avar). Outlines
+// get the gvar deltas that apply there (see glyf_decode), advances the
+// HVAR deltas or, without HVAR, those of the gvar phantom points. Kerning,
+// vertical metric and hinting variations (GPOS, MVAR, cvar) and CFF2
+// outlines are not applied.
 
-    while (*p) {
-        utf8_int32_t codepoint;
-        p = (const char*)utf8codepoint((const utf8_int8_t*)p, &codepoint);
-        int glyph = stbtt_FindGlyphIndex(&font, codepoint);
+#define MAX_VAR_AXES 16
+
+typedef struct {
+    uint32_t gvar, hvar;          // table offsets, 0 when absent
+    int num_axes;                 // 0 for the default instance
+    int16_t coords[MAX_VAR_AXES]; // normalized F2Dot14, in fvar axis order
+} var_instance;
+
+static int var_round(float v) {
+    return STBTT_ifloor(v + 0.5f);
+}
 
-        stbtt_vertex *v;
-        int n = stbtt_GetGlyphShape(&font, glyph, &v);
+// Parses a decimal number such as "700" or "87.5" at *s.
+static float var_parse_number(const char **s) {
+    const char *p = *s;
+    int neg = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    float v = 0, scale = 1;
+    while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    if (*p == '.')
+        for (p++; *p >= '0' && *p <= '9'; p++) v += (*p - '0') * (scale *= 0.1f);
+    *s = p;
+    return neg ? -v : v;
+}
+
+// Maps a user-space value onto [-1, 1] with the axis default at 0, in
+// F2Dot14 units but not yet rounded: like fontTools, coordinates are
+// quantized once, after the avar mapping.
+static float var_normalize(const uint8_t *axis, float v) {
+    float lo = (int32_t)get32(axis + 4) / 65536.0f;
+    float def = (int32_t)get32(axis + 8) / 65536.0f;
+    float hi = (int32_t)get32(axis + 12) / 65536.0f;
+    float n = 0;
+    if (v < def && def > lo) n = ((v < lo ? lo : v) - def) / (def - lo);
+    else if (v > def && hi > def) n = ((v > hi ? hi : v) - def) / (hi - def);
+    return n * 16384;
+}
 
-        // Start a new path for this character
-        if (drawOff + 20 < drawBufSize) {
-            drawOff = write_str(drawBuf, drawOff, "<path fill='");
-            drawOff = write_str(drawBuf, drawOff, color);
-            drawOff = write_str(drawBuf, drawOff, "' d='");
+// Applies an avar segment map (positionMapCount, then from/to pairs).
+static float var_avar_map(const uint8_t *seg, float v) {
+    int count = get16(seg);
+    const uint8_t *m = seg + 2;
+    if (!count) return v;
+    int from0 = (int16_t)get16(m), to0 = (int16_t)get16(m + 2);
+    if (v <= from0) return v + to0 - from0;
+    for (int k = 1; k < count; k++) {
+        int from1 = (int16_t)get16(m + 4*k), to1 = (int16_t)get16(m + 4*k + 2);
+        if (v <= from1) {
+            if (v == from1) return to1;
+            return to0 + (float)(to1 - to0) * (v - from0) / (from1 - from0);
         }
+        from0 = from1;
+        to0 = to1;
+    }
+    return v + to0 - from0;
+}
 
-        for (int j = 0; j < n; j++) {
-            stbtt_vertex *p = &v[j];
+// Resolves a variation spec against the font's fvar table: either axis
+// settings in user units such as "wght=700,wdth=87.5" (':' works as the
+// separator too, unknown axes are ignored) or the name of a named
+// instance such as "Condensed Bold". Returns 1 with v filled in for a
+// non-default instance, 0 for the default instance and -1 when no named
+// instance matches.
+static int var_parse(const stbtt_fontinfo *font, const char *spec, var_instance *v) {
+    v->num_axes = 0;
+    if (!spec || !*spec) return 0;
 
-            float x = pen_x + p->x * scale;
-            float y = baseline - p->y * scale;
+    int is_axes = 0;
+    for (const char *s = spec; *s; s++)
+        if (*s == '=' || *s == ':') is_axes = 1;
 
-            // Update bounding box
-            if (x < min_x) min_x = x;
-            if (x > max_x) max_x = x;
-            if (y < min_y) min_y = y;
-            if (y > max_y) max_y = y;
+    const uint8_t *d = font->data;
+    uint32_t fvar = stbtt__find_table(font->data, font->fontstart, "fvar");
+    int count = fvar ? get16(d + fvar + 8) : 0;
+    if (!count || count > MAX_VAR_AXES) return is_axes ? 0 : -1;
+    const uint8_t *axes = d + fvar + get16(d + fvar + 4);
+    int axis_size = get16(d + fvar + 10);
+    int num_instances = get16(d + fvar + 12), instance_size = get16(d + fvar + 14);
 
-            if (p->type == STBTT_vmove) {
-                if (drawOff + 50 < drawBufSize) {
-                    drawBuf[drawOff++]='M';
-                    drawOff = write_float(drawBuf, drawOff, x);
-                    drawBuf[drawOff++]=' ';
-                    drawOff = write_float(drawBuf, drawOff, y);
-                }
-            }
-            else if (p->type == STBTT_vline) {
-                if (drawOff + 50 < drawBufSize) {
-                    drawBuf[drawOff++]='L';
-                    drawOff = write_float(drawBuf, drawOff, x);
-                    drawBuf[drawOff++]=' ';
-                    drawOff = write_float(drawBuf, drawOff, y);
-                }
+    float user[MAX_VAR_AXES];
+    for (int i = 0; i < count; i++)
+        user[i] = (int32_t)get32(axes + i*axis_size + 8) / 65536.0f;
+
+    if (is_axes) {
+        const char *s = spec;
+        while (*s) {
+            while (*s == ' ') s++;
+            uint32_t tag = 0;
+            int k = 0;
+            for (; *s && *s != '=' && *s != ':'; s++)
+                if (k < 4) tag = tag << 8 | (uint8_t)*s, k++;
+            for (; k < 4; k++) tag = tag << 8 | ' ';
+            if (*s) s++;
+            float value = var_parse_number(&s);
+            for (int i = 0; i < count; i++)
+                if (get32(axes + i*axis_size) == tag) user[i] = value;
+            while (*s && *s != ',') s++;
+            if (*s) s++;
+        }
+    } else {
+        int found = 0, len;
+        for (int i = 0; i < num_instances && !found; i++) {
+            const uint8_t *inst = axes + count*axis_size + i*instance_size;
+            const char *name = stbtt_GetFontNameString(font, &len, STBTT_PLATFORM_ID_MICROSOFT,
+                STBTT_MS_EID_UNICODE_BMP, STBTT_MS_LANG_ENGLISH, get16(inst));
+            if (!name || !stbtt_CompareUTF8toUTF16_bigendian(spec, (int)STBTT_strlen(spec), name, len))
+                continue;
+            for (int k = 0; k < count; k++)
+                user[k] = (int32_t)get32(inst + 4 + 4*k) / 65536.0f;
+            found = 1;
+        }
+        if (!found) return -1;
+    }
+
+    uint32_t avar = stbtt__find_table(font->data, font->fontstart, "avar");
+    const uint8_t *seg = avar && (int)get16(d + avar + 6) == count ? d + avar + 8 : NULL;
+    int active = 0;
+    for (int i = 0; i < count; i++) {
+        float n = var_normalize(axes + i*axis_size, user[i]);
+        if (seg) {
+            n = var_avar_map(seg, n);
+            seg += 2 + 4 * get16(seg);
+        }
+        int c = var_round(n);
+        v->coords[i] = (int16_t)c;
+        active |= c != 0;
+    }
+    if (!active) return 0;
+
+    v->num_axes = count;
+    v->gvar = stbtt__find_table(font->data, font->fontstart, "gvar");
+    v->hvar = stbtt__find_table(font->data, font->fontstart, "HVAR");
+    if (v->gvar && (int)get16(d + v->gvar + 4) != count) v->gvar = 0;
+    return 1;
+}
+
+// Scalar for one axis of a gvar tuple or an item variation region: 1 at
+// the peak, falling linearly to 0 at start and end.
+static float var_axis_scalar(int c, int start, int peak, int end) {
+    if (peak == 0 || c == peak) return 1;
+    if (start > peak || peak > end || (start < 0 && end > 0)) return 1;
+    if (c <= start || c >= end) return 0;
+    return c < peak ? (float)(c - start) / (peak - start) : (float)(end - c) / (end - peak);
+}
+
+// Sum of the deltas of one item of an ItemVariationStore, scaled for v.
+static float ivs_delta(const uint8_t *d, uint32_t ivs, const var_instance *v, uint32_t outer, uint32_t inner) {
+    if (outer >= get16(d + ivs + 6)) return 0;
+    const uint8_t *regions = d + ivs + get32(d + ivs + 2);
+    const uint8_t *ivd = d + ivs + get32(d + ivs + 8 + 4*outer);
+    uint32_t items = get16(ivd), words = get16(ivd + 2), num = get16(ivd + 4);
+    int longs = words & 0x8000;
+    words &= 0x7FFF;
+    int axes = get16(regions), num_regions = get16(regions + 2);
+    if (inner >= items || words > num || axes != v->num_axes) return 0;
+
+    int wsize = longs ? 4 : 2, ssize = longs ? 2 : 1;
+    const uint8_t *row = ivd + 6 + 2*num + inner * (words*wsize + (num - words)*ssize);
+    float sum = 0;
+    for (uint32_t r = 0; r < num; r++) {
+        int delta;
+        if (r < words) {
+            delta = longs ? (int32_t)get32(row) : (int16_t)get16(row);
+            row += wsize;
+        } else {
+            delta = longs ? (int16_t)get16(row) : (int8_t)*row;
+            row += ssize;
+        }
+        int index = get16(ivd + 6 + 2*r);
+        if (!delta || index >= num_regions) continue;
+        const uint8_t *reg = regions + 4 + 6 * axes * index;
+        float scalar = 1;
+        for (int a = 0; a < axes && scalar != 0; a++, reg += 6)
+            scalar *= var_axis_scalar(v->coords[a], (int16_t)get16(reg),
+                (int16_t)get16(reg + 2), (int16_t)get16(reg + 4));
+        sum += scalar * delta;
+    }
+    return sum;
+}
+
+// HVAR advance width delta for glyph.
+static float hvar_advance(const stbtt_fontinfo *font, const var_instance *v, int glyph) {
+    const uint8_t *d = font->data, *hvar = d + v->hvar;
+    uint32_t ivs = v->hvar + get32(hvar + 4), map = get32(hvar + 8);
+    uint32_t outer = 0, inner = (uint32_t)glyph;
+    if (map) {
+        // DeltaSetIndexMap: packed outer/inner indices, last entry repeats
+        const uint8_t *m = hvar + map;
+        uint32_t count = m[0] ? get32(m + 2) : get16(m + 2);
+        const uint8_t *entries = m + (m[0] ? 6 : 4);
+        int size = ((m[1] >> 4) & 3) + 1, bits = (m[1] & 15) + 1;
+        if (!count) return 0;
+        uint32_t i = (uint32_t)glyph < count ? (uint32_t)glyph : count - 1, val = 0;
+        for (int k = 0; k < size; k++) val = val << 8 | entries[i*size + k];
+        outer = val >> bits;
+        inner = val & ((1u << bits) - 1);
+    }
+    return ivs_delta(d, ivs, v, outer, inner);
+}
+
+// Packed point numbers. Sets *count to the number of points, 0 meaning
+// all of them; returns the position after them or NULL.
+static const uint8_t* gvar_points(const uint8_t *p, const uint8_t *end, uint16_t *pts, int max, int *count) {
+    if (p >= end) return NULL;
+    int n = *p++;
+    if (n & 0x80) {
+        if (p >= end) return NULL;
+        n = (n & 0x7F) << 8 | *p++;
+    }
+    if (n > max) return NULL;
+    *count = n;
+    int pt = 0;
+    for (int i = 0; i < n; ) {
+        if (p >= end) return NULL;
+        int ctl = *p++, run = (ctl & 0x7F) + 1, size = ctl & 0x80 ? 2 : 1;
+        if (end - p < run * size) return NULL;
+        for (int k = 0; k < run; k++, p += size)
+            if (i < n) pts[i++] = (uint16_t)(pt += size == 2 ? get16(p) : *p);
+    }
+    return p;
+}
+
+// Packed deltas: runs of zeros, bytes, words or longs.
+static const uint8_t* gvar_read_deltas(const uint8_t *p, const uint8_t *end, float *out, int n) {
+    for (int i = 0; i < n; ) {
+        if (!p || p >= end) return NULL;
+        int ctl = *p++, run = (ctl & 0x3F) + 1;
+        int size = (ctl & 0xC0) == 0xC0 ? 4 : ctl & 0x80 ? 0 : ctl & 0x40 ? 2 : 1;
+        if (end - p < run * size) return NULL;
+        for (int k = 0; k < run; k++, p += size)
+            if (i < n) out[i++] = size == 4 ? (int32_t)get32(p) : size == 2 ? (int16_t)get16(p)
+                                : size == 1 ? (int8_t)*p : 0;
+    }
+    return p;
+}
+
+// Infers deltas for the points of contour [first, last] that a tuple left
+// out by interpolating between the touched points on either side (IUP).
+static void gvar_infer(const int16_t *c, float *d, const uint8_t *touched, int first, int last) {
+    int start = -1;
+    for (int i = first; i <= last && start < 0; i++)
+        if (touched[i]) start = i;
+    if (start < 0) return;
+
+    int prev = start, i = start;
+    do {
+        i = i == last ? first : i + 1;
+        if (!touched[i]) continue;
+        int c1 = c[prev], c2 = c[i];
+        float d1 = d[prev], d2 = d[i];
+        if (c1 > c2) {
+            int t = c1; c1 = c2; c2 = t;
+            float u = d1; d1 = d2; d2 = u;
+        }
+        for (int j = prev == last ? first : prev + 1; j != i; j = j == last ? first : j + 1) {
+            if (c1 == c2) d[j] = d1 == d2 ? d1 : 0;
+            else if (c[j] <= c1) d[j] = d1;
+            else if (c[j] >= c2) d[j] = d2;
+            else d[j] = d1 + (c[j] - c1) * ((d2 - d1) / (c2 - c1));
+        }
+        prev = i;
+    } while (i != start);
+}
+
+// Sums the gvar deltas for glyph at instance v into delta, x then y for
+// each of n points: the glyph's points (or components) followed by its
+// four phantom points. For simple glyphs, xs/ys and ends (the default
+// outline and the glyf endPtsOfContours array) let deltas be inferred for
+// points a tuple leaves out; composites pass ends == NULL. Returns 0 if
+// the glyph has no variation data.
+static int gvar_deltas(const stbtt_fontinfo *font, const var_instance *v, int glyph,
+    const int16_t *xs, const int16_t *ys, const uint8_t *ends, int contours, int n, int16_t *delta) {
+    const uint8_t *gvar = font->data + v->gvar;
+    if (!v->gvar || glyph >= (int)get16(gvar + 12)) return 0;
+    uint32_t start, stop;
+    if (get16(gvar + 14) & 1) {
+        start = get32(gvar + 20 + 4*glyph);
+        stop = get32(gvar + 24 + 4*glyph);
+    } else {
+        start = 2 * get16(gvar + 20 + 2*glyph);
+        stop = 2 * get16(gvar + 22 + 2*glyph);
+    }
+    if (stop <= start) return 0;
+
+    int axes = v->num_axes;
+    const uint8_t *shared_tuples = gvar + get32(gvar + 8);
+    const uint8_t *gv = gvar + get32(gvar + 16) + start, *end = gv + (stop - start);
+    int tuples = get16(gv), shared_count = 0;
+    const uint8_t *hdr = gv + 4, *ser = gv + get16(gv + 2);
+
+    // accumulated x/y, one tuple's packed and expanded deltas, its points
+    float *acc = (float*)STBTT_malloc(n * (6 * sizeof(float) + 2 * sizeof(uint16_t) + 1), 0);
+    if (!acc) return 0;
+    float *px = acc + 2*n, *py = px + n, *tx = py + n, *ty = tx + n;
+    uint16_t *shared = (uint16_t*)(ty + n), *pts = shared + n;
+    uint8_t *touched = (uint8_t*)(pts + n);
+    STBTT_memset(acc, 0, 2 * n * sizeof(float));
+
+    if (tuples & 0x8000)
+        ser = gvar_points(ser, end, shared, n, &shared_count);
+    tuples &= 0x0FFF;
+
+    for (int t = 0; t < tuples && ser; t++) {
+        if (end - hdr < 4) break;
+        uint32_t size = get16(hdr), index = get16(hdr + 2);
+        hdr += 4;
+        const uint8_t *peak = index & 0x8000 ? hdr : shared_tuples + 2 * axes * (index & 0x0FFF);
+        if (index & 0x8000) hdr += 2*axes;
+        const uint8_t *inter = index & 0x4000 ? hdr : NULL;
+        if (inter) hdr += 4*axes;
+        const uint8_t *p = ser, *pend = ser + size;
+        if (pend > end) break;
+        ser = pend;
+
+        float scalar = 1;
+        for (int a = 0; a < axes && scalar != 0; a++) {
+            int pk = (int16_t)get16(peak + 2*a);
+            int lo = inter ? (int16_t)get16(inter + 2*a) : pk < 0 ? pk : 0;
+            int hi = inter ? (int16_t)get16(inter + 2*axes + 2*a) : pk > 0 ? pk : 0;
+            scalar *= var_axis_scalar(v->coords[a], lo, pk, hi);
+        }
+        if (scalar == 0) continue;
+
+        const uint16_t *use = shared;
+        int count = shared_count;
+        if (index & 0x2000) {
+            p = gvar_points(p, pend, pts, n, &count);
+            use = pts;
+        }
+        int m = count ? count : n;
+        p = gvar_read_deltas(p, pend, px, m);
+        if (!gvar_read_deltas(p, pend, py, m)) continue;
+
+        if (!count) {
+            for (int i = 0; i < n; i++) {
+                acc[2*i] += scalar * px[i];
+                acc[2*i+1] += scalar * py[i];
             }
-            else if (p->type == STBTT_vcurve) {
-                if (drawOff + 100 < drawBufSize) {
-                    drawBuf[drawOff++]='Q';
-                    drawOff = write_float(drawBuf, drawOff,
-                        pen_x + p->cx * scale);
-                    drawBuf[drawOff++]=' ';
-                    drawOff = write_float(drawBuf, drawOff,
-                        baseline - p->cy * scale);
-                    drawBuf[drawOff++]=' ';
-                    drawOff = write_float(drawBuf, drawOff, x);
-                    drawBuf[drawOff++]=' ';
-                    drawOff = write_float(drawBuf, drawOff, y);
+            continue;
+        }
+        STBTT_memset(touched, 0, n);
+        STBTT_memset(tx, 0, 2 * n * sizeof(float));
+        for (int i = 0; i < count; i++) {
+            if (use[i] >= n) continue;
+            tx[use[i]] = px[i];
+            ty[use[i]] = py[i];
+            touched[use[i]] = 1;
+        }
+        for (int c = 0, first = 0; ends && c < contours; c++) {
+            int last = get16(ends + 2*c);
+            if (last >= n - 4 || last < first) break;
+            gvar_infer(xs, tx, touched, first, last);
+            gvar_infer(ys, ty, touched, first, last);
+            first = last + 1;
+        }
+        for (int i = 0; i < n; i++) {
+            acc[2*i] += scalar * tx[i];
+            acc[2*i+1] += scalar * ty[i];
+        }
+    }
+
+    for (int i = 0; i < 2*n; i++)
+        delta[i] = (int16_t)var_round(acc[i]);
+    STBTT_free(acc, 0);
+    return 1;
+}
+
+// ---------------- glyf ----------------
+// Streams TrueType outlines straight from the glyf table into a pen,
+// computing implied on-curve midpoints on the fly instead of going through
+// stbtt_GetGlyphShape's temporary stbtt_vertex array. The emitted sequence
+// is identical to what stbtt_GetGlyphShape would produce.
+
+typedef struct glyph_pen glyph_pen;
+struct glyph_pen {
+    void (*emit)(glyph_pen *pen, int type, int x, int y, int cx, int cy);
+};
+
+#define GLYF_MAX_DEPTH 8
+
+typedef struct {
+    const stbtt_uint8 *flags, *xs, *ys;
+    const int16_t *delta; // x, y per point for a variable font instance, or NULL
+    stbtt_uint8 flag, repeat;
+    int rx, ry;           // as stored
+    int x, y;             // with the instance deltas applied
+} glyf_cursor;
+
+static void glyf_cursor_next(glyf_cursor *c) {
+    if (c->repeat) {
+        c->repeat--;
+    } else {
+        c->flag = *c->flags++;
+        if (c->flag & 8) c->repeat = *c->flags++;
+    }
+    if (c->flag & 2) {
+        stbtt_int16 dx = *c->xs++;
+        c->rx += (c->flag & 16) ? dx : -dx;
+    } else if (!(c->flag & 16)) {
+        c->rx += (stbtt_int16)(c->xs[0]*256 + c->xs[1]);
+        c->xs += 2;
+    }
+    if (c->flag & 4) {
+        stbtt_int16 dy = *c->ys++;
+        c->ry += (c->flag & 32) ? dy : -dy;
+    } else if (!(c->flag & 32)) {
+        c->ry += (stbtt_int16)(c->ys[0]*256 + c->ys[1]);
+        c->ys += 2;
+    }
+    c->x = c->rx = (stbtt_int16)c->rx;
+    c->y = c->ry = (stbtt_int16)c->ry;
+    if (c->delta) {
+        c->x += c->delta[0];
+        c->y += c->delta[1];
+        c->delta += 2;
+    }
+}
+
+static void glyf_close_contour(glyph_pen *pen, int was_off, int start_off,
+    int sx, int sy, int scx, int scy, int cx, int cy) {
+    if (start_off) {
+        if (was_off)
+            pen->emit(pen, STBTT_vcurve, (cx+scx)>>1, (cy+scy)>>1, cx, cy);
+        pen->emit(pen, STBTT_vcurve, sx, sy, scx, scy);
+    } else if (was_off) {
+        pen->emit(pen, STBTT_vcurve, sx, sy, cx, cy);
+    } else {
+        pen->emit(pen, STBTT_vline, sx, sy, 0, 0);
+    }
+}
+
+// Positions a cursor before the first point of a simple glyph and sets *n
+// to its number of points.
+static glyf_cursor glyf_simple_cursor(const stbtt_uint8 *g, int contours, const int16_t *delta, int *n) {
+    const stbtt_uint8 *ends = g + 10;
+    int ins = ttUSHORT((stbtt_uint8*)ends + contours*2);
+    const stbtt_uint8 *p = ends + contours*2 + 2 + ins;
+    *n = 1 + ttUSHORT((stbtt_uint8*)ends + contours*2 - 2);
+
+    // The flag, x and y arrays are stored back to back, so one scan over
+    // the flags tells us where the x and y streams start.
+    const stbtt_uint8 *f = p;
+    int xbytes = 0;
+    for (int i = 0; i < *n; ) {
+        stbtt_uint8 flag = *f++;
+        int count = 1;
+        if (flag & 8) count += *f++;
+        if (flag & 2) xbytes += count;
+        else if (!(flag & 16)) xbytes += 2*count;
+        i += count;
+    }
+
+    glyf_cursor c = { p, f, f + xbytes, delta, 0, 0, 0, 0, 0, 0 };
+    return c;
+}
+
+static void glyf_decode_simple(const stbtt_uint8 *g, int contours, const int16_t *delta, glyph_pen *pen) {
+    const stbtt_uint8 *ends = g + 10;
+    int n;
+    glyf_cursor c = glyf_simple_cursor(g, contours, delta, &n);
+    int next_move = 0, j = 0, was_off = 0, start_off = 0;
+    int sx = 0, sy = 0, scx = 0, scy = 0, cx = 0, cy = 0;
+
+    for (int i = 0; i < n; i++) {
+        glyf_cursor_next(&c);
+        int x = c.x, y = c.y, on = c.flag & 1;
+
+        if (next_move == i) {
+            if (i != 0)
+                glyf_close_contour(pen, was_off, start_off, sx, sy, scx, scy, cx, cy);
+
+            start_off = !on;
+            if (start_off) {
+                // Contour starts off-curve: find an on-curve start point and
+                // remember the control point for when we wrap around.
+                scx = x;
+                scy = y;
+                glyf_cursor peek = c;
+                if (i + 1 < n) glyf_cursor_next(&peek);
+                if (!(peek.flag & 1)) {
+                    sx = (x + peek.x) >> 1;
+                    sy = (y + peek.y) >> 1;
+                } else {
+                    sx = peek.x;
+                    sy = peek.y;
+                    c = peek;
+                    i++;
                 }
+            } else {
+                sx = x;
+                sy = y;
             }
+            pen->emit(pen, STBTT_vmove, sx, sy, 0, 0);
+            was_off = 0;
+            next_move = 1 + ttUSHORT((stbtt_uint8*)ends + j*2);
+            j++;
+        } else if (!on) {
+            // two off-curve points in a row imply an on-curve midpoint
+            if (was_off)
+                pen->emit(pen, STBTT_vcurve, (cx+x)>>1, (cy+y)>>1, cx, cy);
+            cx = x;
+            cy = y;
+            was_off = 1;
+        } else {
+            if (was_off)
+                pen->emit(pen, STBTT_vcurve, x, y, cx, cy);
+            else
+                pen->emit(pen, STBTT_vline, x, y, 0, 0);
+            was_off = 0;
         }
+    }
+    glyf_close_contour(pen, was_off, start_off, sx, sy, scx, scy, cx, cy);
+}
+
+// Applies a composite component's matrix before forwarding to the parent
+// pen. Rounding follows stb_truetype so nested components land on the
+// same coordinates.
+typedef struct {
+    glyph_pen pen;
+    glyph_pen *next;
+    float mtx[6];
+    float m, n;
+} glyf_xform_pen;
 
-        // Close the current character's path
-        if (drawOff + 10 < drawBufSize) {
-            drawOff = write_str(drawBuf, drawOff, "'/>");
+static void glyf_xform_emit(glyph_pen *pen, int type, int x, int y, int cx, int cy) {
+    glyf_xform_pen *t = (glyf_xform_pen*)pen;
+    const float *mtx = t->mtx;
+    short px = (short)x, py = (short)y, pcx = (short)cx, pcy = (short)cy;
+    t->next->emit(t->next, type,
+        (short)(t->m * (mtx[0]*px + mtx[2]*py + mtx[4])),
+        (short)(t->n * (mtx[1]*px + mtx[3]*py + mtx[5])),
+        (short)(t->m * (mtx[0]*pcx + mtx[2]*pcy + mtx[4])),
+        (short)(t->n * (mtx[1]*pcx + mtx[3]*pcy + mtx[5])));
+}
+
+static int glyf_component_count(const stbtt_uint8 *data) {
+    const stbtt_uint8 *comp = data + 10;
+    int count = 0, flags;
+    do {
+        flags = ttUSHORT((stbtt_uint8*)comp);
+        comp += 4 + (flags & 1 ? 4 : 2) + (flags & 8 ? 2 : flags & 64 ? 4 : flags & 128 ? 8 : 0);
+        count++;
+    } while (flags & 32);
+    return count;
+}
+
+// gvar deltas of glyph (data is its glyf record, or NULL for a glyph
+// without outline) at instance var, in scratch memory, or NULL when the
+// glyph doesn't vary. *n is set to the number of points, phantom points
+// included.
+static int16_t* glyf_var_deltas(const stbtt_fontinfo *font, const var_instance *var, int glyph,
+    const stbtt_uint8 *data, int *n) {
+    int contours = data ? ttSHORT((stbtt_uint8*)data) : 0, points = 0;
+    int16_t *xs = NULL;
+    if (contours > 0) {
+        glyf_cursor c = glyf_simple_cursor(data, contours, NULL, &points);
+        xs = (int16_t*)STBTT_malloc(4 * points, 0);
+        if (!xs) return NULL;
+        for (int i = 0; i < points; i++) {
+            glyf_cursor_next(&c);
+            xs[i] = (int16_t)c.x;
+            xs[points + i] = (int16_t)c.y;
         }
+    } else if (contours < 0) {
+        points = glyf_component_count(data);
+    }
 
-        stbtt_FreeShape(&font, v);
+    *n = points + 4;
+    int16_t *delta = (int16_t*)STBTT_malloc(4 * *n, 0);
+    if (delta && !gvar_deltas(font, var, glyph, xs, xs + points, contours > 0 ? data + 10 : NULL,
+                              contours, *n, delta)) {
+        STBTT_free(delta, 0);
+        delta = NULL;
+    }
+    STBTT_free(xs, 0);
+    return delta;
+}
 
-        int ax;
-        stbtt_GetGlyphHMetrics(&font, glyph, &ax, 0);
-        pen_x += (int)(ax * scale);
+// Change in glyph's advance width at instance var: from HVAR when the
+// font has it, otherwise from the gvar deltas of the phantom points.
+static int var_advance_delta(const stbtt_fontinfo *font, const var_instance *var, int glyph) {
+    if (var->hvar) return var_round(hvar_advance(font, var, glyph));
+    uint32_t len;
+    int n;
+    int16_t *delta = glyf_var_deltas(font, var, glyph, glyf_data(font, glyph, &len), &n);
+    if (!delta) return 0;
+    int dx = delta[2*(n-3)] - delta[2*(n-4)];
+    STBTT_free(delta, 0);
+    return dx;
+}
+
+// Decodes glyph into pen, at instance var when it isn't NULL.
+static void glyf_decode(const stbtt_fontinfo *font, const var_instance *var, int glyph, glyph_pen *pen, int depth) {
+    uint32_t len;
+    const stbtt_uint8 *data = depth > GLYF_MAX_DEPTH ? NULL : glyf_data(font, glyph, &len);
+    if (!data) return;
+
+    int contours = ttSHORT((stbtt_uint8*)data), n;
+    if (contours == 0) return;
+    int16_t *delta = var ? glyf_var_deltas(font, var, glyph, data, &n) : NULL;
+
+    if (contours > 0) {
+        glyf_decode_simple(data, contours, delta, pen);
+        STBTT_free(delta, 0);
+        return;
+    }
+
+    stbtt_uint8 *comp = (stbtt_uint8*)data + 10;
+    int more = 1;
+    for (int k = 0; more; k++) {
+        stbtt_uint16 flags = ttSHORT(comp); comp += 2;
+        stbtt_uint16 gidx = ttSHORT(comp); comp += 2;
+        glyf_xform_pen t = { { glyf_xform_emit }, pen, {1,0,0,1,0,0}, 0, 0 };
+        float *mtx = t.mtx;
 
-        // Apply kerning between current and next glyph
-        if (*p) {
-            utf8_int32_t next_codepoint;
-            const char *next_ptr = (const char*)utf8codepoint((const utf8_int8_t*)p, &next_codepoint);
-            int next_glyph = stbtt_FindGlyphIndex(&font, next_codepoint);
-            pen_x += (int)(scale * stbtt_GetGlyphKernAdvance(&font, glyph, next_glyph));
+        if (flags & 2) { // XY values
+            if (flags & 1) {
+                mtx[4] = ttSHORT(comp); comp += 2;
+                mtx[5] = ttSHORT(comp); comp += 2;
+            } else {
+                mtx[4] = ttCHAR(comp); comp += 1;
+                mtx[5] = ttCHAR(comp); comp += 1;
+            }
+            if (delta) {
+                mtx[4] += delta[2*k];
+                mtx[5] += delta[2*k+1];
+            }
         }
+        if (flags & (1<<3)) { // WE_HAVE_A_SCALE
+            mtx[0] = mtx[3] = ttSHORT(comp)/16384.0f; comp += 2;
+            mtx[1] = mtx[2] = 0;
+        } else if (flags & (1<<6)) { // WE_HAVE_AN_X_AND_YSCALE
+            mtx[0] = ttSHORT(comp)/16384.0f; comp += 2;
+            mtx[1] = mtx[2] = 0;
+            mtx[3] = ttSHORT(comp)/16384.0f; comp += 2;
+        } else if (flags & (1<<7)) { // WE_HAVE_A_TWO_BY_TWO
+            mtx[0] = ttSHORT(comp)/16384.0f; comp += 2;
+            mtx[1] = ttSHORT(comp)/16384.0f; comp += 2;
+            mtx[2] = ttSHORT(comp)/16384.0f; comp += 2;
+            mtx[3] = ttSHORT(comp)/16384.0f; comp += 2;
+        }
+        t.m = (float)STBTT_sqrt(mtx[0]*mtx[0] + mtx[1]*mtx[1]);
+        t.n = (float)STBTT_sqrt(mtx[2]*mtx[2] + mtx[3]*mtx[3]);
+
+        glyf_decode(font, var, gidx, &t.pen, depth + 1);
+        more = flags & (1<<5);
     }
+    STBTT_free(delta, 0);
+}
 
-    // Calculate dimensions from bounding box
-    int width = (int)(max_x - min_x) + 20; // Add padding
-    int height = (int)(max_y - min_y) + 20;
-    int viewBox_x = (int)min_x - 10;
-    int viewBox_y = (int)min_y - 10;
+// ---------------- outline ----------------
+// Compact outline storage for cached and precomputed glyphs. Instead of
+// stbtt_vertex's 14-byte records, an outline keeps one command byte per
+// segment plus separate packed int16 x and y streams. Moves and lines
+// consume one point, curves two (control point first). The arrays follow
+// the header directly, so an outline is a single position-independent
+// block: 4 + 4*npts + ncmds bytes.
+typedef struct {
+    uint16_t ncmds;
+    uint16_t npts;
+    // int16_t xs[npts]; int16_t ys[npts]; uint8_t cmds[ncmds];
+} outline;
 
-    uint32_t off = 0;
+static uint32_t outline_size(uint32_t ncmds, uint32_t npts) {
+    return sizeof(outline) + 4*npts + ncmds;
+}
 
-    // Write complete SVG header with actual dimensions
-    off = write_str(out, off, "<svg xmlns='http://www.w3.org/2000/svg'");
-    off = write_str(out, off, " width='");
-    off = write_int(out, off, width);
-    off = write_str(out, off, "' height='");
-    off = write_int(out, off, height);
-    off = write_str(out, off, "' viewBox='");
-    off = write_int(out, off, viewBox_x);
-    off = write_str(out, off, " ");
-    off = write_int(out, off, viewBox_y);
-    off = write_str(out, off, " ");
-    off = write_int(out, off, width);
-    off = write_str(out, off, " ");
-    off = write_int(out, off, height);
-    off = write_str(out, off, "'><g>");
+static int16_t* outline_xs(const outline *o) { return (int16_t*)(o + 1); }
+static int16_t* outline_ys(const outline *o) { return outline_xs(o) + o->npts; }
+static uint8_t* outline_cmds(const outline *o) { return (uint8_t*)(outline_ys(o) + o->npts); }
 
-    // Copy path data from drawBuf (now contains individual <path> elements)
-    for (uint32_t i = 0; i < drawOff && off + 1 < out_max; i++) {
-        out[off++] = drawBuf[i];
+// Counts commands and points while o is NULL, fills o otherwise.
+typedef struct {
+    glyph_pen pen;
+    outline *o;
+    uint32_t ncmds, npts;
+} outline_pen;
+
+static void outline_pen_emit(glyph_pen *pen, int type, int x, int y, int cx, int cy) {
+    outline_pen *r = (outline_pen*)pen;
+    if (r->o) {
+        int16_t *xs = outline_xs(r->o), *ys = outline_ys(r->o);
+        if (type == STBTT_vcurve) {
+            xs[r->npts] = (int16_t)cx;
+            ys[r->npts] = (int16_t)cy;
+            r->npts++;
+        }
+        xs[r->npts] = (int16_t)x;
+        ys[r->npts] = (int16_t)y;
+        outline_cmds(r->o)[r->ncmds] = (uint8_t)type;
+    } else if (type == STBTT_vcurve) {
+        r->npts++;
     }
+    r->npts++;
+    r->ncmds++;
+}
 
-    off = write_str(out, off, "</g></svg>");
-    out[off]=0;
-    return off;
+// Emits ncmds commands of an outline held as separate arrays
+static void outline_emit_arrays(const int16_t *xs, const int16_t *ys, const uint8_t *cmds,
+    uint32_t ncmds, glyph_pen *pen) {
+    for (uint32_t i = 0, k = 0; i < ncmds; i++) {
+        if (cmds[i] == STBTT_vcurve) {
+            pen->emit(pen, STBTT_vcurve, xs[k+1], ys[k+1], xs[k], ys[k]);
+            k += 2;
+        } else {
+            pen->emit(pen, cmds[i], xs[k], ys[k], 0, 0);
+            k++;
+        }
+    }
+}
+
+static void outline_emit(const outline *o, glyph_pen *pen) {
+    outline_emit_arrays(outline_xs(o), outline_ys(o), outline_cmds(o), o->ncmds, pen);
+}
+
+// Decodes a glyf outline, at instance var when it isn't NULL, into a
+// freshly allocated persistent outline: a counting pass sizes it, a second
+// pass fills it in place.
+static outline* outline_build(const stbtt_fontinfo *font, const var_instance *var, int glyph) {
+    outline_pen r = { { outline_pen_emit }, NULL, 0, 0 };
+    glyf_decode(font, var, glyph, &r.pen, 0);
+    if (r.ncmds > 0xFFFF || r.npts > 0xFFFF) return NULL;
+
+    outline *o = persist_alloc(outline_size(r.ncmds, r.npts));
+    if (!o) return NULL;
+    o->ncmds = (uint16_t)r.ncmds;
+    o->npts = (uint16_t)r.npts;
+
+    r.o = o;
+    r.ncmds = r.npts = 0;
+    glyf_decode(font, var, glyph, &r.pen, 0);
+    return o;
+}
+
+// ---------------- face cache ----------------
+// Fonts are copied in afresh on every request, so derived data that should
+// survive between requests is keyed by a fingerprint of the font (the head
+// table's whole-file checksum adjustment and the glyph count) rather than
+// by its address. Each instance of a variable font gets a face cache of
+// its own, keyed by the font fingerprint mixed with its coordinates.
+
+#define MAX_FACES 16
+#define COMPOSITE_BITS 9
+#define COMPOSITE_SLOTS (1 << COMPOSITE_BITS)
+
+// Composite glyphs (most accented Latin letters) flattened once into a
+// single outline with every component matrix already applied. For
+// variable font instances every glyph is cached, with its deltas applied.
+typedef struct {
+    const outline *o; // NULL marks an unused slot
+    uint16_t glyph;
+} composite_entry;
+
+typedef struct {
+    uint32_t fingerprint;
+    composite_entry *composites;
+} face_cache;
+
+static face_cache faces[MAX_FACES];
+static int num_faces = 0;
+
+// Identifies a font to the caches keyed by it: faces, coverage, GSUB plans,
+// the ASCII tables, words and sessions. Hashes the head, hhea and maxp
+// fields stb_truetype reads anyway, and the directory checksums of the
+// tables rendering reads, so that fonts sharing a checkSumAdjustment (0
+// from some tools) and a glyph count (sibling weights) still differ. A
+// lazily opened font keeps the checksums of the tables it copies, so a
+// static font opened lazily matches the font itself.
+static uint32_t font_fingerprint(const stbtt_fontinfo *font) {
+    static const char tags[][5] = { "cmap", "glyf", "loca", "hmtx", "kern", "GDEF", "GPOS",
+                                    "GSUB", "fvar", "avar", "gvar", "HVAR" };
+    const uint8_t *d = font->data;
+    uint32_t h = hash_bytes(d + font->head, 54);
+    h = hash_update(h, d + font->hhea, 36);
+    uint32_t maxp = stbtt__find_table((stbtt_uint8*)d, font->fontstart, "maxp");
+    if (maxp) h = hash_update(h, d + maxp, 6);
+    // in tags order, whatever order the directory lists them in
+    const uint8_t *dir = d + font->fontstart;
+    for (uint32_t t = 0; t < sizeof(tags) / sizeof(tags[0]); t++)
+        for (uint32_t i = 0, n = get16(dir + 4); i < n; i++)
+            if (stbtt_tag(dir + 12 + 16 * i, tags[t])) h = hash_update(h, dir + 12 + 16 * i, 8);
+    return h;
+}
+
+static face_cache* face_cache_for(uint32_t fp) {
+    for (int i = 0; i < num_faces; i++)
+        if (faces[i].fingerprint == fp) return &faces[i];
+
+    if (num_faces == MAX_FACES) return NULL;
+    composite_entry *slots = persist_alloc(COMPOSITE_SLOTS * sizeof(composite_entry));
+    if (!slots) return NULL;
+
+    face_cache *fc = &faces[num_faces++];
+    fc->fingerprint = fp;
+    fc->composites = slots;
+    return fc;
+}
+
+static const composite_entry* composite_lookup(const stbtt_fontinfo *font, face_cache *fc,
+    const var_instance *var, int glyph) {
+    uint32_t i = ((uint32_t)glyph * 2654435761u) >> (32 - COMPOSITE_BITS);
+    for (int probe = 0; probe < COMPOSITE_SLOTS; probe++, i = (i + 1) & (COMPOSITE_SLOTS - 1)) {
+        composite_entry *e = &fc->composites[i];
+        if (e->o && e->glyph == glyph) return e;
+        if (e->o) continue;
+
+        e->o = outline_build(font, var, glyph);
+        if (!e->o) return NULL;
+        e->glyph = (uint16_t)glyph;
+        return e;
+    }
+    return NULL;
+}
+
+// Emits a glyph outline, at instance var when it isn't NULL, into pen.
+// glyf outlines are streamed directly, except composites and instanced
+// glyphs which are served from the face cache when there is one; CFF
+// outlines still go through stb_truetype.
+static void emit_glyph(const stbtt_fontinfo *font, face_cache *fc, const var_instance *var,
+    int glyph, glyph_pen *pen) {
+    if (!font->cff.size) {
+        uint32_t len;
+        const stbtt_uint8 *data;
+        const composite_entry *e;
+        int contours;
+        if (fc && (data = glyf_data(font, glyph, &len)) != NULL &&
+            (contours = ttSHORT((stbtt_uint8*)data)) != 0 && (var || contours < 0) &&
+            (e = composite_lookup(font, fc, var, glyph)) != NULL) {
+            outline_emit(e->o, pen);
+            return;
+        }
+        glyf_decode(font, var, glyph, pen, 0);
+        return;
+    }
+    stbtt_vertex *v;
+    int n = stbtt_GetGlyphShape(font, glyph, &v);
+    for (int i = 0; i < n; i++)
+        pen->emit(pen, v[i].type, v[i].x, v[i].y, v[i].cx, v[i].cy);
+    stbtt_FreeShape(font, v);
+}
+
+// ---------------- pack ----------------
+// Prebaked font pack, produced offline from a TTF by the fontpack tool.
+// Everything layout needs is stored ready to use: a direct Latin-1 glyph
+// table plus sorted codepoint ranges, advances, kerning pairs, glyph boxes
+// and flattened compact outlines. Binding a pack only validates the header
+// and its indexes, there is no table directory walk and no outline
+// decoding.
+//
+// Sections are 4-byte aligned, little-endian and addressed by offsets from
+// the start of the pack, so the same bytes can be mmap'd natively or
+// copied into WASM memory with a single memory.set.
+
+#define PACK_MAGIC   0x50533254u // "T2SP"
+#define PACK_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // total pack size in bytes
+    uint32_t fingerprint;   // font_fingerprint() of the source TTF
+    int16_t  ascent, descent, line_gap, units_per_em;
+    uint32_t num_glyphs;
+    uint32_t num_ranges;
+    uint32_t num_kerns;
+    uint32_t latin_off;     // uint16_t[256], glyphs for U+0000-U+00FF
+    uint32_t ranges_off;    // pack_range[num_ranges], codepoints >= U+0100
+    uint32_t metrics_off;   // pack_metric[num_glyphs]
+    uint32_t boxes_off;     // pack_box[num_glyphs]
+    uint32_t kerns_off;     // pack_kern[num_kerns], sorted by pair
+    uint32_t outlines_off;  // uint32_t[num_glyphs + 1] outline offsets
+} pack_header;
+
+// codepoints first .. first+count-1 map to glyphs glyph .. glyph+count-1
+typedef struct { uint32_t first, count, glyph; } pack_range;
+typedef struct { uint16_t advance; int16_t lsb; } pack_metric;
+typedef struct { int16_t x0, y0, x1, y1; } pack_box;
+typedef struct { uint32_t pair; int32_t value; } pack_kern; // pair = g1 << 16 | g2
+
+static int pack_section_ok(const pack_header *p, uint32_t off, uint32_t count, uint32_t size) {
+    return off % 4 == 0 && off <= p->size && count <= (p->size - off) / size;
+}
+
+static const void* pack_at(const pack_header *p, uint32_t off) {
+    return (const uint8_t*)p + off;
+}
+
+// An outline from offset start up to end must be 2-byte aligned, fit
+// between the two and have as many points as its commands consume.
+static int pack_outline_ok(const pack_header *p, uint32_t start, uint32_t end) {
+    if (start % 2 || end - start < sizeof(outline)) return 0;
+    const outline *o = pack_at(p, start);
+    if (outline_size(o->ncmds, o->npts) > end - start) return 0;
+    const uint8_t *cmds = outline_cmds(o);
+    uint32_t npts = 0;
+    for (uint32_t i = 0; i < o->ncmds; i++)
+        npts += cmds[i] == STBTT_vcurve ? 2 : 1;
+    return npts == o->npts;
 }
+
+// Checks the header and the indexes into the pack: every glyph id the
+// Latin table and the ranges map to, and every outline's extent. Glyph
+// ids are 16-bit, as kerning pairs store them.
+static const pack_header* pack_bind(const uint8_t *data, uint32_t len) {
+    const pack_header *p = (const pack_header*)data;
+    if (((uintptr_t)data & 3) || len < sizeof(pack_header) || p->magic != PACK_MAGIC ||
+        p->version != PACK_VERSION || p->size > len || p->num_glyphs > 0xFFFF)
+        return NULL;
+    if (!pack_section_ok(p, p->latin_off, 256, 2) ||
+        !pack_section_ok(p, p->ranges_off, p->num_ranges, sizeof(pack_range)) ||
+        !pack_section_ok(p, p->metrics_off, p->num_glyphs, sizeof(pack_metric)) ||
+        !pack_section_ok(p, p->boxes_off, p->num_glyphs, sizeof(pack_box)) ||
+        !pack_section_ok(p, p->kerns_off, p->num_kerns, sizeof(pack_kern)) ||
+        !pack_section_ok(p, p->outlines_off, p->num_glyphs + 1, 4))
+        return NULL;
+
+    const uint16_t *latin = pack_at(p, p->latin_off);
+    for (int cp = 0; cp < 256; cp++)
+        if (latin[cp] >= p->num_glyphs && latin[cp] != 0) return NULL;
+    const pack_range *r = pack_at(p, p->ranges_off);
+    for (uint32_t i = 0; i < p->num_ranges; i++)
+        if (r[i].glyph >= p->num_glyphs || r[i].count > p->num_glyphs - r[i].glyph) return NULL;
+
+    const uint32_t *offs = pack_at(p, p->outlines_off);
+    for (uint32_t g = 0; g < p->num_glyphs; g++) {
+        if (offs[g] > offs[g + 1] || offs[g + 1] > p->size) return NULL;
+        if (offs[g] != offs[g + 1] && !pack_outline_ok(p, offs[g], offs[g + 1])) return NULL;
+    }
+    return p;
+}
+
+static int pack_find_glyph(const pack_header *p, int cp) {
+    if (cp >= 0 && cp < 256)
+        return ((const uint16_t*)pack_at(p, p->latin_off))[cp];
+
+    const pack_range *r = pack_at(p, p->ranges_off);
+    uint32_t lo = 0, hi = p->num_ranges;
+    while (lo < hi) {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if ((uint32_t)cp < r[mid].first) hi = mid;
+        else if ((uint32_t)cp - r[mid].first >= r[mid].count) lo = mid + 1;
+        else return r[mid].glyph + ((uint32_t)cp - r[mid].first);
+    }
+    return 0;
+}
+
+static int pack_kern_advance(const pack_header *p, int g1, int g2) {
+    const pack_kern *k = pack_at(p, p->kerns_off);
+    uint32_t pair = (uint32_t)g1 << 16 | (uint32_t)g2;
+    uint32_t lo = 0, hi = p->num_kerns;
+    while (lo < hi) {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if (k[mid].pair < pair) lo = mid + 1;
+        else if (k[mid].pair > pair) hi = mid;
+        else return k[mid].value;
+    }
+    return 0;
+}
+
+static const outline* pack_outline(const pack_header *p, int glyph) {
+    if (glyph < 0 || (uint32_t)glyph >= p->num_glyphs) return NULL;
+    const uint32_t *offs = pack_at(p, p->outlines_off);
+    if (offs[glyph] == offs[glyph + 1]) return NULL;
+    return pack_at(p, offs[glyph]);
+}
+
+// ---------------- inflate ----------------
+// zlib/deflate decoder (RFC 1950/1951) for WOFF tables. Output size is
+// always known up front, so everything decodes into one flat buffer with
+// no sliding window.
+
+typedef struct {
+    const uint8_t *p, *end;
+    uint32_t bits;
+    int nbits;
+    int bad; // set on running out of input or on a corrupt code
+} bit_reader;
+
+// Reads n <= 24 bits, least significant first.
+static uint32_t br_bits(bit_reader *br, int n) {
+    while (br->nbits < n) {
+        uint32_t b = 0;
+        if (br->p < br->end) b = *br->p++;
+        else br->bad = 1;
+        br->bits |= b << br->nbits;
+        br->nbits += 8;
+    }
+    uint32_t v = br->bits & ((1u << n) - 1);
+    br->bits >>= n;
+    br->nbits -= n;
+    return v;
+}
+
+static void br_align(bit_reader *br) {
+    br_bits(br, br->nbits & 7);
+}
+
+// Canonical prefix code, decoded bit by bit. count[0] non-zero marks a
+// code with a single zero-length symbol (Brotli only).
+#define HUFF_MAX_BITS 15
+
+typedef struct {
+    uint16_t count[HUFF_MAX_BITS + 1];
+    uint16_t *symbol;
+} huffman;
+
+static int huff_build(huffman *h, const uint8_t *lengths, uint32_t n) {
+    uint16_t offs[HUFF_MAX_BITS + 1];
+    for (int len = 0; len <= HUFF_MAX_BITS; len++) h->count[len] = 0;
+    for (uint32_t i = 0; i < n; i++) h->count[lengths[i]]++;
+    h->count[0] = 0;
+
+    int left = 1;
+    for (int len = 1; len <= HUFF_MAX_BITS; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0) return 0; // over-subscribed
+    }
+    offs[1] = 0;
+    for (int len = 1; len < HUFF_MAX_BITS; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+    for (uint32_t i = 0; i < n; i++)
+        if (lengths[i]) h->symbol[offs[lengths[i]]++] = (uint16_t)i;
+    return 1;
+}
+
+static int huff_decode(bit_reader *br, const huffman *h) {
+    if (h->count[0]) return h->symbol[0];
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= HUFF_MAX_BITS; len++) {
+        code |= br_bits(br, 1);
+        int count = h->count[len];
+        if (code - count < first) return h->symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    br->bad = 1;
+    return -1;
+}
+
+static const uint16_t inflate_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t inflate_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t inflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t inflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static int inflate_codes(bit_reader *br, const huffman *lit, const huffman *dist,
+    uint8_t *out, uint32_t *pos, uint32_t out_len) {
+    for (;;) {
+        int sym = huff_decode(br, lit);
+        if (sym < 0 || br->bad) return 0;
+        if (sym < 256) {
+            if (*pos >= out_len) return 0;
+            out[(*pos)++] = (uint8_t)sym;
+        } else if (sym == 256) {
+            return 1;
+        } else {
+            sym -= 257;
+            if (sym >= 29) return 0;
+            uint32_t len = inflate_len_base[sym] + br_bits(br, inflate_len_extra[sym]);
+            int d = huff_decode(br, dist);
+            if (d < 0 || d >= 30) return 0;
+            uint32_t back = inflate_dist_base[d] + br_bits(br, inflate_dist_extra[d]);
+            if (back > *pos || len > out_len - *pos) return 0;
+            for (uint32_t i = 0; i < len; i++, (*pos)++)
+                out[*pos] = out[*pos - back];
+        }
+    }
+}
+
+// Inflates a zlib stream that must decode to exactly out_len bytes.
+static int inflate_zlib(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_len) {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    uint8_t lengths[288 + 32];
+    uint16_t lit_syms[288], dist_syms[32], len_syms[19];
+    huffman lit = { {0}, lit_syms }, dist = { {0}, dist_syms }, lencode = { {0}, len_syms };
+
+    if (in_len < 2 || (in[0] & 0x0F) != 8 || (in[1] & 0x20) || ((in[0] << 8) | in[1]) % 31)
+        return 0;
+    bit_reader br = { in + 2, in + in_len, 0, 0, 0 };
+    uint32_t pos = 0;
+    int last;
+    do {
+        last = br_bits(&br, 1);
+        uint32_t type = br_bits(&br, 2);
+        if (type == 0) {
+            br_align(&br);
+            uint32_t len = br_bits(&br, 16);
+            if ((len ^ 0xFFFF) != br_bits(&br, 16) || len > out_len - pos) return 0;
+            while (len--) out[pos++] = (uint8_t)br_bits(&br, 8);
+        } else if (type == 1) {
+            uint32_t i = 0;
+            for (; i < 144; i++) lengths[i] = 8;
+            for (; i < 256; i++) lengths[i] = 9;
+            for (; i < 280; i++) lengths[i] = 7;
+            for (; i < 288; i++) lengths[i] = 8;
+            for (; i < 288 + 30; i++) lengths[i] = 5;
+            huff_build(&lit, lengths, 288);
+            huff_build(&dist, lengths + 288, 30);
+            if (!inflate_codes(&br, &lit, &dist, out, &pos, out_len)) return 0;
+        } else if (type == 2) {
+            uint32_t hlit = br_bits(&br, 5) + 257, hdist = br_bits(&br, 5) + 1, hclen = br_bits(&br, 4) + 4;
+            if (hlit > 286 || hdist > 30) return 0;
+            for (uint32_t i = 0; i < 19; i++)
+                lengths[order[i]] = i < hclen ? (uint8_t)br_bits(&br, 3) : 0;
+            if (!huff_build(&lencode, lengths, 19)) return 0;
+            for (uint32_t i = 0; i < hlit + hdist; ) {
+                int sym = huff_decode(&br, &lencode);
+                if (sym < 0) return 0;
+                if (sym < 16) {
+                    lengths[i++] = (uint8_t)sym;
+                    continue;
+                }
+                uint8_t len = 0;
+                uint32_t rep;
+                if (sym == 16) {
+                    if (!i) return 0;
+                    len = lengths[i - 1];
+                    rep = 3 + br_bits(&br, 2);
+                } else if (sym == 17) {
+                    rep = 3 + br_bits(&br, 3);
+                } else {
+                    rep = 11 + br_bits(&br, 7);
+                }
+                if (rep > hlit + hdist - i) return 0;
+                while (rep--) lengths[i++] = len;
+            }
+            if (!lengths[256] || !huff_build(&lit, lengths, hlit) ||
+                !huff_build(&dist, lengths + hlit, hdist))
+                return 0;
+            if (!inflate_codes(&br, &lit, &dist, out, &pos, out_len)) return 0;
+        } else {
+            return 0;
+        }
+        if (br.bad) return 0;
+    } while (!last);
+    return pos == out_len;
+}
+
+#ifdef TXT2SVG_WOFF2
+// ---------------- brotli ----------------
+// Brotli decoder (RFC 7932) for WOFF2. Like inflate it writes into a flat
+// buffer of known size, so back references index the output directly and
+// anything reaching further back than the output so far is a static
+// dictionary word. The dictionary is generated from brotli_dictionary.bin.
+
+#include "brotli_dict.h"
+#define brotli_dictionary brotli_dictionary_bin
+
+#define BROTLI_MAX_ALPHABET 704
+#define BROTLI_NUM_TRANSFORMS 121
+
+static const uint8_t brotli_lut0[256] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  4,  4,  0,  0,  4,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     8, 12, 16, 12, 12, 20, 12, 16, 24, 28, 12, 12, 32, 12, 36, 12,
+    44, 44, 44, 44, 44, 44, 44, 44, 44, 44, 32, 32, 24, 40, 28, 12,
+    12, 48, 52, 52, 52, 48, 52, 52, 52, 48, 52, 52, 52, 52, 52, 48,
+    52, 52, 52, 52, 52, 48, 52, 52, 52, 52, 52, 24, 12, 28, 12, 12,
+    12, 56, 60, 60, 60, 56, 60, 60, 60, 56, 60, 60, 60, 60, 60, 56,
+    60, 60, 60, 60, 60, 56, 60, 60, 60, 60, 60, 24, 12, 28, 12,  0,
+     0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,
+     0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,
+     0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,
+     0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,
+     2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,
+     2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,
+     2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,
+     2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,  2,  3,
+};
+static const uint8_t brotli_lut1[256] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+     2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  1,  1,  1,  1,  1,  1,
+     1,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+     2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  1,  1,  1,  1,  1,
+     1,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,
+     3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  1,  1,  1,  1,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+     2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+};
+static const char brotli_affixes[] =
+    "\0\1 \5 the \2s \4 of \5 and \2, \4 in \4 to \2e \1\42\1.\2\42>\1\12\1]"
+    "\5 for \3 a \6 that \2. \6 with \1'\6 from \4 by \6. The \4 on \4 as "
+    "\4 is \4ing \2\12\11\1:\3ed \1(\4 at \3ly \2=\42\5.com/\10 of the "
+    "\7. This \1,\5 not \3er \3al \2='\4ful \4ive \5less \4est \4ize "
+    "\2\xc2\xa0\4ous ";
+static const uint8_t brotli_transforms[121 * 3] = {
+    0, 0, 0, 0, 0, 1, 1, 0, 1, 0, 12, 0, 0, 10, 1, 0, 0, 3,
+    1, 0, 0, 9, 0, 1, 0, 0, 12, 0, 10, 0, 0, 0, 17, 0, 13, 0,
+    0, 1, 0, 23, 0, 1, 0, 0, 23, 1, 10, 1, 0, 0, 26, 0, 0, 31,
+    36, 0, 1, 0, 0, 39, 0, 0, 41, 0, 0, 43, 0, 0, 46, 0, 3, 0,
+    0, 0, 48, 0, 0, 50, 0, 14, 0, 0, 2, 0, 0, 0, 56, 0, 0, 60,
+    1, 10, 0, 0, 0, 67, 41, 0, 0, 1, 0, 23, 0, 15, 0, 0, 0, 70,
+    0, 0, 77, 0, 0, 79, 0, 0, 86, 0, 16, 0, 0, 17, 0, 3, 0, 0,
+    0, 4, 0, 0, 0, 91, 0, 11, 0, 0, 0, 98, 0, 0, 103, 0, 0, 108,
+    0, 7, 0, 0, 1, 113, 0, 0, 118, 0, 0, 121, 1, 0, 67, 0, 0, 123,
+    0, 20, 0, 0, 18, 0, 0, 6, 0, 0, 0, 127, 0, 10, 23, 0, 8, 0,
+    0, 0, 129, 0, 0, 134, 3, 0, 12, 0, 5, 0, 0, 9, 0, 1, 10, 23,
+    0, 10, 39, 41, 0, 127, 0, 11, 1, 0, 10, 43, 0, 0, 138, 1, 0, 41,
+    141, 0, 0, 3, 0, 147, 0, 10, 77, 0, 0, 156, 0, 0, 164, 41, 0, 1,
+    0, 10, 127, 0, 10, 41, 0, 0, 166, 1, 0, 138, 0, 0, 172, 1, 11, 1,
+    0, 0, 176, 1, 11, 0, 0, 0, 180, 0, 11, 39, 0, 10, 67, 1, 0, 127,
+    0, 0, 183, 1, 10, 67, 0, 0, 188, 0, 0, 193, 0, 11, 77, 0, 0, 199,
+    1, 10, 41, 0, 11, 43, 1, 0, 180, 0, 10, 164, 0, 0, 204, 0, 11, 41,
+    209, 0, 0, 1, 0, 164, 0, 10, 138, 0, 11, 138, 0, 0, 212, 0, 11, 23,
+    0, 10, 180, 1, 10, 164, 1, 11, 138, 1, 11, 23, 0, 11, 164, 0, 11, 127,
+    0, 11, 67, 1, 11, 41, 0, 11, 180, 1, 11, 67, 1, 10, 138, 1, 11, 180,
+    1, 10, 180,
+};
+
+static const uint8_t brotli_dict_bits[25] = {
+    0, 0, 0, 0, 10, 10, 11, 11, 10, 10, 10, 10, 10, 9, 9, 8, 7, 7, 8, 7, 7, 6, 6, 5, 5 };
+static const uint32_t brotli_dict_offset[25] = {
+    0, 0, 0, 0, 0, 4096, 9216, 21504, 35840, 44032, 53248, 63488, 74752,
+    87040, 93696, 100864, 104704, 106752, 108928, 113536, 115968, 118528,
+    119872, 121280, 122016 };
+
+static const uint16_t brotli_blen_base[26] = {
+    1, 5, 9, 13, 17, 25, 33, 41, 49, 65, 81, 97, 113, 145, 177, 209,
+    241, 305, 369, 497, 753, 1265, 2289, 4337, 8433, 16625 };
+static const uint8_t brotli_blen_extra[26] = {
+    2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 7, 8, 9, 10, 11, 12, 13, 24 };
+
+static const uint32_t brotli_insert_base[24] = {
+    0, 1, 2, 3, 4, 5, 6, 8, 10, 14, 18, 26, 34, 50, 66, 98,
+    130, 194, 322, 578, 1090, 2114, 6210, 22594 };
+static const uint8_t brotli_insert_extra[24] = {
+    0, 0, 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 7, 8, 9, 10, 12, 14, 24 };
+static const uint32_t brotli_copy_base[24] = {
+    2, 3, 4, 5, 6, 7, 8, 9, 10, 12, 14, 18, 22, 30, 38, 54,
+    70, 102, 134, 198, 326, 582, 1094, 2118 };
+static const uint8_t brotli_copy_extra[24] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 7, 8, 9, 10, 24 };
+// insert and copy length code offsets of the eleven 64-symbol cells of
+// the insert-and-copy alphabet; cells 0 and 1 reuse the last distance
+static const uint8_t brotli_cell_insert[11] = { 0, 0, 0, 0, 8, 8, 0, 16, 8, 16, 16 };
+static const uint8_t brotli_cell_copy[11] = { 0, 8, 0, 8, 0, 8, 16, 0, 16, 8, 16 };
+
+// distance codes 0-15 refer back to the ring of the last four distances
+static const uint8_t brotli_dist_ring[16] = { 0, 1, 2, 3, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1 };
+static const int8_t brotli_dist_delta[16] = { 0, 0, 0, 0, -1, 1, -2, 2, -3, 3, -1, 1, -2, 2, -3, 3 };
+
+static uint32_t brotli_lut2(uint8_t c) {
+    return c == 0 ? 0 : c < 16 ? 1 : c < 64 ? 2 : c < 128 ? 3 : c < 192 ? 4 : c < 240 ? 5 : c < 255 ? 6 : 7;
+}
+
+static uint32_t brotli_context(uint32_t mode, uint8_t p1, uint8_t p2) {
+    switch (mode) {
+    case 0: return p1 & 0x3F;
+    case 1: return p1 >> 2;
+    case 2: return brotli_lut0[p1] | brotli_lut1[p2];
+    default: return (brotli_lut2(p1) << 3) | brotli_lut2(p2);
+    }
+}
+
+static uint32_t brotli_ferment(uint8_t *p, uint32_t len) {
+    if (p[0] < 192) {
+        if (p[0] >= 'a' && p[0] <= 'z') p[0] ^= 32;
+        return 1;
+    }
+    if (p[0] < 224) {
+        if (len > 1) p[1] ^= 32;
+        return 2;
+    }
+    if (len > 2) p[2] ^= 5;
+    return 3;
+}
+
+// Applies dictionary transform t to word, returning the output length.
+// Types: 0 identity, 1-9 omit last n, 10 uppercase first, 11 uppercase
+// all, 12-20 omit first n - 11.
+static uint32_t brotli_transform(uint8_t *dst, const uint8_t *word, uint32_t len, uint32_t t) {
+    const uint8_t *tr = brotli_transforms + 3 * t;
+    const char *prefix = brotli_affixes + tr[0], *suffix = brotli_affixes + tr[2];
+    uint32_t type = tr[1], n = 0;
+
+    for (int i = 0; i < prefix[0]; i++) dst[n++] = (uint8_t)prefix[1 + i];
+    uint32_t skip = type >= 12 ? type - 11 : 0, cut = type <= 9 ? type : 0;
+    if (skip > len) skip = len;
+    uint32_t wl = len - skip > cut ? len - skip - cut : 0;
+    uint8_t *w = dst + n;
+    for (uint32_t i = 0; i < wl; i++) dst[n++] = word[skip + i];
+    if (type == 10 && wl) {
+        brotli_ferment(w, wl);
+    } else if (type == 11) {
+        for (uint32_t i = 0; i < wl; ) i += brotli_ferment(w + i, wl - i);
+    }
+    for (int i = 0; i < suffix[0]; i++) dst[n++] = (uint8_t)suffix[1 + i];
+    return n;
+}
+
+// Reads a prefix code (section 3) over alphabet_size symbols into h,
+// whose symbol array must hold alphabet_size entries.
+static int brotli_read_code(bit_reader *br, uint32_t alphabet_size, huffman *h) {
+    uint8_t lengths[BROTLI_MAX_ALPHABET];
+    STBTT_memset(lengths, 0, alphabet_size);
+
+    uint32_t hskip = br_bits(br, 2);
+    if (hskip == 1) {
+        // simple code: up to four literal symbols with implied lengths
+        static const uint8_t simple[5][4] = { {0}, {0}, {1, 1}, {1, 2, 2}, {2, 2, 2, 2} };
+        uint32_t bits = 0, syms[4];
+        while ((1u << bits) < alphabet_size) bits++;
+        uint32_t nsym = br_bits(br, 2) + 1;
+        for (uint32_t i = 0; i < nsym; i++) {
+            syms[i] = br_bits(br, bits);
+            if (syms[i] >= alphabet_size) return 0;
+            for (uint32_t j = 0; j < i; j++)
+                if (syms[j] == syms[i]) return 0;
+        }
+        if (nsym == 1) {
+            for (int len = 0; len <= HUFF_MAX_BITS; len++) h->count[len] = 0;
+            h->count[0] = 1;
+            h->symbol[0] = (uint16_t)syms[0];
+            return 1;
+        }
+        int tree = nsym == 4 && br_bits(br, 1);
+        for (uint32_t i = 0; i < nsym; i++)
+            lengths[syms[i]] = tree ? (i < 2 ? i + 1 : 3) : simple[nsym][i];
+        return huff_build(h, lengths, alphabet_size);
+    }
+
+    // complex code: code lengths are themselves prefix coded
+    static const uint8_t order[18] = { 1, 2, 3, 4, 0, 5, 17, 6, 16, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    uint8_t cl_lengths[18] = {0};
+    uint16_t cl_syms[18];
+    huffman cl = { {0}, cl_syms };
+    int space = 32, num_codes = 0;
+    for (uint32_t i = hskip; i < 18; i++) {
+        // fixed code over 0-5: 00, 0111, 011, 10, 01, 1111 (first bit rightmost)
+        uint32_t v = br_bits(br, 2), len;
+        if (v == 0) len = 0;
+        else if (v == 1) len = 4;
+        else if (v == 2) len = 3;
+        else if (!br_bits(br, 1)) len = 2;
+        else len = br_bits(br, 1) ? 5 : 1;
+        cl_lengths[order[i]] = (uint8_t)len;
+        if (len) {
+            space -= 32 >> len;
+            num_codes++;
+            if (space <= 0) break;
+        }
+    }
+    if (num_codes != 1 && space != 0) return 0;
+    if (num_codes == 1) {
+        for (int s = 0; s < 18; s++)
+            if (cl_lengths[s]) { cl.count[0] = 1; cl_syms[0] = (uint16_t)s; }
+    } else if (!huff_build(&cl, cl_lengths, 18)) {
+        return 0;
+    }
+
+    uint32_t prev_len = 8, repeat = 0, repeat_len = 0, sym = 0;
+    int left = 32768;
+    while (sym < alphabet_size && left > 0) {
+        int len = huff_decode(br, &cl);
+        if (len < 0 || br->bad) return 0;
+        if (len < 16) {
+            repeat = 0;
+            lengths[sym++] = (uint8_t)len;
+            if (len) {
+                prev_len = (uint32_t)len;
+                left -= 32768 >> len;
+            }
+            continue;
+        }
+        uint32_t extra = len == 16 ? 2 : 3;
+        uint32_t new_len = len == 16 ? prev_len : 0;
+        if (repeat_len != new_len) {
+            repeat = 0;
+            repeat_len = new_len;
+        }
+        uint32_t old = repeat;
+        if (repeat) repeat = (repeat - 2) << extra;
+        repeat += br_bits(br, extra) + 3;
+        uint32_t delta = repeat - old;
+        if (delta > alphabet_size - sym) return 0;
+        while (delta--) lengths[sym++] = (uint8_t)repeat_len;
+        if (repeat_len) left -= (int)((repeat - old) << (15 - repeat_len));
+    }
+    if (left != 0) return 0;
+    return huff_build(h, lengths, alphabet_size);
+}
+
+// ntrees codes over the same alphabet in a single allocation
+static huffman* brotli_read_group(bit_reader *br, uint32_t ntrees, uint32_t alphabet_size) {
+    huffman *h = (huffman*)STBTT_malloc(ntrees * (sizeof(huffman) + alphabet_size * sizeof(uint16_t)), 0);
+    if (!h) return NULL;
+    uint16_t *syms = (uint16_t*)(h + ntrees);
+    for (uint32_t i = 0; i < ntrees; i++) {
+        h[i].symbol = syms + i * alphabet_size;
+        if (!brotli_read_code(br, alphabet_size, &h[i])) {
+            STBTT_free(h, 0);
+            return NULL;
+        }
+    }
+    return h;
+}
+
+static uint32_t brotli_varlen(bit_reader *br) {
+    if (!br_bits(br, 1)) return 0;
+    uint32_t n = br_bits(br, 3);
+    return n ? (1u << n) + br_bits(br, n) : 1;
+}
+
+static int brotli_context_map(bit_reader *br, uint8_t *map, uint32_t size, uint32_t ntrees) {
+    if (ntrees == 1) {
+        STBTT_memset(map, 0, size);
+        return 1;
+    }
+    uint32_t rlemax = br_bits(br, 1) ? br_bits(br, 4) + 1 : 0;
+    uint16_t syms[256 + 16];
+    huffman h = { {0}, syms };
+    if (!brotli_read_code(br, ntrees + rlemax, &h)) return 0;
+
+    for (uint32_t i = 0; i < size; ) {
+        int sym = huff_decode(br, &h);
+        if (sym < 0 || br->bad) return 0;
+        if (sym == 0) {
+            map[i++] = 0;
+        } else if ((uint32_t)sym <= rlemax) {
+            uint32_t reps = (1u << sym) + br_bits(br, sym);
+            if (reps > size - i) return 0;
+            while (reps--) map[i++] = 0;
+        } else {
+            map[i++] = (uint8_t)(sym - rlemax);
+        }
+    }
+    if (br_bits(br, 1)) {
+        // inverse move-to-front
+        uint8_t mtf[256];
+        for (int i = 0; i < 256; i++) mtf[i] = (uint8_t)i;
+        for (uint32_t i = 0; i < size; i++) {
+            uint8_t idx = map[i], v = mtf[idx];
+            map[i] = v;
+            for (; idx; idx--) mtf[idx] = mtf[idx - 1];
+            mtf[0] = v;
+        }
+    }
+    return 1;
+}
+
+// Block types and counts of one category (literal, insert-and-copy or
+// distance) within a meta-block.
+typedef struct {
+    uint32_t ntypes, type, prev, left;
+    huffman types, counts;
+    uint16_t type_syms[256 + 2], count_syms[26];
+} brotli_blocks;
+
+static uint32_t brotli_block_count(bit_reader *br, const huffman *h) {
+    int sym = huff_decode(br, h);
+    if (sym < 0) return 1;
+    return brotli_blen_base[sym] + br_bits(br, brotli_blen_extra[sym]);
+}
+
+static int brotli_read_blocks(bit_reader *br, brotli_blocks *b) {
+    b->ntypes = brotli_varlen(br) + 1;
+    b->type = 0;
+    b->prev = 1;
+    b->left = 0xFFFFFFFFu;
+    if (b->ntypes < 2) return 1;
+    b->types.symbol = b->type_syms;
+    b->counts.symbol = b->count_syms;
+    if (!brotli_read_code(br, b->ntypes + 2, &b->types) ||
+        !brotli_read_code(br, 26, &b->counts))
+        return 0;
+    b->left = brotli_block_count(br, &b->counts);
+    return 1;
+}
+
+static void brotli_switch(bit_reader *br, brotli_blocks *b) {
+    int sym = huff_decode(br, &b->types);
+    uint32_t t = sym == 0 ? b->prev : sym == 1 ? b->type + 1 : (uint32_t)sym - 2;
+    if (sym < 0) t = 0;
+    if (t >= b->ntypes) t -= b->ntypes;
+    b->prev = b->type;
+    b->type = t;
+    b->left = brotli_block_count(br, &b->counts);
+}
+
+// Decoder state that carries across meta-blocks.
+typedef struct {
+    bit_reader br;
+    uint8_t *out;
+    uint32_t pos, max_backward;
+    uint32_t dist_ring[4], dist_idx;
+} brotli_state;
+
+static int brotli_metablock(brotli_state *s, uint32_t end) {
+    bit_reader *br = &s->br;
+    uint8_t *out = s->out;
+    brotli_blocks bl[3]; // literal, insert-and-copy, distance
+    uint8_t modes[256], *cmap_lit = NULL, *cmap_dist = NULL;
+    huffman *lits = NULL, *cmds = NULL, *dists = NULL;
+    int ok = 0;
+
+    for (int c = 0; c < 3; c++)
+        if (!brotli_read_blocks(br, &bl[c])) return 0;
+    uint32_t npostfix = br_bits(br, 2);
+    uint32_t ndirect = br_bits(br, 4) << npostfix;
+    for (uint32_t i = 0; i < bl[0].ntypes; i++) modes[i] = (uint8_t)br_bits(br, 2);
+
+    uint32_t ntrees_lit = brotli_varlen(br) + 1;
+    cmap_lit = (uint8_t*)STBTT_malloc(64 * bl[0].ntypes, 0);
+    if (!cmap_lit || !brotli_context_map(br, cmap_lit, 64 * bl[0].ntypes, ntrees_lit)) goto done;
+    uint32_t ntrees_dist = brotli_varlen(br) + 1;
+    cmap_dist = (uint8_t*)STBTT_malloc(4 * bl[2].ntypes, 0);
+    if (!cmap_dist || !brotli_context_map(br, cmap_dist, 4 * bl[2].ntypes, ntrees_dist)) goto done;
+
+    lits = brotli_read_group(br, ntrees_lit, 256);
+    cmds = brotli_read_group(br, bl[1].ntypes, 704);
+    dists = brotli_read_group(br, ntrees_dist, 16 + ndirect + (48 << npostfix));
+    if (!lits || !cmds || !dists) goto done;
+
+    uint32_t pos = s->pos;
+    while (pos < end && !br->bad) {
+        if (!bl[1].left) brotli_switch(br, &bl[1]);
+        bl[1].left--;
+        int cmd = huff_decode(br, &cmds[bl[1].type]);
+        if (cmd < 0) goto done;
+        uint32_t cell = (uint32_t)cmd >> 6;
+        uint32_t ic = brotli_cell_insert[cell] + ((cmd >> 3) & 7);
+        uint32_t cc = brotli_cell_copy[cell] + (cmd & 7);
+        uint32_t insert = brotli_insert_base[ic] + br_bits(br, brotli_insert_extra[ic]);
+        uint32_t copy = brotli_copy_base[cc] + br_bits(br, brotli_copy_extra[cc]);
+        if (insert > end - pos) goto done;
+
+        while (insert--) {
+            if (!bl[0].left) brotli_switch(br, &bl[0]);
+            bl[0].left--;
+            uint8_t p1 = pos ? out[pos - 1] : 0, p2 = pos > 1 ? out[pos - 2] : 0;
+            uint32_t ctx = brotli_context(modes[bl[0].type], p1, p2);
+            int lit = huff_decode(br, &lits[cmap_lit[64 * bl[0].type + ctx]]);
+            if (lit < 0) goto done;
+            out[pos++] = (uint8_t)lit;
+        }
+        if (pos >= end) break;
+
+        int dcode = 0;
+        if (cell >= 2) {
+            if (!bl[2].left) brotli_switch(br, &bl[2]);
+            bl[2].left--;
+            uint32_t cid = copy > 4 ? 3 : copy - 2;
+            dcode = huff_decode(br, &dists[cmap_dist[4 * bl[2].type + cid]]);
+            if (dcode < 0) goto done;
+        }
+        int64_t distance;
+        if (dcode < 16) {
+            distance = (int64_t)s->dist_ring[(s->dist_idx - brotli_dist_ring[dcode]) & 3] + brotli_dist_delta[dcode];
+            if (distance <= 0) goto done;
+        } else if ((uint32_t)dcode < 16 + ndirect) {
+            distance = dcode - 15;
+        } else {
+            uint32_t d = (uint32_t)dcode - ndirect - 16;
+            uint32_t nbits = 1 + (d >> (npostfix + 1));
+            uint32_t offset = ((2 + ((d >> npostfix) & 1)) << nbits) - 4;
+            distance = ((int64_t)(offset + br_bits(br, nbits)) << npostfix) +
+                (d & ((1u << npostfix) - 1)) + ndirect + 1;
+        }
+
+        uint32_t max_distance = pos < s->max_backward ? pos : s->max_backward;
+        if (distance > max_distance) {
+            // static dictionary word, possibly transformed
+            if (copy < 4 || copy > 24) goto done;
+            uint32_t word_id = (uint32_t)(distance - max_distance - 1);
+            uint32_t nbits = brotli_dict_bits[copy];
+            uint32_t t = word_id >> nbits;
+            if (t >= BROTLI_NUM_TRANSFORMS) goto done;
+            uint8_t word[40];
+            uint32_t n = brotli_transform(word, brotli_dictionary + brotli_dict_offset[copy] +
+                (word_id & ((1u << nbits) - 1)) * copy, copy, t);
+            if (n > end - pos) goto done;
+            for (uint32_t i = 0; i < n; i++) out[pos++] = word[i];
+        } else {
+            if (dcode) {
+                s->dist_idx = (s->dist_idx + 1) & 3;
+                s->dist_ring[s->dist_idx] = (uint32_t)distance;
+            }
+            if (copy > end - pos) goto done;
+            for (uint32_t i = 0; i < copy; i++, pos++)
+                out[pos] = out[pos - (uint32_t)distance];
+        }
+    }
+    s->pos = pos;
+    ok = pos == end && !br->bad;
+
+done:
+    STBTT_free(cmap_lit, 0);
+    STBTT_free(cmap_dist, 0);
+    STBTT_free(lits, 0);
+    STBTT_free(cmds, 0);
+    STBTT_free(dists, 0);
+    return ok;
+}
+
+// Decodes a Brotli stream that must produce exactly out_len bytes.
+static int brotli_decode(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_len) {
+    brotli_state s = { { in, in + in_len, 0, 0, 0 }, out, 0, 0, { 16, 15, 11, 4 }, 3 };
+    bit_reader *br = &s.br;
+
+    uint32_t wbits, n;
+    if (!br_bits(br, 1)) wbits = 16;
+    else if ((n = br_bits(br, 3)) != 0) wbits = 17 + n;
+    else if ((n = br_bits(br, 3)) == 1) return 0; // large window extension
+    else wbits = n ? 8 + n : 17;
+    s.max_backward = (1u << wbits) - 16;
+
+    int last = 0;
+    while (!last) {
+        last = br_bits(br, 1);
+        if (last && br_bits(br, 1)) break; // ISLASTEMPTY
+        uint32_t nibbles = br_bits(br, 2);
+        if (nibbles == 3) {
+            // metadata block, skipped
+            if (br_bits(br, 1)) return 0;
+            uint32_t bytes = br_bits(br, 2), skip = 0;
+            for (uint32_t i = 0; i < bytes; i++) skip |= br_bits(br, 8) << (8 * i);
+            if (bytes) skip++;
+            br_align(br);
+            while (skip-- && !br->bad) br_bits(br, 8);
+            if (br->bad) return 0;
+            continue;
+        }
+        uint32_t mlen = br_bits(br, 4 * (nibbles + 4)) + 1;
+        if (br->bad || mlen > out_len - s.pos) return 0;
+        if (!last && br_bits(br, 1)) {
+            br_align(br);
+            while (mlen--) out[s.pos++] = (uint8_t)br_bits(br, 8);
+            if (br->bad) return 0;
+            continue;
+        }
+        if (!brotli_metablock(&s, s.pos + mlen)) return 0;
+    }
+    return s.pos == out_len;
+}
+#endif // TXT2SVG_WOFF2
+
+// ---------------- woff ----------------
+// WOFF and WOFF2 fonts are decoded back into a plain TTF in front of
+// stb_truetype. Decoding happens once per isolate: decoded fonts are kept
+// in persistent memory, keyed by the compressed file's header and table
+// directory since it is copied in afresh on every request.
+
+#define WOFF_MAGIC  0x774F4646u // "wOFF"
+#define WOFF2_MAGIC 0x774F4632u // "wOF2"
+#define MAX_WOFF_FONTS 8
+
+typedef struct {
+    uint32_t tag;
+    const uint8_t *data;
+    uint32_t len;
+} sfnt_table;
+
+typedef struct {
+    uint32_t hash, len;
+    const uint8_t *ttf;
+    uint32_t ttf_len;
+} woff_entry;
+
+static woff_entry woff_fonts[MAX_WOFF_FONTS];
+static int num_woff_fonts = 0;
+
+// Writes an sfnt with the given tables, sorted by tag as the table
+// directory requires, into persistent memory if *persist is set or
+// request scratch. Clears *persist if persistent memory ran out and the
+// sfnt went to scratch instead.
+static uint8_t* sfnt_build(uint32_t flavor, sfnt_table *t, uint32_t n, int *persist, uint32_t *out_len) {
+    for (uint32_t i = 1; i < n; i++) {
+        sfnt_table x = t[i];
+        uint32_t j = i;
+        for (; j > 0 && t[j-1].tag > x.tag; j--) t[j] = t[j-1];
+        t[j] = x;
+    }
+    uint32_t size = 12 + 16 * n;
+    for (uint32_t i = 0; i < n; i++) size += (t[i].len + 3) & ~3u;
+
+    uint8_t *o = *persist ? (uint8_t*)persist_alloc(size) : NULL;
+    if (!o) {
+        *persist = 0;
+        o = (uint8_t*)STBTT_malloc(size, 0);
+    }
+    if (!o) return NULL;
+    STBTT_memset(o, 0, size);
+
+    uint32_t search = 1, selector = 0;
+    while (search * 2 <= n) { search *= 2; selector++; }
+    put32(o, flavor);
+    put16(o + 4, n);
+    put16(o + 6, search * 16);
+    put16(o + 8, selector);
+    put16(o + 10, (n - search) * 16);
+
+    uint32_t at = 12 + 16 * n;
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *e = o + 12 + 16 * i;
+        STBTT_memcpy(o + at, t[i].data, t[i].len);
+        put32(e, t[i].tag);
+        put32(e + 4, table_checksum(o + at, t[i].len));
+        put32(e + 8, at);
+        put32(e + 12, t[i].len);
+        at += (t[i].len + 3) & ~3u;
+    }
+    *out_len = size;
+    return o;
+}
+
+static uint8_t* woff_decode(const uint8_t *data, uint32_t len, int *persist, uint32_t *out_len) {
+    if (len < 44) return NULL;
+    uint32_t n = get16(data + 12);
+    if (44 + 20 * n > len) return NULL;
+    sfnt_table *t = (sfnt_table*)STBTT_malloc(n * sizeof(sfnt_table) + 1, 0);
+    if (!t) return NULL;
+
+    uint8_t *ttf = NULL;
+    uint32_t i = 0;
+    for (; i < n; i++) {
+        const uint8_t *e = data + 44 + 20 * i;
+        uint32_t off = get32(e + 4), comp = get32(e + 8), orig = get32(e + 12);
+        t[i].tag = get32(e);
+        t[i].len = orig;
+        if (off > len || comp > len - off || comp > orig) break;
+        if (comp == orig) {
+            t[i].data = data + off;
+            continue;
+        }
+        uint8_t *buf = (uint8_t*)STBTT_malloc(orig, 0);
+        t[i].data = buf;
+        if (!buf || !inflate_zlib(data + off, comp, buf, orig)) { i++; break; }
+    }
+    if (i == n && n)
+        ttf = sfnt_build(get32(data + 4), t, n, persist, out_len);
+    else
+        n = i;
+
+    for (i = 0; i < n; i++)
+        if (t[i].data < data || t[i].data >= data + len) STBTT_free((void*)t[i].data, 0);
+    STBTT_free(t, 0);
+    return ttf;
+}
+
+#ifdef TXT2SVG_WOFF2
+// WOFF2 (https://www.w3.org/TR/WOFF2/): a table directory followed by one
+// Brotli stream holding every table back to back. glyf and loca may be
+// stored in the transformed form of section 5.1 and hmtx in that of 5.4.
+
+static const char woff2_tags[63][5] = {
+    "cmap", "head", "hhea", "hmtx", "maxp", "name", "OS/2", "post", "cvt ", "fpgm",
+    "glyf", "loca", "prep", "CFF ", "VORG", "EBDT", "EBLC", "gasp", "hdmx", "kern",
+    "LTSH", "PCLT", "VDMX", "vhea", "vmtx", "BASE", "GDEF", "GPOS", "GSUB", "EBSC",
+    "JSTF", "MATH", "CBDT", "CBLC", "COLR", "CPAL", "SVG ", "sbix", "acnt", "avar",
+    "bdat", "bloc", "bsln", "cvar", "fdsc", "feat", "fmtx", "fvar", "gvar", "hsty",
+    "just", "lcar", "mort", "morx", "opbd", "prop", "trak", "Zapf", "Silf", "Glat",
+    "Gloc", "Feat", "Sill" };
+
+#define TAG_GLYF 0x676C7966u
+#define TAG_LOCA 0x6C6F6361u
+#define TAG_HMTX 0x686D7478u
+#define TAG_HHEA 0x68686561u
+
+// Bounds-checked reader over one of the WOFF2 streams; reads past the end
+// return zeros and set bad.
+typedef struct {
+    const uint8_t *p, *end;
+    int bad;
+} byte_reader;
+
+static const uint8_t* rd_take(byte_reader *r, uint32_t n) {
+    if (n > (uint32_t)(r->end - r->p)) {
+        r->bad = 1;
+        return NULL;
+    }
+    const uint8_t *p = r->p;
+    r->p += n;
+    return p;
+}
+
+static uint32_t rd_u8(byte_reader *r) {
+    const uint8_t *p = rd_take(r, 1);
+    return p ? p[0] : 0;
+}
+
+static uint32_t rd_u16(byte_reader *r) {
+    const uint8_t *p = rd_take(r, 2);
+    return p ? get16(p) : 0;
+}
+
+static uint32_t rd_u32(byte_reader *r) {
+    const uint8_t *p = rd_take(r, 4);
+    return p ? get32(p) : 0;
+}
+
+static uint32_t rd_255u16(byte_reader *r) {
+    uint32_t code = rd_u8(r);
+    if (code == 253) return rd_u16(r);
+    if (code == 255) return rd_u8(r) + 253;
+    if (code == 254) return rd_u8(r) + 253 * 2;
+    return code;
+}
+
+static uint32_t rd_base128(byte_reader *r) {
+    uint32_t v = 0;
+    for (int i = 0; i < 5; i++) {
+        uint32_t b = rd_u8(r);
+        if ((i == 0 && b == 0x80) || (v & 0xFE000000u)) break;
+        v = (v << 7) | (b & 0x7F);
+        if (!(b & 0x80)) return v;
+    }
+    r->bad = 1;
+    return 0;
+}
+
+static uint32_t rd_remaining(const byte_reader *r) {
+    return (uint32_t)(r->end - r->p);
+}
+
+// Encodes decoded points as glyf flags and x/y deltas, collapsing runs of
+// equal flags with the repeat bit.
+static uint8_t* woff2_put_points(uint8_t *o, const int16_t *xs, const int16_t *ys,
+    const uint8_t *on, uint32_t n, int overlap) {
+    uint8_t prev = 0, *count = NULL;
+    for (uint32_t i = 0; i < n; i++) {
+        int dx = xs[i] - (i ? xs[i-1] : 0), dy = ys[i] - (i ? ys[i-1] : 0);
+        uint8_t f = on[i] | (i == 0 && overlap ? 0x40 : 0);
+        if (dx == 0) f |= 0x10;
+        else if (dx >= -255 && dx <= 255) f |= 0x02 | (dx > 0 ? 0x10 : 0);
+        if (dy == 0) f |= 0x20;
+        else if (dy >= -255 && dy <= 255) f |= 0x04 | (dy > 0 ? 0x20 : 0);
+
+        if (i && f == prev && (!count || *count < 255)) {
+            if (!count) {
+                o[-1] |= 0x08;
+                count = o++;
+                *count = 0;
+            }
+            (*count)++;
+        } else {
+            *o++ = prev = f;
+            count = NULL;
+        }
+    }
+    for (int axis = 0; axis < 2; axis++) {
+        const int16_t *v = axis ? ys : xs;
+        for (uint32_t i = 0; i < n; i++) {
+            int d = v[i] - (i ? v[i-1] : 0);
+            if (d == 0) continue;
+            if (d >= -255 && d <= 255) {
+                *o++ = (uint8_t)(d < 0 ? -d : d);
+            } else {
+                put16(o, (uint16_t)d);
+                o += 2;
+            }
+        }
+    }
+    return o;
+}
+
+// One point from the flag and glyph streams (section 5.2).
+static int woff2_triplet(uint32_t flag, byte_reader *r, int *dx, int *dy) {
+    uint32_t b0, b1, b2;
+    flag &= 0x7F;
+    if (flag < 10) {
+        *dx = 0;
+        *dy = (int)(((flag & 14) << 7) + rd_u8(r));
+    } else if (flag < 20) {
+        *dx = (int)((((flag - 10) & 14) << 7) + rd_u8(r));
+        *dy = 0;
+    } else if (flag < 84) {
+        b0 = flag - 20;
+        b1 = rd_u8(r);
+        *dx = (int)(1 + (b0 & 0x30) + (b1 >> 4));
+        *dy = (int)(1 + ((b0 & 0x0C) << 2) + (b1 & 0x0F));
+    } else if (flag < 120) {
+        b0 = flag - 84;
+        *dx = (int)(1 + ((b0 / 12) << 8) + rd_u8(r));
+        *dy = (int)(1 + (((b0 % 12) >> 2) << 8) + rd_u8(r));
+    } else if (flag < 124) {
+        b0 = rd_u8(r);
+        b1 = rd_u8(r);
+        b2 = rd_u8(r);
+        *dx = (int)((b0 << 4) + (b1 >> 4));
+        *dy = (int)(((b1 & 0x0F) << 8) + b2);
+    } else {
+        b0 = rd_u16(r);
+        *dx = (int)b0;
+        *dy = (int)rd_u16(r);
+    }
+    // bit 0 of the flag is the sign of x and bit 1 that of y (set means
+    // positive), except that single-coordinate flags always use bit 0
+    if (flag < 10) {
+        if (!(flag & 1)) *dy = -*dy;
+    } else if (flag < 20) {
+        if (!(flag & 1)) *dx = -*dx;
+    } else {
+        if (!(flag & 1)) *dx = -*dx;
+        if (!(flag & 2)) *dy = -*dy;
+    }
+    return !r->bad;
+}
+
+// Rebuilds glyf and loca from the transformed glyf table, collecting each
+// glyph's xMin for the hmtx transform.
+static int woff2_glyf(const uint8_t *src, uint32_t src_len, sfnt_table *glyf, sfnt_table *loca,
+    int16_t **xmins_out, uint32_t *num_glyphs_out) {
+    enum { S_CONTOURS, S_POINTS, S_FLAGS, S_GLYPHS, S_COMPOSITES, S_BBOXES, S_INSTRUCTIONS };
+    if (src_len < 36) return 0;
+    uint32_t option = get16(src + 2), num_glyphs = get16(src + 4), long_loca = get16(src + 6);
+
+    byte_reader s[7];
+    uint32_t off = 36;
+    for (int k = 0; k < 7; k++) {
+        uint32_t size = get32(src + 8 + 4 * k);
+        if (size > src_len - off) return 0;
+        s[k].p = src + off;
+        s[k].end = src + off + size;
+        s[k].bad = 0;
+        off += size;
+    }
+    const uint8_t *overlap = NULL;
+    if (option & 1) {
+        if ((num_glyphs + 7) / 8 > src_len - off) return 0;
+        overlap = src + off;
+    }
+    const uint8_t *has_bbox = rd_take(&s[S_BBOXES], ((num_glyphs + 31) >> 5) << 2);
+    if (!has_bbox) return 0;
+
+    // every contour takes at least a byte of the points stream and every
+    // point one of the glyph stream, which bounds the rebuilt table
+    uint32_t max_points = rd_remaining(&s[S_GLYPHS]);
+    uint32_t bound = 15 * num_glyphs + rd_remaining(&s[S_COMPOSITES]) + rd_remaining(&s[S_INSTRUCTIONS]) +
+        2 * rd_remaining(&s[S_POINTS]) + 5 * max_points;
+    uint32_t loca_len = (num_glyphs + 1) * (long_loca ? 4 : 2);
+    uint8_t *o = (uint8_t*)STBTT_malloc(bound + loca_len, 0);
+    int16_t *xs = (int16_t*)STBTT_malloc(max_points * 4 + max_points + 1, 0);
+    int16_t *xmins = (int16_t*)STBTT_malloc(num_glyphs * 2 + 1, 0);
+    if (!o || !xs || !xmins) goto fail;
+    int16_t *ys = xs + max_points;
+    uint8_t *on = (uint8_t*)(ys + max_points);
+    uint8_t *lo = o + bound;
+
+    uint32_t w = 0;
+    for (uint32_t g = 0; g <= num_glyphs; g++) {
+        if (long_loca) put32(lo + 4 * g, w);
+        else if (w / 2 > 0xFFFF) goto fail;
+        else put16(lo + 2 * g, w / 2);
+        if (g == num_glyphs) break;
+
+        int nc = (int16_t)rd_u16(&s[S_CONTOURS]);
+        int bbox = has_bbox[g >> 3] & (0x80 >> (g & 7));
+        int box[4] = { 0x7FFF, 0x7FFF, -0x8000, -0x8000 };
+        uint8_t *h = o + w;
+        xmins[g] = 0;
+        if (nc == 0) {
+            if (bbox) goto fail;
+            continue;
+        }
+        w += 10;
+
+        if (nc < 0) {
+            if (nc != -1 || !bbox) goto fail;
+            uint32_t flags, instructions = 0;
+            do {
+                flags = rd_u16(&s[S_COMPOSITES]);
+                uint32_t size = 2 + ((flags & 1) ? 4 : 2) +
+                    ((flags & 0x08) ? 2 : (flags & 0x40) ? 4 : (flags & 0x80) ? 8 : 0);
+                const uint8_t *rest = rd_take(&s[S_COMPOSITES], size);
+                if (!rest) goto fail;
+                put16(o + w, flags);
+                STBTT_memcpy(o + w + 2, rest, size);
+                w += 2 + size;
+                instructions |= flags & 0x100;
+            } while (flags & 0x20);
+            if (instructions) {
+                uint32_t ilen = rd_255u16(&s[S_GLYPHS]);
+                const uint8_t *ins = rd_take(&s[S_INSTRUCTIONS], ilen);
+                if (!ins) goto fail;
+                put16(o + w, ilen);
+                STBTT_memcpy(o + w + 2, ins, ilen);
+                w += 2 + ilen;
+            }
+        } else {
+            if ((uint32_t)nc > rd_remaining(&s[S_POINTS])) goto fail;
+            uint32_t npts = 0;
+            for (int c = 0; c < nc; c++) {
+                npts += rd_255u16(&s[S_POINTS]);
+                put16(o + w + 2 * c, npts - 1);
+            }
+            w += 2 * nc;
+            if (npts > rd_remaining(&s[S_GLYPHS])) goto fail;
+
+            int x = 0, y = 0;
+            for (uint32_t i = 0; i < npts; i++) {
+                uint32_t flag = rd_u8(&s[S_FLAGS]);
+                int dx, dy;
+                if (!woff2_triplet(flag, &s[S_GLYPHS], &dx, &dy)) goto fail;
+                x += dx;
+                y += dy;
+                xs[i] = (int16_t)x;
+                ys[i] = (int16_t)y;
+                on[i] = !(flag & 0x80);
+                if (xs[i] < box[0]) box[0] = xs[i];
+                if (ys[i] < box[1]) box[1] = ys[i];
+                if (xs[i] > box[2]) box[2] = xs[i];
+                if (ys[i] > box[3]) box[3] = ys[i];
+            }
+            uint32_t ilen = rd_255u16(&s[S_GLYPHS]);
+            const uint8_t *ins = rd_take(&s[S_INSTRUCTIONS], ilen);
+            if (!ins) goto fail;
+            put16(o + w, ilen);
+            STBTT_memcpy(o + w + 2, ins, ilen);
+            w += 2 + ilen;
+            int ov = overlap && (overlap[g >> 3] & (0x80 >> (g & 7)));
+            w = (uint32_t)(woff2_put_points(o + w, xs, ys, on, npts, ov) - o);
+            if (!npts) box[0] = box[1] = box[2] = box[3] = 0;
+        }
+        if (bbox)
+            for (int k = 0; k < 4; k++) box[k] = (int16_t)rd_u16(&s[S_BBOXES]);
+        put16(h, (uint16_t)nc);
+        for (int k = 0; k < 4; k++) put16(h + 2 + 2 * k, (uint16_t)box[k]);
+        xmins[g] = (int16_t)box[0];
+        while (w & 3) o[w++] = 0;
+
+        for (int k = 0; k < 7; k++)
+            if (s[k].bad) goto fail;
+    }
+
+    glyf->data = o;
+    glyf->len = w;
+    loca->data = lo;
+    loca->len = loca_len;
+    *xmins_out = xmins;
+    *num_glyphs_out = num_glyphs;
+    STBTT_free(xs, 0);
+    return 1;
+
+fail:
+    STBTT_free(o, 0);
+    STBTT_free(xs, 0);
+    STBTT_free(xmins, 0);
+    return 0;
+}
+
+// Rebuilds hmtx, taking left side bearings that were dropped from the
+// glyphs' xMin.
+static uint8_t* woff2_hmtx(const uint8_t *src, uint32_t src_len, uint32_t num_glyphs,
+    uint32_t num_hmetrics, const int16_t *xmins, uint32_t *len) {
+    byte_reader r = { src, src + src_len, 0 };
+    uint32_t flags = rd_u8(&r);
+    if (!num_hmetrics || num_hmetrics > num_glyphs || (flags & ~3u)) return NULL;
+
+    *len = 4 * num_hmetrics + 2 * (num_glyphs - num_hmetrics);
+    uint8_t *o = (uint8_t*)STBTT_malloc(*len, 0);
+    if (!o) return NULL;
+    for (uint32_t i = 0; i < num_hmetrics; i++)
+        put16(o + 4 * i, rd_u16(&r));
+    for (uint32_t i = 0; i < num_hmetrics; i++)
+        put16(o + 4 * i + 2, (flags & 1) ? (uint16_t)xmins[i] : rd_u16(&r));
+    for (uint32_t i = num_hmetrics; i < num_glyphs; i++)
+        put16(o + 2 * num_hmetrics + 2 * i, (flags & 2) ? (uint16_t)xmins[i] : rd_u16(&r));
+    if (r.bad) {
+        STBTT_free(o, 0);
+        return NULL;
+    }
+    return o;
+}
+
+static uint8_t* woff2_decode(const uint8_t *data, uint32_t len, int *persist, uint32_t *out_len) {
+    if (len < 48) return NULL;
+    uint32_t flavor = get32(data + 4);
+    uint32_t n = get16(data + 12), compressed = get32(data + 20);
+    if (flavor == 0x74746366u) return NULL; // collections are not supported
+
+    sfnt_table *t = (sfnt_table*)STBTT_malloc(n * (sizeof(sfnt_table) + 8) + 1, 0);
+    if (!t) return NULL;
+    uint32_t *xform_off = (uint32_t*)(t + n), *xform_len = xform_off + n;
+    uint8_t *stream = NULL, *glyf_buf = NULL, *hmtx_buf = NULL, *ttf = NULL;
+    int16_t *xmins = NULL;
+    int glyf = -1, loca = -1, hmtx = -1, hhea = -1;
+    uint32_t total = 0;
+
+    byte_reader r = { data + 48, data + len, 0 };
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t flags = rd_u8(&r);
+        t[i].tag = (flags & 63) == 63 ? rd_u32(&r) : get32((const uint8_t*)woff2_tags[flags & 63]);
+        t[i].len = rd_base128(&r);
+        // glyf and loca are transformed unless version 3, anything else
+        // only with a non-zero version
+        int is_glyf = t[i].tag == TAG_GLYF || t[i].tag == TAG_LOCA;
+        int transformed = is_glyf ? (flags >> 6) != 3 : (flags >> 6) != 0;
+        xform_len[i] = transformed ? rd_base128(&r) : t[i].len;
+        if (transformed && (is_glyf ? (flags >> 6) != 0 : t[i].tag != TAG_HMTX || (flags >> 6) != 1))
+            goto done;
+        if (xform_len[i] > len * 64u || total + xform_len[i] < total) goto done;
+        xform_off[i] = total;
+        total += xform_len[i];
+
+        if (t[i].tag == TAG_GLYF && transformed) glyf = (int)i;
+        if (t[i].tag == TAG_LOCA && transformed) loca = (int)i;
+        if (t[i].tag == TAG_HMTX && transformed) hmtx = (int)i;
+        if (t[i].tag == TAG_HHEA) hhea = (int)i;
+    }
+    if (r.bad || compressed > rd_remaining(&r) || (glyf < 0) != (loca < 0) || (hmtx >= 0 && glyf < 0))
+        goto done;
+
+    stream = (uint8_t*)STBTT_malloc(total + 1, 0);
+    if (!stream || !brotli_decode(r.p, compressed, stream, total)) goto done;
+    for (uint32_t i = 0; i < n; i++)
+        t[i].data = stream + xform_off[i];
+
+    uint32_t num_glyphs = 0;
+    if (glyf >= 0) {
+        if (!woff2_glyf(t[glyf].data, xform_len[glyf], &t[glyf], &t[loca], &xmins, &num_glyphs))
+            goto done;
+        glyf_buf = (uint8_t*)t[glyf].data;
+    }
+    if (hmtx >= 0) {
+        if (hhea < 0 || t[hhea].len < 36) goto done;
+        hmtx_buf = woff2_hmtx(t[hmtx].data, xform_len[hmtx], num_glyphs,
+            get16(t[hhea].data + 34), xmins, &t[hmtx].len);
+        if (!hmtx_buf) goto done;
+        t[hmtx].data = hmtx_buf;
+    }
+    ttf = sfnt_build(flavor, t, n, persist, out_len);
+
+done:
+    STBTT_free(stream, 0);
+    STBTT_free(glyf_buf, 0);
+    STBTT_free(hmtx_buf, 0);
+    STBTT_free(xmins, 0);
+    STBTT_free(t, 0);
+    return ttf;
+}
+#endif // TXT2SVG_WOFF2
+
+// Returns data itself unless it is a WOFF or WOFF2 font, in which case the
+// decoded TTF is returned and len updated; NULL if decoding failed.
+// Identifies a compressed font without reading all of it. The WOFF header
+// holds the file length and totalSfntSize and its table directory each
+// table's checksum. WOFF2 stores no checksums, so the start of its Brotli
+// stream, which follows a directory of at most 15 bytes a table, and the
+// end of the file stand in for them.
+static uint32_t woff_key(const uint8_t *data, uint32_t len) {
+    uint32_t n = len >= 14 ? get16(data + 12) : 0;
+    if (get32(data) == WOFF_MAGIC) {
+        uint32_t head = 44 + 20 * n;
+        return hash_bytes(data, head < len ? head : len);
+    }
+    uint32_t head = 48 + 15 * n + 64, tail = len < 64 ? len : 64;
+    return hash_bytes(data, head < len ? head : len) ^ (hash_bytes(data + len - tail, tail) * 31);
+}
+
+static const uint8_t* woff_load(const uint8_t *data, uint32_t *len) {
+    uint32_t magic = *len >= 4 ? get32(data) : 0;
+    if (magic != WOFF_MAGIC && magic != WOFF2_MAGIC) return data;
+
+    uint32_t hash = woff_key(data, *len);
+    for (int i = 0; i < num_woff_fonts; i++) {
+        if (woff_fonts[i].hash == hash && woff_fonts[i].len == *len) {
+            *len = woff_fonts[i].ttf_len;
+            return woff_fonts[i].ttf;
+        }
+    }
+
+    // once the cache or persistent memory is full, fonts are decoded into
+    // request scratch
+    int persist = num_woff_fonts < MAX_WOFF_FONTS;
+    uint32_t ttf_len = 0;
+    uint8_t *ttf = NULL;
+    if (magic == WOFF_MAGIC)
+        ttf = woff_decode(data, *len, &persist, &ttf_len);
+#ifdef TXT2SVG_WOFF2
+    else
+        ttf = woff2_decode(data, *len, &persist, &ttf_len);
+#endif
+    if (!ttf) return NULL;
+
+    if (persist) {
+        woff_entry *e = &woff_fonts[num_woff_fonts++];
+        e->hash = hash;
+        e->len = *len;
+        e->ttf = ttf;
+        e->ttf_len = ttf_len;
+    }
+    *len = ttf_len;
+    return ttf;
+}
+
+// ---------------- font ----------------
+// A bound font: a TrueType font parsed through stb_truetype, or a pack.
+// Layout only talks to fonts through these helpers.
+typedef struct {
+    stbtt_fontinfo info;
+    const pack_header *pack;
+    face_cache *cache;
+    uint32_t fingerprint;
+    var_instance var; // var.num_axes is 0 for the default instance
+} font_face;
+
+// Initialized faces, so that a resident font (built-in, decoded from WOFF,
+// or a collection serving several weights) is parsed once per face rather
+// than once per request. Entries are matched on the font's address, the
+// face offset and a hash of that face's table directory, so a different
+// font later copied to the same address is never mistaken for a cached one.
+#define MAX_FONT_INFOS 16
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t len, offset, dir_hash, fingerprint;
+    stbtt_fontinfo info;
+    face_cache *cache;
+} font_info_entry;
+
+static font_info_entry font_infos[MAX_FONT_INFOS];
+static int num_font_infos = 0, next_font_info = 0;
+
+// Binds face of the font at data, at the instance given by variations
+// (see var_parse; NULL or "" for the default instance).
+static int font_bind(font_face *f, const uint8_t *data, uint32_t len, int face, const char *variations) {
+    data = woff_load(data, &len);
+    if (!data) return 0;
+    f->pack = pack_bind(data, len);
+    f->cache = NULL;
+    f->var.num_axes = 0;
+    if (f->pack) {
+        f->fingerprint = f->pack->fingerprint;
+        return face == 0 && !(variations && *variations);
+    }
+
+    int offset = stbtt_GetFontOffsetForIndex(data, face);
+    if (offset < 0 || (uint32_t)offset + 12 > len) return 0;
+    uint32_t dir_len = 12 + 16 * get16(data + offset + 4);
+    if (offset + dir_len > len) return 0;
+    uint32_t dir_hash = hash_bytes(data + offset, dir_len);
+
+    font_info_entry *e = NULL;
+    for (int i = 0; i < num_font_infos && !e; i++) {
+        font_info_entry *c = &font_infos[i];
+        if (c->data == data && c->len == len && c->offset == (uint32_t)offset && c->dir_hash == dir_hash)
+            e = c;
+    }
+    if (e) {
+        f->info = e->info;
+        f->cache = e->cache;
+        f->fingerprint = e->fingerprint;
+    } else {
+        if (!stbtt_InitFont(&f->info, (unsigned char*)data, offset)) return 0;
+        lazy_attach(&f->info);
+        f->fingerprint = font_fingerprint(&f->info);
+        f->cache = face_cache_for(f->fingerprint);
+
+        // replaced round-robin once full
+        e = &font_infos[next_font_info];
+        next_font_info = (next_font_info + 1) % MAX_FONT_INFOS;
+        if (num_font_infos < MAX_FONT_INFOS) num_font_infos++;
+        e->data = data;
+        e->len = len;
+        e->offset = (uint32_t)offset;
+        e->dir_hash = dir_hash;
+        e->info = f->info;
+        e->cache = f->cache;
+        e->fingerprint = f->fingerprint;
+    }
+
+    int instance = var_parse(&f->info, variations, &f->var);
+    if (instance < 0) return 0;
+    if (instance) {
+        f->fingerprint ^= hash_bytes((const uint8_t*)f->var.coords, 2 * f->var.num_axes);
+        f->cache = face_cache_for(f->fingerprint);
+    }
+    return 1;
+}
+
+// Face index of the collection member whose family and style name match
+// name (e.g. "Noto Sans CJK JP Bold"), or -1. Plain fonts have one face.
+WASM_EXPORT
+int32_t wasm_font_face_index(void* font_ptr, uint32_t font_len, void* name_ptr) {
+    const uint8_t *data = woff_load((const uint8_t*)font_ptr, &font_len);
+    if (!data || pack_bind(data, font_len)) return -1;
+    int offset = stbtt_FindMatchingFont(data, (const char*)name_ptr, STBTT_MACSTYLE_DONTCARE);
+    if (offset < 0) return -1;
+    for (int i = 0; ; i++) {
+        int o = stbtt_GetFontOffsetForIndex(data, i);
+        if (o < 0) return -1;
+        if (o == offset) return i;
+    }
+}
+
+static void font_vmetrics(const font_face *f, int *ascent, int *descent, int *gap) {
+    if (f->pack) {
+        *ascent = f->pack->ascent;
+        *descent = f->pack->descent;
+        *gap = f->pack->line_gap;
+    } else {
+        stbtt_GetFontVMetrics(&f->info, ascent, descent, gap);
+    }
+}
+
+static float font_scale_for_pixel_height(const font_face *f, float height) {
+    int ascent, descent, gap;
+    font_vmetrics(f, &ascent, &descent, &gap);
+    return height / (ascent - descent);
+}
+
+static int font_glyph(const font_face *f, int codepoint) {
+    return f->pack ? pack_find_glyph(f->pack, codepoint)
+                   : stbtt_FindGlyphIndex(&f->info, codepoint);
+}
+
+static int font_advance(const font_face *f, int glyph) {
+    if (f->pack) {
+        if (glyph < 0 || (uint32_t)glyph >= f->pack->num_glyphs) return 0;
+        return ((const pack_metric*)pack_at(f->pack, f->pack->metrics_off))[glyph].advance;
+    }
+    int ax;
+    stbtt_GetGlyphHMetrics(&f->info, glyph, &ax, 0);
+    if (f->var.num_axes) ax += var_advance_delta(&f->info, &f->var, glyph);
+    return ax;
+}
+
+static int font_kern(const font_face *f, int g1, int g2) {
+    return f->pack ? pack_kern_advance(f->pack, g1, g2)
+                   : stbtt_GetGlyphKernAdvance(&f->info, g1, g2);
+}
+
+static void font_emit(const font_face *f, int glyph, glyph_pen *pen) {
+    if (f->pack) {
+        const outline *o = pack_outline(f->pack, glyph);
+        if (o) outline_emit(o, pen);
+    } else {
+        emit_glyph(&f->info, f->cache, f->var.num_axes ? &f->var : NULL, glyph, pen);
+    }
+}
+
+// ---------------- coverage ----------------
+// Which codepoints a font maps to a glyph, as a two-level bitset: a page
+// number for every 256 codepoints, pointing at 32-byte bit pages, with
+// page 0 left empty for all the pages a font doesn't touch. Built once per
+// font from its cmap (or a pack's ranges) and kept in persistent memory,
+// keyed by fingerprint, so a fallback check is two loads.
+
+#define COVERAGE_PAGES (0x110000 >> 8)
+#define MAX_COVERAGES 16
+
+typedef struct {
+    uint32_t fingerprint;
+    uint16_t pages[COVERAGE_PAGES];
+    uint8_t (*bits)[32]; // NULL while pages are being counted
+} coverage;
+
+static coverage *coverages[MAX_COVERAGES];
+static int num_coverages = 0;
+
+static int coverage_has(const coverage *c, int cp) {
+    if ((uint32_t)cp >= 0x110000) return 0;
+    return c->bits[c->pages[cp >> 8]][(cp >> 3) & 31] >> (cp & 7) & 1;
+}
+
+static void coverage_add(coverage *c, uint32_t first, uint32_t last) {
+    if (last > 0x10FFFF) last = 0x10FFFF;
+    if (!c->bits) {
+        for (uint32_t page = first >> 8; page <= last >> 8; page++) c->pages[page] = 1;
+        return;
+    }
+    for (uint32_t cp = first; cp <= last; cp++)
+        c->bits[c->pages[cp >> 8]][(cp >> 3) & 31] |= (uint8_t)(1 << (cp & 7));
+}
+
+// Adds every codepoint the font maps to a non-zero glyph.
+static void coverage_scan(coverage *c, const font_face *f) {
+    if (f->pack) {
+        const uint16_t *latin = pack_at(f->pack, f->pack->latin_off);
+        const pack_range *r = pack_at(f->pack, f->pack->ranges_off);
+        for (uint32_t cp = 0; cp < 256; cp++)
+            if (latin[cp]) coverage_add(c, cp, cp);
+        for (uint32_t i = 0; i < f->pack->num_ranges; i++)
+            if (r[i].count) coverage_add(c, r[i].first, r[i].first + r[i].count - 1);
+        return;
+    }
+
+    const stbtt_fontinfo *info = &f->info;
+    const uint8_t *m = info->data + info->index_map;
+    int format = get16(m);
+    if (format == 12 || format == 13) {
+        uint32_t groups = get32(m + 12);
+        for (uint32_t g = 0; g < groups; g++) {
+            const uint8_t *e = m + 16 + 12*g;
+            uint32_t first = get32(e), last = get32(e + 4), glyph = get32(e + 8);
+            if (!glyph) {
+                // format 13 maps the whole group to the one glyph, format
+                // 12 only its first codepoint
+                if (format == 13 || first == last) continue;
+                first++;
+            }
+            coverage_add(c, first, last);
+        }
+        return;
+    }
+
+    uint32_t first = 0, last = 0xFFFF;
+    if (format == 4) {
+        // only the segments need checking, glyph 0 can hide anywhere in them
+        uint32_t segs = get16(m + 6) / 2;
+        for (uint32_t s = 0; s < segs; s++) {
+            uint32_t end = get16(m + 14 + 2*s), start = get16(m + 16 + 2*segs + 2*s);
+            for (uint32_t cp = start; cp <= end && cp < 0xFFFF; cp++)
+                if (stbtt_FindGlyphIndex(info, (int)cp)) coverage_add(c, cp, cp);
+        }
+        return;
+    }
+    if (format == 0) last = 0xFF;
+    if (format == 6) {
+        first = get16(m + 6);
+        last = first + get16(m + 8) - 1;
+    }
+    for (uint32_t cp = first; cp <= last; cp++)
+        if (stbtt_FindGlyphIndex(info, (int)cp)) coverage_add(c, cp, cp);
+}
+
+// Coverage of a bound font. Once the cache is full coverage is built in
+// request scratch; NULL if there is no memory for it.
+static const coverage* coverage_for(const font_face *f) {
+    uint32_t fp = f->pack ? f->pack->fingerprint : font_fingerprint(&f->info);
+    for (int i = 0; i < num_coverages; i++)
+        if (coverages[i]->fingerprint == fp) return coverages[i];
+
+    int persist = num_coverages < MAX_COVERAGES;
+    coverage *c = persist ? (coverage*)persist_alloc(sizeof(coverage))
+                          : (coverage*)STBTT_malloc(sizeof(coverage), 0);
+    if (!c) return NULL;
+    STBTT_memset(c, 0, sizeof(coverage));
+    c->fingerprint = fp;
+
+    // first pass marks the pages in use, second sets their bits
+    coverage_scan(c, f);
+    uint32_t n = 1;
+    for (uint32_t page = 0; page < COVERAGE_PAGES; page++)
+        if (c->pages[page]) c->pages[page] = (uint16_t)n++;
+    c->bits = persist ? persist_alloc(n * 32) : STBTT_malloc(n * 32, 0);
+    if (!c->bits) {
+        // c is the latest persistent allocation, so it can be given back
+        if (persist) persist_release(c, sizeof(coverage));
+        else STBTT_free(c, 0);
+        return NULL;
+    }
+    STBTT_memset(c->bits, 0, n * 32);
+    coverage_scan(c, f);
+
+    if (persist) coverages[num_coverages++] = c;
+    return c;
+}
+
+// ---------------- gsub ----------------
+// Glyph substitution: the ccmp, locl, rlig, rclt, calt, clig and liga
+// features of the default language of the font's latn (else DFLT, else
+// first) script, applied in lookup list order. Single (1), ligature (4)
+// and chaining context (6) lookups are applied, also when wrapped in
+// extension (7) lookups; other types are skipped.
+//
+// A font's lookups are compiled once into flat tries kept in persistent
+// memory, keyed by fingerprint. A single substitution is a one-glyph
+// ligature, so types 1 and 4 share one trie: a node per matched prefix,
+// edges sorted by glyph, and the substitute on the node where a sequence
+// ends. A chaining lookup is a trie of depth one whose leaves list the
+// rules starting with that glyph. Rule glyph sets are range lists, the same
+// form for coverages and class definitions. Shaping a glyph is a binary
+// search per trie level instead of a walk through subtables and coverages.
+
+#define MAX_GSUB_PLANS 16
+#define GSUB_MAX_MATCH 16     // longest ligature or context input
+#define GSUB_DELETED 0xFFFF   // a ligature component that was merged away
+
+typedef struct { uint16_t start, end, cls; } gsub_range;
+
+// Glyphs of class cls in ranges[first..first+count); class 0 is every
+// glyph in no range. A coverage is class 1 of its own ranges.
+typedef struct { uint32_t first, count, cls; } gsub_set;
+
+typedef struct { uint32_t glyph, node; } gsub_edge;
+
+// In a chaining lookup's leaves, edges index rule_refs instead
+typedef struct { uint32_t edges, num_edges; int32_t sub; } gsub_node;
+
+typedef struct {
+    uint32_t sets;   // backtrack sets, input sets after the first glyph, lookahead sets
+    uint32_t substs; // (input index, lookup) pairs
+    uint16_t num_backtrack, num_input, num_lookahead, num_substs;
+} gsub_rule;
+
+typedef struct {
+    uint16_t chain; // root leaves list rules rather than substitutes
+    uint16_t flags; // LookupFlag
+    uint32_t root;
+} gsub_lookup;
+
+typedef struct {
+    uint32_t fingerprint;
+    uint32_t num_glyphs;
+    uint32_t num_order;
+    const uint16_t *order; // lookups to apply, in order
+    const gsub_lookup *lookups;
+    const gsub_node *nodes;
+    const gsub_edge *edges;
+    const gsub_rule *rules;
+    const uint32_t *rule_refs;
+    const gsub_set *sets;
+    const gsub_range *ranges;
+    const uint16_t *substs;
+    const uint8_t *classes; // GDEF glyph class per glyph, NULL if no lookup skips any
+    const uint8_t *starts;  // bit per glyph that starts a match in an applied lookup
+} gsub_plan;
+
+static gsub_plan *gsub_plans[MAX_GSUB_PLANS];
+static int num_gsub_plans = 0;
+
+// The plan is built in growable scratch arrays, then copied into one
+// block. Everything refers to everything else by index.
+enum { GV_ORDER, GV_LOOKUPS, GV_NODES, GV_EDGES, GV_RULES, GV_RULE_REFS,
+       GV_SETS, GV_RANGES, GV_SUBSTS, GV_COUNT };
+
+static const uint8_t gsub_elem_size[GV_COUNT] = {
+    sizeof(uint16_t), sizeof(gsub_lookup), sizeof(gsub_node), sizeof(gsub_edge),
+    sizeof(gsub_rule), sizeof(uint32_t), sizeof(gsub_set), sizeof(gsub_range), sizeof(uint16_t),
+};
+
+typedef struct {
+    uint8_t *data;
+    uint32_t len, cap, elem; // len and cap in elements
+} gsub_vec;
+
+typedef struct {
+    const uint8_t *t; // GSUB
+    uint32_t num_glyphs;
+    gsub_vec v[GV_COUNT];
+    uint16_t *slots;  // compiled lookup per lookup list index
+    int failed;
+} gsub_builder;
+
+#define GSUB_SLOT_NONE 0xFFFF  // not compiled yet
+#define GSUB_SLOT_SKIP 0xFFFE  // unsupported type
+
+// Appends count zeroed elements and returns the index of the first.
+// Element pointers taken before a push are invalidated by it.
+static uint32_t gsub_push(gsub_vec *v, uint32_t count, int *failed) {
+    if (!count) return v->len;
+    if (v->len + count > v->cap) {
+        uint32_t cap = v->cap ? v->cap * 2 : 64;
+        while (cap < v->len + count) cap *= 2;
+        uint8_t *data = (uint8_t*)STBTT_malloc(cap * v->elem, 0);
+        if (!data) {
+            *failed = 1;
+            return 0;
+        }
+        if (v->len) STBTT_memcpy(data, v->data, v->len * v->elem);
+        STBTT_free(v->data, 0);
+        v->data = data;
+        v->cap = cap;
+    }
+    STBTT_memset(v->data + v->len * v->elem, 0, count * v->elem);
+    v->len += count;
+    return v->len - count;
+}
+
+#define GV(b, k, T) ((T*)(b)->v[k].data)
+
+// The glyphs of a coverage table in coverage index order, in scratch
+static uint32_t gsub_coverage_glyphs(const uint8_t *cov, uint16_t **glyphs) {
+    uint32_t format = get16(cov), n = get16(cov + 2), count = 0;
+    if (format == 1) count = n;
+    else if (format == 2)
+        for (uint32_t r = 0; r < n; r++) {
+            const uint8_t *e = cov + 4 + 6*r;
+            if (get16(e + 2) >= get16(e)) count += get16(e + 2) - get16(e) + 1;
+        }
+    if (count > 65536) count = 65536;
+    *glyphs = (uint16_t*)STBTT_malloc(2 * count + 2, 0);
+    if (!*glyphs) return 0;
+
+    uint32_t k = 0;
+    if (format == 1)
+        for (; k < count; k++) (*glyphs)[k] = (uint16_t)get16(cov + 4 + 2*k);
+    else if (format == 2)
+        for (uint32_t r = 0; r < n; r++) {
+            const uint8_t *e = cov + 4 + 6*r;
+            for (uint32_t g = get16(e); g <= get16(e + 2) && k < count; g++) (*glyphs)[k++] = (uint16_t)g;
+        }
+    return k;
+}
+
+static uint32_t gsub_add_range(gsub_builder *b, uint32_t start, uint32_t end, uint32_t cls) {
+    uint32_t i = gsub_push(&b->v[GV_RANGES], 1, &b->failed);
+    if (b->failed) return 0;
+    gsub_range *r = GV(b, GV_RANGES, gsub_range) + i;
+    r->start = (uint16_t)start;
+    r->end = (uint16_t)end;
+    r->cls = (uint16_t)cls;
+    return i;
+}
+
+// A coverage table as a set
+static uint32_t gsub_coverage_set(gsub_builder *b, const uint8_t *cov) {
+    uint32_t format = get16(cov), n = get16(cov + 2);
+    uint32_t first = b->v[GV_RANGES].len;
+    if (format == 1) {
+        // runs of consecutive glyphs become one range
+        for (uint32_t i = 0; i < n; ) {
+            uint32_t start = get16(cov + 4 + 2*i), end = start;
+            while (++i < n && get16(cov + 4 + 2*i) == end + 1) end++;
+            gsub_add_range(b, start, end, 1);
+        }
+    } else if (format == 2) {
+        for (uint32_t r = 0; r < n; r++)
+            gsub_add_range(b, get16(cov + 4 + 6*r), get16(cov + 6 + 6*r), 1);
+    }
+    uint32_t s = gsub_push(&b->v[GV_SETS], 1, &b->failed);
+    if (b->failed) return 0;
+    gsub_set *set = GV(b, GV_SETS, gsub_set) + s;
+    set->first = first;
+    set->count = b->v[GV_RANGES].len - first;
+    set->cls = 1;
+    return s;
+}
+
+static uint32_t gsub_glyph_set(gsub_builder *b, uint32_t glyph) {
+    uint32_t first = gsub_add_range(b, glyph, glyph, 1);
+    uint32_t s = gsub_push(&b->v[GV_SETS], 1, &b->failed);
+    if (b->failed) return 0;
+    gsub_set *set = GV(b, GV_SETS, gsub_set) + s;
+    set->first = first;
+    set->count = 1;
+    set->cls = 1;
+    return s;
+}
+
+// Appends a class definition as ranges (class 0 left implicit) and
+// returns the first; *count gets their number.
+static uint32_t gsub_class_ranges(gsub_builder *b, const uint8_t *cd, uint32_t *count) {
+    uint32_t first = b->v[GV_RANGES].len;
+    uint32_t format = get16(cd);
+    if (format == 1) {
+        uint32_t start = get16(cd + 2), n = get16(cd + 4);
+        for (uint32_t i = 0; i < n; ) {
+            uint32_t cls = get16(cd + 6 + 2*i), j = i;
+            while (j + 1 < n && get16(cd + 6 + 2*(j + 1)) == cls) j++;
+            if (cls) gsub_add_range(b, start + i, start + j, cls);
+            i = j + 1;
+        }
+    } else if (format == 2) {
+        uint32_t n = get16(cd + 2);
+        for (uint32_t r = 0; r < n; r++) {
+            const uint8_t *e = cd + 4 + 6*r;
+            if (get16(e + 4)) gsub_add_range(b, get16(e), get16(e + 2), get16(e + 4));
+        }
+    }
+    *count = b->v[GV_RANGES].len - first;
+    return first;
+}
+
+static uint32_t gsub_range_class(const gsub_range *r, uint32_t count, uint32_t glyph) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (glyph < r[mid].start) hi = mid;
+        else if (glyph > r[mid].end) lo = mid + 1;
+        else return r[mid].cls;
+    }
+    return 0;
+}
+
+static uint32_t gsub_class_set(gsub_builder *b, uint32_t first, uint32_t count, uint32_t cls) {
+    uint32_t s = gsub_push(&b->v[GV_SETS], 1, &b->failed);
+    if (b->failed) return 0;
+    gsub_set *set = GV(b, GV_SETS, gsub_set) + s;
+    set->first = first;
+    set->count = count;
+    set->cls = cls;
+    return s;
+}
+
+// A glyph sequence and what it maps to: the substitute for a trie, the
+// rule for a chaining lookup's root
+typedef struct {
+    uint32_t seq; // into the entry pool
+    uint32_t len;
+    int32_t value;
+} gsub_entry;
+
+typedef struct {
+    gsub_vec entries, pool;
+} gsub_entries;
+
+static void gsub_entry_add(gsub_builder *b, gsub_entries *e, uint32_t first,
+                           const uint8_t *rest, uint32_t rest_len, int32_t value) {
+    if (rest_len + 1 > GSUB_MAX_MATCH) return;
+    uint32_t seq = gsub_push(&e->pool, rest_len + 1, &b->failed);
+    uint32_t i = gsub_push(&e->entries, 1, &b->failed);
+    if (b->failed) return;
+    uint16_t *s = (uint16_t*)e->pool.data + seq;
+    s[0] = (uint16_t)first;
+    for (uint32_t k = 0; k < rest_len; k++) s[k + 1] = (uint16_t)get16(rest + 2*k);
+    gsub_entry *en = (gsub_entry*)e->entries.data + i;
+    en->seq = seq;
+    en->len = rest_len + 1;
+    en->value = value;
+}
+
+static int gsub_entry_less(const uint16_t *pool, const gsub_entry *a, const gsub_entry *b) {
+    for (uint32_t k = 0; k < a->len && k < b->len; k++)
+        if (pool[a->seq + k] != pool[b->seq + k]) return pool[a->seq + k] < pool[b->seq + k];
+    return a->len < b->len;
+}
+
+// Stable bottom-up merge sort, so the first of several entries for one
+// sequence (the first subtable's) stays first
+static int gsub_sort(gsub_entries *e) {
+    uint32_t n = e->entries.len;
+    gsub_entry *a = (gsub_entry*)e->entries.data;
+    gsub_entry *t = (gsub_entry*)STBTT_malloc(n * sizeof(gsub_entry) + 1, 0);
+    if (!t) return 0;
+    const uint16_t *pool = (const uint16_t*)e->pool.data;
+    for (uint32_t w = 1; w < n; w *= 2) {
+        for (uint32_t lo = 0; lo < n; lo += 2*w) {
+            uint32_t mid = lo + w < n ? lo + w : n, hi = lo + 2*w < n ? lo + 2*w : n;
+            uint32_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) t[k++] = gsub_entry_less(pool, &a[j], &a[i]) ? a[j++] : a[i++];
+            while (i < mid) t[k++] = a[i++];
+            while (j < hi) t[k++] = a[j++];
+        }
+        STBTT_memcpy(a, t, n * sizeof(gsub_entry));
+    }
+    STBTT_free(t, 0);
+    return 1;
+}
+
+// Builds the trie node for the sorted entries [lo, hi) sharing their
+// first depth glyphs; entries ending here sort first and the first wins
+static uint32_t gsub_trie(gsub_builder *b, const gsub_entries *e, uint32_t lo, uint32_t hi, uint32_t depth) {
+    const gsub_entry *en = (const gsub_entry*)e->entries.data;
+    const uint16_t *pool = (const uint16_t*)e->pool.data;
+    uint32_t node = gsub_push(&b->v[GV_NODES], 1, &b->failed);
+    if (b->failed) return 0;
+    int32_t sub = -1;
+    for (; lo < hi && en[lo].len == depth; lo++)
+        if (sub < 0) sub = en[lo].value;
+
+    uint32_t num_edges = 0;
+    for (uint32_t i = lo; i < hi; i++)
+        if (i == lo || pool[en[i].seq + depth] != pool[en[i - 1].seq + depth]) num_edges++;
+    uint32_t edges = gsub_push(&b->v[GV_EDGES], num_edges, &b->failed);
+    if (b->failed) return 0;
+    gsub_node *nd = GV(b, GV_NODES, gsub_node) + node;
+    nd->edges = edges;
+    nd->num_edges = num_edges;
+    nd->sub = sub;
+
+    for (uint32_t i = lo, k = 0; i < hi; k++) {
+        uint32_t glyph = pool[en[i].seq + depth], j = i;
+        while (j < hi && pool[en[j].seq + depth] == glyph) j++;
+        uint32_t child = gsub_trie(b, e, i, j, depth + 1);
+        if (b->failed) return 0;
+        gsub_edge *ed = GV(b, GV_EDGES, gsub_edge) + edges + k;
+        ed->glyph = glyph;
+        ed->node = child;
+        i = j;
+    }
+    return node;
+}
+
+// The root of a chaining lookup: an edge per first glyph to a leaf
+// listing its rules, in subtable order
+static uint32_t gsub_rule_root(gsub_builder *b, const gsub_entries *e) {
+    const gsub_entry *en = (const gsub_entry*)e->entries.data;
+    const uint16_t *pool = (const uint16_t*)e->pool.data;
+    uint32_t n = e->entries.len;
+    uint32_t root = gsub_push(&b->v[GV_NODES], 1, &b->failed);
+    uint32_t num_edges = 0;
+    for (uint32_t i = 0; i < n; i++)
+        if (i == 0 || pool[en[i].seq] != pool[en[i - 1].seq]) num_edges++;
+    uint32_t edges = gsub_push(&b->v[GV_EDGES], num_edges, &b->failed);
+    uint32_t refs = gsub_push(&b->v[GV_RULE_REFS], n, &b->failed);
+    uint32_t leaves = gsub_push(&b->v[GV_NODES], num_edges, &b->failed);
+    if (b->failed) return 0;
+
+    gsub_node *nodes = GV(b, GV_NODES, gsub_node);
+    nodes[root].edges = edges;
+    nodes[root].num_edges = num_edges;
+    nodes[root].sub = -1;
+    for (uint32_t i = 0, k = 0; i < n; k++) {
+        uint32_t glyph = pool[en[i].seq], j = i;
+        gsub_node *leaf = &nodes[leaves + k];
+        leaf->edges = refs + i;
+        leaf->sub = -1;
+        for (; j < n && pool[en[j].seq] == glyph; j++)
+            GV(b, GV_RULE_REFS, uint32_t)[refs + j] = (uint32_t)en[j].value;
+        leaf->num_edges = j - i;
+        GV(b, GV_EDGES, gsub_edge)[edges + k].glyph = glyph;
+        GV(b, GV_EDGES, gsub_edge)[edges + k].node = leaves + k;
+        i = j;
+    }
+    return root;
+}
+
+static int gsub_compile(gsub_builder *b, uint32_t index, int nested);
+
+// Appends a rule; sets are filled in by the caller
+static uint32_t gsub_rule_add(gsub_builder *b, uint32_t num_backtrack, uint32_t num_input,
+                              uint32_t num_lookahead, const uint8_t *records, uint32_t num_substs) {
+    uint32_t r = gsub_push(&b->v[GV_RULES], 1, &b->failed);
+    uint32_t substs = gsub_push(&b->v[GV_SUBSTS], 2 * num_substs, &b->failed);
+    if (b->failed) return 0;
+    for (uint32_t k = 0; k < num_substs; k++) {
+        int slot = gsub_compile(b, get16(records + 4*k + 2), 1);
+        uint16_t *s = GV(b, GV_SUBSTS, uint16_t) + substs + 2*k;
+        s[0] = (uint16_t)get16(records + 4*k);
+        s[1] = slot < 0 ? GSUB_SLOT_SKIP : (uint16_t)slot;
+    }
+    gsub_rule *rule = GV(b, GV_RULES, gsub_rule) + r;
+    rule->sets = b->v[GV_SETS].len;
+    rule->substs = substs;
+    rule->num_backtrack = (uint16_t)num_backtrack;
+    rule->num_input = (uint16_t)num_input;
+    rule->num_lookahead = (uint16_t)num_lookahead;
+    rule->num_substs = (uint16_t)num_substs;
+    return r;
+}
+
+// Format 1 and 2 chaining rules: glyphs, or classes of the three class
+// definitions. The rule's first input glyph is matched by the root.
+static int32_t gsub_chain_rule(gsub_builder *b, const uint8_t *r, const uint32_t *cd) {
+    uint32_t nb = get16(r);
+    const uint8_t *in = r + 2 + 2*nb;
+    uint32_t ni = get16(in);
+    const uint8_t *la = in + 2*ni;
+    uint32_t nl = get16(la);
+    const uint8_t *sub = la + 2 + 2*nl;
+    if (!ni || ni > GSUB_MAX_MATCH) return -1;
+
+    uint32_t rule = gsub_rule_add(b, nb, ni, nl, sub + 2, get16(sub));
+    for (uint32_t k = 0; k < nb; k++)
+        cd ? gsub_class_set(b, cd[0], cd[1], get16(r + 2 + 2*k)) : gsub_glyph_set(b, get16(r + 2 + 2*k));
+    for (uint32_t k = 1; k < ni; k++)
+        cd ? gsub_class_set(b, cd[2], cd[3], get16(in + 2*k)) : gsub_glyph_set(b, get16(in + 2*k));
+    for (uint32_t k = 0; k < nl; k++)
+        cd ? gsub_class_set(b, cd[4], cd[5], get16(la + 2 + 2*k)) : gsub_glyph_set(b, get16(la + 2 + 2*k));
+    return (int32_t)rule;
+}
+
+// Adds the entries of one substitution subtable (type 1 or 4)
+static void gsub_subst_entries(gsub_builder *b, gsub_entries *e, uint32_t type, const uint8_t *st) {
+    uint16_t *glyphs;
+    uint32_t n = gsub_coverage_glyphs(st + get16(st + 2), &glyphs);
+    uint32_t format = get16(st);
+    for (uint32_t i = 0; i < n; i++) {
+        if (type == 1 && format == 1)
+            gsub_entry_add(b, e, glyphs[i], NULL, 0, (glyphs[i] + get16(st + 4)) & 0xFFFF);
+        else if (type == 1 && format == 2 && i < get16(st + 4))
+            gsub_entry_add(b, e, glyphs[i], NULL, 0, get16(st + 6 + 2*i));
+        else if (type == 4 && format == 1 && i < get16(st + 4)) {
+            const uint8_t *set = st + get16(st + 6 + 2*i);
+            for (uint32_t l = 0; l < get16(set); l++) {
+                const uint8_t *lig = set + get16(set + 2 + 2*l);
+                uint32_t comps = get16(lig + 2);
+                if (comps) gsub_entry_add(b, e, glyphs[i], lig + 4, comps - 1, get16(lig));
+            }
+        }
+    }
+    STBTT_free(glyphs, 0);
+}
+
+// Adds the rules of one chaining context subtable (type 6) to e, keyed
+// by their first input glyph
+static void gsub_chain_entries(gsub_builder *b, gsub_entries *e, const uint8_t *st) {
+    uint32_t format = get16(st);
+    uint16_t *glyphs;
+    if (format == 1 || format == 2) {
+        uint32_t n = gsub_coverage_glyphs(st + get16(st + 2), &glyphs);
+        uint32_t cd[6], num_sets = get16(st + (format == 1 ? 4 : 10));
+        const uint8_t *sets = st + (format == 1 ? 6 : 12);
+        if (format == 2)
+            for (int k = 0; k < 3; k++) cd[2*k] = gsub_class_ranges(b, st + get16(st + 4 + 2*k), &cd[2*k + 1]);
+        // format 1 has a rule set per covered glyph, format 2 one per class
+        // of the first glyph, shared by every glyph of the class
+        gsub_vec rules = { NULL, 0, 0, sizeof(uint32_t) };
+        uint32_t *first = (uint32_t*)STBTT_malloc(4 * num_sets + 4, 0);
+        if (!first) b->failed = 1;
+        for (uint32_t set = 0; set < num_sets && !b->failed; set++) {
+            first[set] = rules.len;
+            if (!get16(sets + 2*set)) continue;
+            const uint8_t *rs = st + get16(sets + 2*set);
+            for (uint32_t r = 0; r < get16(rs); r++) {
+                int32_t rule = gsub_chain_rule(b, rs + get16(rs + 2 + 2*r), format == 2 ? cd : NULL);
+                if (rule < 0) continue;
+                uint32_t k = gsub_push(&rules, 1, &b->failed);
+                if (!b->failed) ((uint32_t*)rules.data)[k] = (uint32_t)rule;
+            }
+        }
+        if (first) first[num_sets] = rules.len;
+        for (uint32_t i = 0; i < n && !b->failed; i++) {
+            uint32_t set = format == 1 ? i
+                : gsub_range_class(GV(b, GV_RANGES, gsub_range) + cd[2], cd[3], glyphs[i]);
+            if (set >= num_sets) continue;
+            for (uint32_t r = first[set]; r < first[set + 1]; r++)
+                gsub_entry_add(b, e, glyphs[i], NULL, 0, (int32_t)((uint32_t*)rules.data)[r]);
+        }
+        STBTT_free(rules.data, 0);
+        STBTT_free(first, 0);
+        STBTT_free(glyphs, 0);
+    } else if (format == 3) {
+        uint32_t nb = get16(st + 2);
+        const uint8_t *in = st + 4 + 2*nb;
+        uint32_t ni = get16(in);
+        const uint8_t *la = in + 2 + 2*ni;
+        uint32_t nl = get16(la);
+        const uint8_t *sub = la + 2 + 2*nl;
+        if (!ni || ni > GSUB_MAX_MATCH) return;
+        uint32_t rule = gsub_rule_add(b, nb, ni, nl, sub + 2, get16(sub));
+        for (uint32_t k = 0; k < nb; k++) gsub_coverage_set(b, st + get16(st + 4 + 2*k));
+        for (uint32_t k = 1; k < ni; k++) gsub_coverage_set(b, st + get16(in + 2 + 2*k));
+        for (uint32_t k = 0; k < nl; k++) gsub_coverage_set(b, st + get16(la + 2 + 2*k));
+        uint32_t n = gsub_coverage_glyphs(st + get16(in + 2), &glyphs);
+        for (uint32_t i = 0; i < n; i++) gsub_entry_add(b, e, glyphs[i], NULL, 0, (int32_t)rule);
+        STBTT_free(glyphs, 0);
+    }
+}
+
+// Compiles lookup index of the LookupList, once, and returns its slot or
+// -1 if it has an unsupported type. Lookups nested in a chaining rule
+// can only be substitutions.
+static int gsub_compile(gsub_builder *b, uint32_t index, int nested) {
+    const uint8_t *list = b->t + get16(b->t + 8);
+    if (index >= get16(list) || b->failed) return -1;
+    if (b->slots[index] != GSUB_SLOT_NONE)
+        return b->slots[index] == GSUB_SLOT_SKIP ? -1 : b->slots[index];
+    b->slots[index] = GSUB_SLOT_SKIP;
+
+    const uint8_t *lookup = list + get16(list + 2 + 2*index);
+    uint32_t type = get16(lookup), flags = get16(lookup + 2), num = get16(lookup + 4);
+    if (type == 7 && num) {
+        const uint8_t *ext = lookup + get16(lookup + 6);
+        type = get16(ext + 2);
+    }
+    if (type != 1 && type != 4 && (type != 6 || nested)) return -1;
+
+    uint32_t slot = gsub_push(&b->v[GV_LOOKUPS], 1, &b->failed);
+    gsub_entries e = { { NULL, 0, 0, sizeof(gsub_entry) }, { NULL, 0, 0, sizeof(uint16_t) } };
+    for (uint32_t s = 0; s < num && !b->failed; s++) {
+        const uint8_t *st = lookup + get16(lookup + 6 + 2*s);
+        if (get16(lookup) == 7) st += get32(st + 4);
+        if (type == 6) gsub_chain_entries(b, &e, st);
+        else gsub_subst_entries(b, &e, type, st);
+    }
+    uint32_t root = 0;
+    if (!b->failed && gsub_sort(&e))
+        root = type == 6 ? gsub_rule_root(b, &e) : gsub_trie(b, &e, 0, e.entries.len, 0);
+    else
+        b->failed = 1;
+    STBTT_free(e.entries.data, 0);
+    STBTT_free(e.pool.data, 0);
+    if (b->failed) return -1;
+
+    gsub_lookup *l = GV(b, GV_LOOKUPS, gsub_lookup) + slot;
+    l->chain = type == 6;
+    l->flags = (uint16_t)flags;
+    l->root = root;
+    b->slots[index] = (uint16_t)slot;
+    return (int)slot;
+}
+
+// Lookup list indices of the default features, in ascending order, as
+// marks in a lookupCount array
+static int gsub_features(const uint8_t *t, uint8_t *marks) {
+    static const char features[][5] = { "ccmp", "locl", "rlig", "rclt", "calt", "clig", "liga" };
+    const uint8_t *scripts = t + get16(t + 4), *feats = t + get16(t + 6);
+    const uint8_t *lookups = t + get16(t + 8);
+    uint32_t num_scripts = get16(scripts);
+    if (!num_scripts) return 0;
+
+    static const char prefer[][5] = { "latn", "DFLT" };
+    const uint8_t *script = NULL;
+    for (int pass = 0; pass < 2 && !script; pass++)
+        for (uint32_t i = 0; i < num_scripts && !script; i++)
+            if (stbtt_tag(scripts + 2 + 6*i, prefer[pass]))
+                script = scripts + get16(scripts + 2 + 6*i + 4);
+    if (!script) script = scripts + get16(scripts + 6);
+    if (!get16(script)) return 0;
+    const uint8_t *lang = script + get16(script);
+
+    uint32_t num_lookups = get16(lookups), found = 0;
+    uint32_t required = get16(lang + 2), num_feats = get16(lang + 4);
+    for (uint32_t i = 0; i <= num_feats; i++) {
+        uint32_t fi = i < num_feats ? get16(lang + 6 + 2*i) : required;
+        if (fi >= get16(feats)) continue;
+        const uint8_t *rec = feats + 2 + 6*fi;
+        int wanted = i == num_feats;
+        for (uint32_t k = 0; k < sizeof(features) / sizeof(features[0]) && !wanted; k++)
+            wanted = stbtt_tag(rec, features[k]);
+        if (!wanted) continue;
+        const uint8_t *feat = feats + get16(rec + 4);
+        for (uint32_t k = 0; k < get16(feat + 2); k++) {
+            uint32_t li = get16(feat + 4 + 2*k);
+            if (li < num_lookups && !marks[li]) {
+                marks[li] = 1;
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+// Compiles the plan for a font. Plans for fonts without GSUB, or with
+// none of the default features, have no lookups to apply.
+static gsub_plan* gsub_build(const stbtt_fontinfo *info, uint32_t fp, int persist) {
+    gsub_builder b;
+    STBTT_memset(&b, 0, sizeof(b));
+    for (int k = 0; k < GV_COUNT; k++) b.v[k].elem = gsub_elem_size[k];
+    b.num_glyphs = (uint32_t)info->numGlyphs;
+    uint32_t gsub = stbtt__find_table(info->data, info->fontstart, "GSUB");
+    uint32_t num_list = 0;
+    uint8_t *marks = NULL;
+    if (gsub && get16(info->data + gsub) == 1) {
+        b.t = info->data + gsub;
+        num_list = get16(b.t + get16(b.t + 8));
+        marks = (uint8_t*)STBTT_malloc(num_list + 1, 0);
+        b.slots = (uint16_t*)STBTT_malloc(2 * num_list + 2, 0);
+        if (!marks || !b.slots) b.failed = 1;
+        else {
+            STBTT_memset(marks, 0, num_list);
+            for (uint32_t i = 0; i < num_list; i++) b.slots[i] = GSUB_SLOT_NONE;
+            gsub_features(b.t, marks);
+        }
+    }
+    for (uint32_t i = 0; i < num_list && !b.failed; i++) {
+        if (!marks[i]) continue;
+        int slot = gsub_compile(&b, i, 0);
+        if (slot < 0) continue;
+        uint32_t o = gsub_push(&b.v[GV_ORDER], 1, &b.failed);
+        if (!b.failed) GV(&b, GV_ORDER, uint16_t)[o] = (uint16_t)slot;
+    }
+
+    // out of scratch: build again next time rather than cache a plan
+    // without lookups
+    uint8_t *block = NULL;
+    if (b.failed) goto done;
+
+    // one block: the plan, the starts bitset, GDEF classes, then the arrays
+    uint32_t num_order = b.v[GV_ORDER].len;
+    int skips = 0;
+    for (uint32_t i = 0; i < b.v[GV_LOOKUPS].len && num_order; i++)
+        skips |= GV(&b, GV_LOOKUPS, gsub_lookup)[i].flags & 0xE;
+    uint32_t gdef = skips ? stbtt__find_table(info->data, info->fontstart, "GDEF") : 0;
+    if (gdef && !get16(info->data + gdef + 4)) gdef = 0;
+    uint32_t starts_len = num_order ? (b.num_glyphs + 8) / 8 : 0;
+    uint32_t classes_len = gdef ? b.num_glyphs : 0;
+    uint32_t size = (sizeof(gsub_plan) + starts_len + classes_len + 7) & ~7u;
+    uint32_t offs[GV_COUNT];
+    for (int k = 0; k < GV_COUNT; k++) {
+        offs[k] = size;
+        if (num_order) size += (b.v[k].len * b.v[k].elem + 7) & ~7u;
+    }
+    block = persist ? (uint8_t*)persist_alloc(size) : (uint8_t*)STBTT_malloc(size, 0);
+    if (block) {
+        gsub_plan *p = (gsub_plan*)block;
+        STBTT_memset(block, 0, size);
+        p->fingerprint = fp;
+        p->num_glyphs = b.num_glyphs;
+        p->num_order = num_order;
+        if (num_order) {
+            for (int k = 0; k < GV_COUNT; k++)
+                if (b.v[k].len) STBTT_memcpy(block + offs[k], b.v[k].data, b.v[k].len * b.v[k].elem);
+            p->order = (const uint16_t*)(block + offs[GV_ORDER]);
+            p->lookups = (const gsub_lookup*)(block + offs[GV_LOOKUPS]);
+            p->nodes = (const gsub_node*)(block + offs[GV_NODES]);
+            p->edges = (const gsub_edge*)(block + offs[GV_EDGES]);
+            p->rules = (const gsub_rule*)(block + offs[GV_RULES]);
+            p->rule_refs = (const uint32_t*)(block + offs[GV_RULE_REFS]);
+            p->sets = (const gsub_set*)(block + offs[GV_SETS]);
+            p->ranges = (const gsub_range*)(block + offs[GV_RANGES]);
+            p->substs = (const uint16_t*)(block + offs[GV_SUBSTS]);
+
+            uint8_t *starts = block + sizeof(gsub_plan);
+            for (uint32_t o = 0; o < num_order; o++) {
+                const gsub_node *root = &p->nodes[p->lookups[p->order[o]].root];
+                for (uint32_t k = 0; k < root->num_edges; k++) {
+                    uint32_t g = p->edges[root->edges + k].glyph;
+                    if (g < b.num_glyphs) starts[g >> 3] |= (uint8_t)(1 << (g & 7));
+                }
+            }
+            p->starts = starts;
+
+            if (gdef) {
+                uint8_t *classes = starts + starts_len;
+                const uint8_t *cd = info->data + gdef + get16(info->data + gdef + 4);
+                uint32_t first = b.v[GV_RANGES].len, count;
+                gsub_class_ranges(&b, cd, &count);
+                if (!b.failed)
+                    for (uint32_t g = 0; g < b.num_glyphs; g++)
+                        classes[g] = (uint8_t)gsub_range_class(GV(&b, GV_RANGES, gsub_range) + first, count, g);
+                p->classes = classes;
+            }
+        }
+    }
+
+done:
+    for (int k = 0; k < GV_COUNT; k++) STBTT_free(b.v[k].data, 0);
+    STBTT_free(b.slots, 0);
+    STBTT_free(marks, 0);
+    return (gsub_plan*)block;
+}
+
+// Substitution plan of a bound font, or NULL for packs (which keep no
+// GSUB) and when memory runs out. Once the cache is full plans are built
+// in request scratch.
+static const gsub_plan* gsub_plan_for(const font_face *f) {
+    if (f->pack) return NULL;
+    uint32_t fp = font_fingerprint(&f->info);
+    gsub_plan *p = NULL;
+    for (int i = 0; i < num_gsub_plans && !p; i++)
+        if (gsub_plans[i]->fingerprint == fp) p = gsub_plans[i];
+    if (!p) {
+        int persist = num_gsub_plans < MAX_GSUB_PLANS;
+        p = gsub_build(&f->info, fp, persist);
+        if (p && persist) gsub_plans[num_gsub_plans++] = p;
+    }
+    return p && p->num_order ? p : NULL;
+}
+
+static int gsub_skip(const gsub_plan *p, uint32_t flags, uint32_t glyph) {
+    if (glyph == GSUB_DELETED) return 1;
+    if (!(flags & 0xE) || !p->classes || glyph >= p->num_glyphs) return 0;
+    uint32_t cls = p->classes[glyph];
+    return (cls == 1 && (flags & 2)) || (cls == 2 && (flags & 4)) || (cls == 3 && (flags & 8));
+}
+
+static int gsub_next(const gsub_plan *p, uint32_t flags, const uint16_t *g, int n, int i) {
+    while (++i < n && gsub_skip(p, flags, g[i])) {}
+    return i;
+}
+
+static int gsub_prev(const gsub_plan *p, uint32_t flags, const uint16_t *g, int i) {
+    while (--i >= 0 && gsub_skip(p, flags, g[i])) {}
+    return i;
+}
+
+static const gsub_node* gsub_step(const gsub_plan *p, const gsub_node *node, uint32_t glyph) {
+    const gsub_edge *e = p->edges + node->edges;
+    uint32_t lo = 0, hi = node->num_edges;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (e[mid].glyph < glyph) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < node->num_edges && e[lo].glyph == glyph ? &p->nodes[e[lo].node] : NULL;
+}
+
+static int gsub_set_has(const gsub_plan *p, const gsub_set *s, uint32_t glyph) {
+    return gsub_range_class(p->ranges + s->first, s->count, glyph) == s->cls;
+}
+
+// Applies a substitution trie at i, longest match first. The substitute
+// replaces the first glyph and the other components are deleted.
+static void gsub_apply_trie(const gsub_plan *p, const gsub_lookup *l, uint16_t *g, int n, int i) {
+    const gsub_node *node = &p->nodes[l->root];
+    int pos[GSUB_MAX_MATCH], depth = 0, best = 0;
+    int32_t sub = -1;
+    for (int j = i; j < n && depth < GSUB_MAX_MATCH; j = gsub_next(p, l->flags, g, n, j)) {
+        node = gsub_step(p, node, g[j]);
+        if (!node) break;
+        pos[depth++] = j;
+        if (node->sub >= 0) {
+            best = depth;
+            sub = node->sub;
+        }
+    }
+    if (!best) return;
+    g[i] = (uint16_t)sub;
+    for (int k = 1; k < best; k++) g[pos[k]] = GSUB_DELETED;
+}
+
+// Tries the rules of a chaining lookup at i. Returns the index after the
+// matched input, or 0 if no rule matched.
+static int gsub_apply_chain(const gsub_plan *p, const gsub_lookup *l, uint16_t *g, int n, int i) {
+    const gsub_node *leaf = gsub_step(p, &p->nodes[l->root], g[i]);
+    if (!leaf) return 0;
+    for (uint32_t r = 0; r < leaf->num_edges; r++) {
+        const gsub_rule *rule = &p->rules[p->rule_refs[leaf->edges + r]];
+        const gsub_set *set = &p->sets[rule->sets];
+        int pos[GSUB_MAX_MATCH], ok = 1, j = i;
+        for (uint32_t k = 0; k < rule->num_backtrack && ok; k++, set++) {
+            j = gsub_prev(p, l->flags, g, j);
+            ok = j >= 0 && gsub_set_has(p, set, g[j]);
+        }
+        pos[0] = j = i;
+        for (uint32_t k = 1; k < rule->num_input && ok; k++, set++) {
+            pos[k] = j = gsub_next(p, l->flags, g, n, j);
+            ok = j < n && gsub_set_has(p, set, g[j]);
+        }
+        int end = j + 1;
+        for (uint32_t k = 0; k < rule->num_lookahead && ok; k++, set++) {
+            j = gsub_next(p, l->flags, g, n, j);
+            ok = j < n && gsub_set_has(p, set, g[j]);
+        }
+        if (!ok) continue;
+
+        const uint16_t *s = p->substs + rule->substs;
+        for (uint32_t k = 0; k < rule->num_substs; k++, s += 2) {
+            if (s[0] >= rule->num_input || s[1] == GSUB_SLOT_SKIP) continue;
+            const gsub_lookup *nested = &p->lookups[s[1]];
+            if (!gsub_skip(p, nested->flags, g[pos[s[0]]]))
+                gsub_apply_trie(p, nested, g, n, pos[s[0]]);
+        }
+        return end;
+    }
+    return 0;
+}
+
+// Shapes a run of glyphs in place, keeping each glyph's codepoint (a
+// ligature keeps its first component's). Returns the new length.
+static int gsub_apply(const gsub_plan *p, uint16_t *g, int32_t *cps, int n) {
+    // most runs start no lookup at all
+    int i = 0;
+    while (i < n && !(g[i] < p->num_glyphs && (p->starts[g[i] >> 3] >> (g[i] & 7) & 1))) i++;
+    if (i == n) return n;
+
+    for (uint32_t o = 0; o < p->num_order; o++) {
+        const gsub_lookup *l = &p->lookups[p->order[o]];
+        for (i = 0; i < n; ) {
+            if (gsub_skip(p, l->flags, g[i])) {
+                i++;
+            } else if (l->chain) {
+                int end = gsub_apply_chain(p, l, g, n, i);
+                i = end ? end : i + 1;
+            } else {
+                gsub_apply_trie(p, l, g, n, i);
+                i++;
+            }
+        }
+    }
+
+    int w = 0;
+    for (i = 0; i < n; i++) {
+        if (g[i] == GSUB_DELETED) continue;
+        g[w] = g[i];
+        cps[w++] = cps[i];
+    }
+    return w;
+}
+
+// ---------------- ascii tables ----------------
+// Printable ASCII (U+0020-U+007E) for the bundled fonts is precomputed at
+// build time by `fontpack -c` into ascii_tables.h: glyph outlines, both
+// pre-serialized as font-unit path data and as compact outline arrays,
+// on-curve bounding boxes, advances and kerning pairs. Glyphs found there
+// are never decoded: the path data is placed with a transform as is, and
+// words built from the arrays go through the pen like decoded glyphs.
+// Subsets keep glyph ids, outlines, metrics and kerning, so a table also
+// serves its font's subset to the ranges the Worker renders from.
+
+#define ASCII_FIRST 0x20
+#define ASCII_COUNT 95
+
+typedef struct {
+    uint8_t right;
+    int16_t value;
+} ascii_kern;
+
+typedef struct {
+    uint32_t fingerprint;
+    uint32_t subset_fingerprint; // of the Worker's subset of the font, 0 if none
+    const char *const *paths;   // "" for glyphs with no outline
+    const int16_t (*boxes)[4];  // x0, y0, x1, y1 of on-curve points
+    const uint16_t *advances;
+    const uint16_t *glyphs;
+    const uint16_t *kern_index; // kerns[kern_index[i] .. kern_index[i+1]) have left i
+    const ascii_kern *kerns;
+    // glyph i has the xs, then the ys, of points point_index[i] ..
+    // point_index[i+1] of points and commands cmd_index[i] ..
+    // cmd_index[i+1] of cmds, as in an outline
+    const int16_t *points;
+    const uint16_t *point_index;
+    const uint8_t *cmds;
+    const uint16_t *cmd_index;
+} ascii_table;
+
+#ifdef TXT2SVG_ASCII_TABLES
+#include "ascii_tables.h"
+#else
+static const ascii_table *const ascii_tables[1];
+#define NUM_ASCII_TABLES 0
+#endif
+
+static const ascii_table* ascii_table_for(const font_face *f) {
+    for (int i = 0; i < NUM_ASCII_TABLES; i++)
+        if (ascii_tables[i]->fingerprint == f->fingerprint ||
+            (ascii_tables[i]->subset_fingerprint && ascii_tables[i]->subset_fingerprint == f->fingerprint))
+            return ascii_tables[i];
+    return NULL;
+}
+
+static int ascii_kern_advance(const ascii_table *t, int left, int right) {
+    for (int k = t->kern_index[left]; k < t->kern_index[left + 1]; k++)
+        if (t->kerns[k].right == right) return t->kerns[k].value;
+    return 0;
+}
+
+// Emits precomputed glyph i into pen, point for point as decoding it would
+static void ascii_outline_emit(const ascii_table *t, int i, glyph_pen *pen) {
+    uint32_t first = t->point_index[i], npts = t->point_index[i + 1] - first;
+    const int16_t *xs = t->points + 2 * first;
+    outline_emit_arrays(xs, xs + npts, t->cmds + t->cmd_index[i],
+                        t->cmd_index[i + 1] - t->cmd_index[i], pen);
+}
+
+// ---------------- svg pen ----------------
+// Formats pen output as SVG path commands in pixel space, tracking the
+// bounding box of the on-curve points as it goes.
+typedef struct {
+    glyph_pen pen;
+    char *buf;
+    uint32_t off, cap;
+    float ox, oy, scale;
+    float min_x, max_x, min_y, max_y;
+    int precision; // decimals of coordinates
+} svg_pen;
+
+static void svg_pen_emit(glyph_pen *pen, int type, int vx, int vy, int vcx, int vcy) {
+    svg_pen *s = (svg_pen*)pen;
+    char *drawBuf = s->buf;
+    uint32_t drawOff = s->off;
+
+    float x = s->ox + vx * s->scale;
+    float y = s->oy - vy * s->scale;
+
+    // Update bounding box
+    if (x < s->min_x) s->min_x = x;
+    if (x > s->max_x) s->max_x = x;
+    if (y < s->min_y) s->min_y = y;
+    if (y > s->max_y) s->max_y = y;
+
+    if (type == STBTT_vmove || type == STBTT_vline) {
+        if (drawOff + 50 < s->cap) {
+            drawBuf[drawOff++] = type == STBTT_vmove ? 'M' : 'L';
+            drawOff = write_fixed(drawBuf, drawOff, x, s->precision);
+            drawBuf[drawOff++]=' ';
+            drawOff = write_fixed(drawBuf, drawOff, y, s->precision);
+        }
+    }
+    else if (type == STBTT_vcurve) {
+        if (drawOff + 100 < s->cap) {
+            drawBuf[drawOff++]='Q';
+            drawOff = write_fixed(drawBuf, drawOff, s->ox + vcx * s->scale, s->precision);
+            drawBuf[drawOff++]=' ';
+            drawOff = write_fixed(drawBuf, drawOff, s->oy - vcy * s->scale, s->precision);
+            drawBuf[drawOff++]=' ';
+            drawOff = write_fixed(drawBuf, drawOff, x, s->precision);
+            drawBuf[drawOff++]=' ';
+            drawOff = write_fixed(drawBuf, drawOff, y, s->precision);
+        }
+    }
+    s->off = drawOff;
+}
+
+// ---------------- subset ----------------
+// Builds a TrueType font holding only the outlines for a Unicode range spec
+// such as "U+0020-007E,U+00A0-00FF", plus .notdef, any composite components
+// they reference and every glyph the font's substitutions can make of
+// them. Glyph ids are kept: dropped glyphs stay in place with empty
+// outlines, so GDEF, GPOS, GSUB and kern are copied unchanged and shape and
+// kern text as in the original. The head checksum is recomputed so a
+// subset never shares a fingerprint with its original.
+
+#define SUBSET_MAX_RANGES 64
+
+typedef struct {
+    uint32_t first, last;
+} cp_range;
+
+static int parse_hex(const char **s, uint32_t *v) {
+    const char *p = *s;
+    if ((p[0] == 'U' || p[0] == 'u') && p[1] == '+') p += 2;
+    uint32_t x = 0;
+    int digits = 0;
+    for (;; p++, digits++) {
+        char c = *p;
+        if (c >= '0' && c <= '9') x = x*16 + (c - '0');
+        else if (c >= 'a' && c <= 'f') x = x*16 + (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') x = x*16 + (c - 'A' + 10);
+        else break;
+        if (x > 0x10FFFF) return 0;
+    }
+    *s = p;
+    *v = x;
+    return digits > 0;
+}
+
+// Parses "U+20-7E, A0-FF, 20AC" into sorted, merged ranges.
+static int parse_ranges(const char *spec, cp_range *r, int max) {
+    int n = 0;
+    while (*spec) {
+        if (*spec == ',' || *spec == ' ') { spec++; continue; }
+        uint32_t first, last;
+        if (!parse_hex(&spec, &first)) return 0;
+        last = first;
+        if (*spec == '-') {
+            spec++;
+            if (!parse_hex(&spec, &last) || last < first) return 0;
+        }
+        if (n == max) return 0;
+
+        // insertion sort, merging overlapping and adjacent ranges
+        int i = n++;
+        while (i > 0 && r[i-1].first > first) { r[i] = r[i-1]; i--; }
+        r[i].first = first;
+        r[i].last = last;
+    }
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (m && r[i].first <= r[m-1].last + 1) {
+            if (r[i].last > r[m-1].last) r[m-1].last = r[i].last;
+        } else {
+            r[m++] = r[i];
+        }
+    }
+    return m;
+}
+
+// Calls fn on every component glyph index slot of a composite glyph.
+static void composite_components(uint8_t *g, void (*fn)(uint8_t *slot, void *ctx), void *ctx) {
+    uint8_t *comp = g + 10;
+    int more = 1;
+    while (more) {
+        stbtt_uint16 flags = ttUSHORT(comp);
+        fn(comp + 2, ctx);
+        comp += 4 + ((flags & 1) ? 4 : 2);
+        if (flags & (1<<3)) comp += 2;
+        else if (flags & (1<<6)) comp += 4;
+        else if (flags & (1<<7)) comp += 8;
+        more = flags & (1<<5);
+    }
+}
+
+typedef struct {
+    const stbtt_fontinfo *font;
+    uint8_t *keep;
+    uint32_t kept;
+    int depth;
+} subset_marks;
+
+static void subset_mark(subset_marks *m, int glyph);
+
+static void subset_mark_slot(uint8_t *slot, void *ctx) {
+    subset_marks *m = (subset_marks*)ctx;
+    subset_mark(m, ttUSHORT(slot));
+}
+
+static void subset_mark(subset_marks *m, int glyph) {
+    if (glyph < 0 || glyph >= m->font->numGlyphs || m->keep[glyph] || m->depth > GLYF_MAX_DEPTH) return;
+    m->keep[glyph] = 1;
+    m->kept++;
+
+    uint32_t len;
+    const uint8_t *data = glyf_data(m->font, glyph, &len);
+    if (data && ttSHORT((stbtt_uint8*)data) < 0) {
+        m->depth++;
+        composite_components((uint8_t*)data, subset_mark_slot, m);
+        m->depth--;
+    }
+}
+
+// Marks the substitutes a trie reaches from node through kept glyphs.
+static void subset_mark_trie(subset_marks *m, const gsub_plan *p, const gsub_node *node) {
+    for (uint32_t k = 0; k < node->num_edges; k++) {
+        const gsub_edge *e = &p->edges[node->edges + k];
+        if (e->glyph >= p->num_glyphs || !m->keep[e->glyph]) continue;
+        const gsub_node *next = &p->nodes[e->node];
+        if (next->sub >= 0) subset_mark(m, next->sub);
+        subset_mark_trie(m, p, next);
+    }
+}
+
+// Marks what the plan's lookups make of kept glyphs until that adds no
+// more. Lookups nested in chaining rules are followed whatever the rule's
+// context, which may keep a few glyphs the text can never reach.
+static void subset_mark_gsub(subset_marks *m, const gsub_plan *p) {
+    uint32_t before;
+    do {
+        before = m->kept;
+        for (uint32_t o = 0; o < p->num_order; o++) {
+            const gsub_lookup *l = &p->lookups[p->order[o]];
+            const gsub_node *root = &p->nodes[l->root];
+            if (!l->chain) {
+                subset_mark_trie(m, p, root);
+                continue;
+            }
+            for (uint32_t k = 0; k < root->num_edges; k++) {
+                const gsub_edge *e = &p->edges[root->edges + k];
+                if (e->glyph >= p->num_glyphs || !m->keep[e->glyph]) continue;
+                const gsub_node *leaf = &p->nodes[e->node];
+                for (uint32_t r = 0; r < leaf->num_edges; r++) {
+                    const gsub_rule *rule = &p->rules[p->rule_refs[leaf->edges + r]];
+                    const uint16_t *sub = p->substs + rule->substs;
+                    for (uint32_t j = 0; j < rule->num_substs; j++, sub += 2)
+                        if (sub[1] != GSUB_SLOT_SKIP)
+                            subset_mark_trie(m, p, &p->nodes[p->lookups[sub[1]].root]);
+                }
+            }
+        }
+    } while (m->kept != before);
+}
+
+// A table of the source font and its length, or NULL if the font has none
+// or it runs past the end of the data.
+static const uint8_t* subset_source(const stbtt_fontinfo *font, uint32_t size, const char *tag,
+    uint32_t *len) {
+    stbtt_uint8 *dir = font->data + font->fontstart;
+    uint32_t num_tables = ttUSHORT(dir + 4);
+    for (uint32_t i = 0; i < num_tables; i++) {
+        stbtt_uint8 *e = dir + 12 + 16 * i;
+        if (!stbtt_tag(e, tag)) continue;
+        uint32_t off = ttULONG(e + 8);
+        *len = ttULONG(e + 12);
+        return off <= size && *len <= size - off ? font->data + off : NULL;
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint8_t *o;
+    uint32_t off, cap;
+} subset_out;
+
+// Reserves n zeroed bytes, or returns NULL if the output is full.
+static uint8_t* subset_take(subset_out *w, uint32_t n) {
+    if (n > w->cap - w->off) return NULL;
+    uint8_t *p = w->o + w->off;
+    STBTT_memset(p, 0, n);
+    w->off += n;
+    return p;
+}
+
+// Starts a table on a 4-byte boundary and returns its offset.
+static uint32_t subset_table(subset_out *w) {
+    subset_take(w, (4 - (w->off & 3)) & 3);
+    return w->off;
+}
+
+// Copies a source table unchanged.
+static int subset_copy(subset_out *w, const uint8_t *src, uint32_t len) {
+    uint8_t *p = subset_take(w, (len + 3) & ~3u);
+    if (!p) return 0;
+    STBTT_memcpy(p, src, len);
+    return 1;
+}
+
+WASM_EXPORT
+uint32_t wasm_subset_font(
+    void* font_ptr,
+    uint32_t font_len,
+    uint32_t face,
+    void* ranges_ptr,
+    void* out_ptr,
+    uint32_t out_max
+) {
+    // in tag order, as the table directory must be
+    static const char tags[][5] = { "GDEF", "GPOS", "GSUB", "cmap", "glyf", "head", "hhea", "hmtx",
+                                    "kern", "loca", "maxp" };
+    enum { T_GDEF, T_GPOS, T_GSUB, T_CMAP, T_GLYF, T_HEAD, T_HHEA, T_HMTX, T_KERN, T_LOCA, T_MAXP,
+           NUM_TABLES };
+    const uint8_t *src[NUM_TABLES];
+    uint32_t src_len[NUM_TABLES], table_off[NUM_TABLES], table_len[NUM_TABLES];
+    uint8_t present[NUM_TABLES];
+
+    stbtt_fontinfo font;
+    cp_range ranges[SUBSET_MAX_RANGES];
+    int num_ranges = parse_ranges((const char*)ranges_ptr, ranges, SUBSET_MAX_RANGES);
+    const uint8_t *ttf = woff_load((const uint8_t*)font_ptr, &font_len);
+    int offset = ttf ? stbtt_GetFontOffsetForIndex(ttf, (int)face) : -1;
+    if (!num_ranges || offset < 0 || !stbtt_InitFont(&font, (unsigned char*)ttf, offset) || font.cff.size)
+        return 0;
+    lazy_attach(&font);
+
+    // GDEF, GPOS, GSUB and kern are kept when the font has them, hhea, hmtx
+    // and maxp are required, the rest is rebuilt
+    uint32_t num_tables = 0;
+    for (int t = 0; t < NUM_TABLES; t++) {
+        src[t] = subset_source(&font, font_len, tags[t], &src_len[t]);
+        if ((t == T_HHEA || t == T_HMTX || t == T_MAXP) && !src[t]) return 0;
+        present[t] = src[t] || t == T_CMAP || t == T_GLYF || t == T_HEAD || t == T_LOCA;
+        num_tables += present[t];
+    }
+
+    uint32_t num_glyphs = (uint32_t)font.numGlyphs;
+    uint8_t *keep = (uint8_t*)STBTT_malloc(num_glyphs, 0);
+    uint32_t *loca = (uint32_t*)STBTT_malloc((num_glyphs + 1) * sizeof(uint32_t), 0);
+    // the plan is only needed here, so it lives in scratch
+    gsub_plan *plan = gsub_build(&font, 0, 0);
+    if (!keep || !loca || !plan) goto fail;
+    STBTT_memset(keep, 0, num_glyphs);
+
+    subset_marks marks = { &font, keep, 0, 0 };
+    subset_mark(&marks, 0);
+    for (int r = 0; r < num_ranges; r++)
+        for (uint32_t cp = ranges[r].first; cp <= ranges[r].last; cp++)
+            subset_mark(&marks, stbtt_FindGlyphIndex(&font, cp));
+    if (plan->num_order) subset_mark_gsub(&marks, plan);
+
+    subset_out w = { (uint8_t*)out_ptr, 0, out_max };
+    uint8_t *p, *dir = subset_take(&w, 12 + 16 * num_tables);
+    if (!dir) goto fail;
+    uint32_t search = 1, selector = 0;
+    while (search * 2 <= num_tables) { search *= 2; selector++; }
+    put32(dir, 0x00010000);
+    put16(dir + 4, num_tables);
+    put16(dir + 6, 16 * search);
+    put16(dir + 8, selector);
+    put16(dir + 10, 16 * (num_tables - search));
+
+    for (int t = T_GDEF; t <= T_GSUB; t++) {
+        if (!src[t]) continue;
+        table_off[t] = subset_table(&w);
+        if (!subset_copy(&w, src[t], table_len[t] = src_len[t])) goto fail;
+    }
+
+    // cmap: a single format 12 subtable (platform 3, encoding 10)
+    table_off[T_CMAP] = subset_table(&w);
+    uint8_t *cmap = subset_take(&w, 12 + 16);
+    if (!cmap) goto fail;
+    put16(cmap + 2, 1);
+    put16(cmap + 4, 3);
+    put16(cmap + 6, 10);
+    put32(cmap + 8, 12);
+    put16(cmap + 12, 12);
+    uint32_t groups = 0;
+    uint8_t *group = NULL;
+    for (int r = 0; r < num_ranges; r++) {
+        for (uint32_t cp = ranges[r].first; cp <= ranges[r].last; cp++) {
+            uint32_t g = (uint32_t)stbtt_FindGlyphIndex(&font, cp);
+            if (!g) continue;
+            if (group && ttULONG(group + 4) + 1 == cp &&
+                ttULONG(group + 8) + (cp - ttULONG(group)) == g) {
+                put32(group + 4, cp);
+                continue;
+            }
+            if (!(group = subset_take(&w, 12))) goto fail;
+            put32(group, cp);
+            put32(group + 4, cp);
+            put32(group + 8, g);
+            groups++;
+        }
+    }
+    table_len[T_CMAP] = w.off - table_off[T_CMAP];
+    put32(cmap + 16, table_len[T_CMAP] - 12);
+    put32(cmap + 24, groups);
+
+    // glyf: kept glyphs copied in place, dropped ones left empty
+    table_off[T_GLYF] = subset_table(&w);
+    for (uint32_t g = 0; g < num_glyphs; g++) {
+        uint32_t len;
+        const uint8_t *glyf = keep[g] ? glyf_data(&font, g, &len) : NULL;
+        loca[g] = w.off - table_off[T_GLYF];
+        if (glyf && !subset_copy(&w, glyf, len)) goto fail;
+    }
+    loca[num_glyphs] = w.off - table_off[T_GLYF];
+    table_len[T_GLYF] = loca[num_glyphs];
+
+    table_off[T_HEAD] = subset_table(&w);
+    if (!(p = subset_take(&w, 56))) goto fail;
+    STBTT_memcpy(p, font.data + font.head, 54);
+    put32(p + 8, 0);   // checkSumAdjustment, filled in last
+    put16(p + 50, 1);  // long loca offsets
+    table_len[T_HEAD] = 54;
+
+    for (int t = T_HHEA; t <= T_KERN; t++) {
+        if (!src[t]) continue;
+        table_off[t] = subset_table(&w);
+        if (!subset_copy(&w, src[t], table_len[t] = src_len[t])) goto fail;
+    }
+
+    table_off[T_LOCA] = subset_table(&w);
+    if (!(p = subset_take(&w, 4 * (num_glyphs + 1)))) goto fail;
+    for (uint32_t g = 0; g <= num_glyphs; g++)
+        put32(p + 4 * g, loca[g]);
+    table_len[T_LOCA] = 4 * (num_glyphs + 1);
+
+    table_off[T_MAXP] = subset_table(&w);
+    if (!subset_copy(&w, src[T_MAXP], table_len[T_MAXP] = src_len[T_MAXP])) goto fail;
+
+    uint8_t *e = dir + 12;
+    for (int t = 0; t < NUM_TABLES; t++) {
+        if (!present[t]) continue;
+        STBTT_memcpy(e, tags[t], 4);
+        put32(e + 4, table_checksum(w.o + table_off[t], table_len[t]));
+        put32(e + 8, table_off[t]);
+        put32(e + 12, table_len[t]);
+        e += 16;
+    }
+    put32(w.o + table_off[T_HEAD] + 8, 0xB1B0AFBAu - table_checksum(w.o, w.off));
+
+    STBTT_free(plan, 0);
+    STBTT_free(keep, 0);
+    STBTT_free(loca, 0);
+    return w.off;
+
+fail:
+    STBTT_free(plan, 0);
+    STBTT_free(keep, 0);
+    STBTT_free(loca, 0);
+    return 0;
+}
+
+// ---------------- builtin fonts ----------------
+// With `make EMBED_FONTS=1` the bundled fonts are linked into the module's
+// data segment. They are usable as soon as the module is instantiated:
+// wasm_builtin_font() returns a pointer that can be passed straight to
+// wasm_generate_svg, with no fetch and no copy into the request heap.
+//
+// Font IDs: 1 = Roboto, 2 = WendyOne, 3 = AlfaSlabOne.
+#ifdef TXT2SVG_BUILTIN_FONTS
+#include "builtin_fonts.h"
+
+static const struct {
+    const uint8_t *data;
+    uint32_t len;
+} builtin_fonts[] = {
+    { public_fonts_Roboto_ttf, sizeof(public_fonts_Roboto_ttf) },
+    { public_fonts_WendyOne_ttf, sizeof(public_fonts_WendyOne_ttf) },
+    { public_fonts_AlfaSlabOne_ttf, sizeof(public_fonts_AlfaSlabOne_ttf) },
+};
+#define NUM_BUILTIN_FONTS (sizeof(builtin_fonts) / sizeof(builtin_fonts[0]))
+#else
+static const struct {
+    const uint8_t *data;
+    uint32_t len;
+} builtin_fonts[1];
+#define NUM_BUILTIN_FONTS 0
+#endif
+
+WASM_EXPORT
+void* wasm_builtin_font(uint32_t id) {
+    if (id < 1 || id > NUM_BUILTIN_FONTS) return NULL;
+    return (void*)builtin_fonts[id - 1].data;
+}
+
+WASM_EXPORT
+uint32_t wasm_builtin_font_len(uint32_t id) {
+    if (id < 1 || id > NUM_BUILTIN_FONTS) return 0;
+    return builtin_fonts[id - 1].len;
+}
+
+// ---------------- line breaking ----------------
+// Line break opportunities after UAX #14, reduced to the classes Latin,
+// Cyrillic, Greek and CJK text need: breaks go after spaces and hyphens
+// and between ideographs, never before closing punctuation or inside a
+// word, and always after a newline. Scripts that break by dictionary
+// (Thai, Lao, Khmer) only break at spaces.
+
+enum {
+    LB_AL, // letters and everything unlisted
+    LB_BK, LB_CR, LB_LF, LB_SP, LB_ZW, LB_ZWJ, LB_CM, LB_GL,
+    LB_BA, LB_HY, LB_BB, LB_OP, LB_CL, LB_EX, LB_IS, LB_NS, LB_QU, LB_NU, LB_ID,
+};
+
+#define LB_NONE  0
+#define LB_ALLOW 1
+#define LB_MUST  2
+
+static int lb_class(int cp) {
+    if (cp < 0x80) {
+        if (cp >= '0' && cp <= '9') return LB_NU;
+        if ((cp | 0x20) >= 'a' && (cp | 0x20) <= 'z') return LB_AL;
+        switch (cp) {
+        case '\n': return LB_LF;
+        case '\r': return LB_CR;
+        case '\v': case '\f': return LB_BK;
+        case ' ': return LB_SP;
+        case '\t': case '|': return LB_BA;
+        case '-': return LB_HY;
+        case '(': case '[': case '{': return LB_OP;
+        case ')': case ']': case '}': return LB_CL;
+        case '!': case '?': return LB_EX;
+        case ',': case '.': case ':': case ';': case '/': return LB_IS;
+        case '"': case '\'': return LB_QU;
+        }
+        return LB_AL;
+    }
+    switch (cp) {
+    case 0x0085: case 0x2028: case 0x2029: return LB_BK;
+    case 0x200B: return LB_ZW;
+    case 0x200D: return LB_ZWJ;
+    case 0x00A0: case 0x034F: case 0x2007: case 0x2011: case 0x202F:
+    case 0x2060: case 0xFEFF: return LB_GL;
+    case 0x00AD: case 0x2010: case 0x2012: case 0x2013: case 0x3000: return LB_BA;
+    case 0x00B4: return LB_BB;
+    case 0x00AB: case 0x00BB: case 0x2018: case 0x2019: case 0x201B:
+    case 0x201C: case 0x201D: case 0x201F: return LB_QU;
+    case 0x201A: case 0x201E: case 0x3008: case 0x300A: case 0x300C: case 0x300E:
+    case 0x3010: case 0x3014: case 0xFF08: case 0xFF3B: case 0xFF5B: return LB_OP;
+    case 0x3001: case 0x3002: case 0x3009: case 0x300B: case 0x300D: case 0x300F:
+    case 0x3011: case 0x3015: case 0xFF09: case 0xFF0C: case 0xFF0E: case 0xFF3D:
+    case 0xFF5D: return LB_CL;
+    case 0xFF01: case 0xFF1F: return LB_EX;
+    case 0xFF1A: case 0xFF1B: return LB_IS;
+    case 0x3005: case 0x303B: case 0x309D: case 0x309E: case 0x30FB: case 0x30FC:
+    case 0x30FD: case 0x30FE: return LB_NS;
+    }
+    if (cp >= 0x2000 && cp <= 0x200A) return LB_BA;
+    if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x1AB0 && cp <= 0x1AFF) ||
+        (cp >= 0x1DC0 && cp <= 0x1DFF) || (cp >= 0x20D0 && cp <= 0x20FF) ||
+        (cp >= 0xFE00 && cp <= 0xFE0F) || (cp >= 0xFE20 && cp <= 0xFE2F) ||
+        (cp >= 0x1F3FB && cp <= 0x1F3FF) || (cp >= 0xE0000 && cp <= 0xE01EF))
+        return LB_CM;
+    if (cp >= 0x3041 && cp <= 0x30FF) {
+        // small kana don't start a line
+        int k = cp >= 0x30A1 ? cp - 0x60 : cp;
+        if (k == 0x3041 || k == 0x3043 || k == 0x3045 || k == 0x3047 || k == 0x3049 ||
+            k == 0x3063 || k == 0x3083 || k == 0x3085 || k == 0x3087 || k == 0x308E ||
+            k == 0x3095 || k == 0x3096)
+            return LB_NS;
+        return LB_ID;
+    }
+    if ((cp >= 0x2E80 && cp <= 0x2FFF) || (cp >= 0x3040 && cp <= 0x31FF) ||
+        (cp >= 0x3400 && cp <= 0x4DBF) || (cp >= 0x4E00 && cp <= 0x9FFF) ||
+        (cp >= 0xA000 && cp <= 0xA4CF) || (cp >= 0xAC00 && cp <= 0xD7A3) ||
+        (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0xFE30 && cp <= 0xFE4F) ||
+        (cp >= 0xFF00 && cp <= 0xFF60) || (cp >= 0x1F000 && cp <= 0x1FAFF) ||
+        (cp >= 0x20000 && cp <= 0x3FFFD))
+        return LB_ID;
+    return LB_AL;
+}
+
+// Whether a line may (or must) break before a character of class cur.
+// prev is the class of the character before it, base that of the last
+// one that isn't a space; combining marks take the class of their base.
+static int lb_break(int base, int prev, int cur) {
+    if (prev == LB_BK || prev == LB_LF || (prev == LB_CR && cur != LB_LF)) return LB_MUST;
+    if (cur == LB_BK || cur == LB_CR || cur == LB_LF || cur == LB_SP || cur == LB_ZW)
+        return LB_NONE;
+    if (base == LB_ZW) return LB_ALLOW;
+    if (prev == LB_ZWJ || cur == LB_CM || cur == LB_ZWJ) return LB_NONE;
+    if (prev == LB_GL || (cur == LB_GL && prev != LB_SP && prev != LB_BA && prev != LB_HY))
+        return LB_NONE;
+    if (cur == LB_CL || cur == LB_EX || cur == LB_IS) return LB_NONE;
+    if (base == LB_OP) return LB_NONE;
+    if (prev == LB_SP) return LB_ALLOW;
+    if (cur == LB_QU || prev == LB_QU) return LB_NONE;
+    if (cur == LB_BA || cur == LB_HY || cur == LB_NS || prev == LB_BB) return LB_NONE;
+    if (prev == LB_HY && cur == LB_NU) return LB_NONE;
+    if (prev == LB_BA || prev == LB_HY || prev == LB_ID || cur == LB_ID) return LB_ALLOW;
+    return LB_NONE;
+}
+
+// ---------------- word cache ----------------
+// Most traffic renders the same few words (product names, navigation
+// labels) over and over. Serialized words are kept in a fixed block of
+// persistent memory, keyed by font instance, scale, precision and the
+// word's glyphs with their offsets from its origin, so a repeat costs a
+// lookup and a copy placed with a translate.
+//
+// The block is a ring: words are appended at the head and the oldest are
+// dropped from the tail to make room. A word used since it was written
+// gets a second chance instead and moves up to the head, so the ring
+// approximates LRU order without touching memory on a hit.
+
+#define WORD_CACHE_BYTES (512 * 1024)
+#define WORD_MAX_BYTES (WORD_CACHE_BYTES / 8) // longest word kept
+#define WORD_BUCKETS 1024
+#define WORD_MAX_GLYPHS 32
+
+// A cached word: this header, then a glyph id and an x offset from the
+// word's origin per glyph, then len bytes of path data
+typedef struct {
+    uint32_t hash, font;
+    float scale;
+    uint16_t precision, num_glyphs;
+    uint32_t size;       // bytes taken in the ring
+    uint32_t chain;      // offset + 1 of the next word in the bucket, 0 for none
+    uint32_t len;
+    uint32_t referenced; // hit since written or last given a second chance
+    float box[4];        // min x, min y, max x, max y from the origin
+} word_entry;
+
+// Counters since the module was instantiated. In WASM memory this is six
+// 32-bit words.
+typedef struct {
+    uint32_t hits, misses;
+    uint32_t evictions;
+    uint32_t rejected; // words longer than WORD_MAX_BYTES
+    uint32_t entries, bytes;
+} word_cache_stats;
+
+static uint8_t *word_ring;
+static uint32_t word_head, word_tail, word_end = WORD_CACHE_BYTES;
+static uint32_t word_buckets[WORD_BUCKETS];
+static word_cache_stats word_stats;
+
+static word_entry* word_at(uint32_t off) {
+    return (word_entry*)(word_ring + off);
+}
+
+static uint32_t* word_key(const word_entry *e) {
+    return (uint32_t*)(e + 1);
+}
+
+static char* word_path(const word_entry *e) {
+    return (char*)(word_key(e) + 2 * e->num_glyphs);
+}
+
+static int word_key_eq(const uint32_t *a, const uint32_t *b, uint32_t n) {
+    for (uint32_t k = 0; k < 2 * n; k++)
+        if (a[k] != b[k]) return 0;
+    return 1;
+}
+
+static uint32_t word_hash(uint32_t font, float scale, int precision, const uint32_t *key, uint32_t n) {
+    union { float f; uint32_t u; } s = { scale };
+    uint32_t h = hash_bytes((const uint8_t*)key, 8 * n);
+    return (h ^ font ^ (s.u * 2654435761u) ^ (uint32_t)precision) * 16777619u;
+}
+
+// Replaces the bucket link to the word at off with to
+static void word_relink(const word_entry *e, uint32_t off, uint32_t to) {
+    uint32_t *link = &word_buckets[e->hash % WORD_BUCKETS];
+    while (*link != off + 1) link = &word_at(*link - 1)->chain;
+    *link = to;
+}
+
+// Drops the word at the tail, or moves it to the head if it was used.
+// Only called with the ring wrapped, so the free gap ends at the tail.
+static void word_drop_oldest(void) {
+    word_entry *e = word_at(word_tail);
+    uint32_t size = e->size;
+    if (e->referenced) {
+        e->referenced = 0;
+        word_relink(e, word_tail, word_head + 1);
+        // the head is behind the tail, so a forward copy is safe
+        uint32_t *to = (uint32_t*)(word_ring + word_head), *from = (uint32_t*)e;
+        for (uint32_t k = 0; k < size / 4; k++) to[k] = from[k];
+        word_head += size;
+    } else {
+        word_relink(e, word_tail, e->chain);
+        word_stats.entries--;
+        word_stats.bytes -= size;
+        word_stats.evictions++;
+    }
+    word_tail += size;
+    if (word_tail == word_end) {
+        word_tail = 0;
+        word_end = WORD_CACHE_BYTES;
+    }
+}
+
+// Makes room for size bytes at the head
+static void word_reserve(uint32_t size) {
+    for (;;) {
+        if (!word_stats.entries) {
+            word_head = word_tail = 0;
+            word_end = WORD_CACHE_BYTES;
+        }
+        if (word_head > word_tail || !word_stats.entries) {
+            if (word_head + size <= WORD_CACHE_BYTES) return;
+            word_end = word_head;
+            word_head = 0;
+        } else if (word_head + size <= word_tail) {
+            return;
+        } else {
+            word_drop_oldest();
+        }
+    }
+}
+
+// The cached word for a key, or NULL
+static const word_entry* word_find(uint32_t font, float scale, int precision,
+                                   const uint32_t *key, uint32_t n, uint32_t hash) {
+    for (uint32_t i = word_buckets[hash % WORD_BUCKETS]; i; ) {
+        word_entry *e = word_at(i - 1);
+        if (e->hash == hash && e->font == font && e->scale == scale &&
+            e->precision == precision && e->num_glyphs == n && word_key_eq(word_key(e), key, n)) {
+            e->referenced = 1;
+            word_stats.hits++;
+            return e;
+        }
+        i = e->chain;
+    }
+    word_stats.misses++;
+    return NULL;
+}
+
+// Caches len bytes of path data for a word
+static void word_store(uint32_t font, float scale, int precision, const uint32_t *key, uint32_t n,
+                       uint32_t hash, const char *path, uint32_t len, const float *box) {
+    uint32_t size = (sizeof(word_entry) + 8 * n + len + 7) & ~7u;
+    if (size > WORD_MAX_BYTES) {
+        word_stats.rejected++;
+        return;
+    }
+    if (!word_ring && !(word_ring = (uint8_t*)persist_alloc(WORD_CACHE_BYTES)))
+        return;
+    word_reserve(size);
+
+    word_entry *e = word_at(word_head);
+    e->hash = hash;
+    e->font = font;
+    e->scale = scale;
+    e->precision = (uint16_t)precision;
+    e->num_glyphs = (uint16_t)n;
+    e->size = size;
+    e->len = len;
+    e->referenced = 0;
+    for (int k = 0; k < 4; k++) e->box[k] = box[k];
+    STBTT_memcpy(word_key(e), key, 8 * n);
+    STBTT_memcpy(word_path(e), path, len);
+    e->chain = word_buckets[hash % WORD_BUCKETS];
+    word_buckets[hash % WORD_BUCKETS] = word_head + 1;
+    word_head += size;
+    word_stats.entries++;
+    word_stats.bytes += size;
+}
+
+// Copies the word cache counters to out_ptr, a word_cache_stats
+WASM_EXPORT
+void wasm_word_cache_stats(void* out_ptr) {
+    STBTT_memcpy(out_ptr, &word_stats, sizeof(word_stats));
+}
+
+// ---------------- main ----------------
+// A font as passed in by the caller: TTF/TTC/WOFF/WOFF2 bytes or a pack,
+// plus the collection face and variable font instance to use. In WASM
+// memory this is four 32-bit words.
+typedef struct {
+    const uint8_t *data;
+    uint32_t len;
+    uint32_t face;
+    const char *variations; // NULL or "" for the default instance
+} font_ref;
+
+#define MAX_FONT_CHAIN 8
+
+// One font of a fallback chain, bound for the request
+typedef struct {
+    font_face face;
+    const ascii_table *ascii;
+    const coverage *cov; // NULL for a chain of one font
+    const gsub_plan *gsub;
+    float scale;
+} chain_font;
+
+// Index of the first font in the chain that covers cp; the first font
+// (and its .notdef) when none does.
+static int chain_pick(const chain_font *chain, int n, int cp) {
+    for (int i = 0; i < n; i++) {
+        const chain_font *cf = &chain[i];
+        if (n == 1 || (cf->cov ? coverage_has(cf->cov, cp) : font_glyph(&cf->face, cp) != 0))
+            return i;
+    }
+    return 0;
+}
+
+// Writes the SVG header sized to the pen's bounding box in front of the
+// paths it holds and closes the document. Given a fixed width and height,
+// the SVG is that size instead, with the paths centered in it. The paths
+// were written at out + 256, which leaves room for the header. The hash
+// of the document is kept in svg_hash.
+static uint32_t svg_hash;
+
+static uint32_t svg_finish(const svg_pen *sp, uint32_t fixed_width, uint32_t fixed_height,
+                           char *out, uint32_t out_max) {
+    float min_x = sp->min_x, max_x = sp->max_x;
+    float min_y = sp->min_y, max_y = sp->max_y;
+    const char *drawBuf = sp->buf;
+    uint32_t drawOff = sp->off;
+
+    // Calculate dimensions from bounding box
+    int width = (int)(max_x - min_x) + 20; // Add padding
+    int height = (int)(max_y - min_y) + 20;
+    int viewBox_x = (int)min_x - 10;
+    int viewBox_y = (int)min_y - 10;
+    if (fixed_width && fixed_height) {
+        if (max_x < min_x) min_x = max_x = min_y = max_y = 0; // nothing drawn
+        width = (int)fixed_width;
+        height = (int)fixed_height;
+        viewBox_x = (int)((min_x + max_x - width) / 2);
+        viewBox_y = (int)((min_y + max_y - height) / 2);
+    }
+
+    uint32_t off = 0;
+
+    // Write complete SVG header with actual dimensions
+    off = write_str(out, off, "<svg xmlns='http://www.w3.org/2000/svg'");
+    off = write_str(out, off, " width='");
+    off = write_int(out, off, width);
+    off = write_str(out, off, "' height='");
+    off = write_int(out, off, height);
+    off = write_str(out, off, "' viewBox='");
+    off = write_int(out, off, viewBox_x);
+    off = write_str(out, off, " ");
+    off = write_int(out, off, viewBox_y);
+    off = write_str(out, off, " ");
+    off = write_int(out, off, width);
+    off = write_str(out, off, " ");
+    off = write_int(out, off, height);
+    off = write_str(out, off, "'><g>");
+
+    // Copy path data from drawBuf (now contains individual <path> elements)
+    // and hash it on the way
+    xxh32_state h;
+    xxh32_init(&h);
+    for (uint32_t i = 0; i < drawOff && off + 1 < out_max; i++) {
+        out[off++] = drawBuf[i];
+        if (!(off & 255)) xxh32_update(&h, (const uint8_t*)out, off);
+    }
+
+    off = write_str(out, off, "</g></svg>");
+    out[off]=0;
+    svg_hash = xxh32_digest(&h, (const uint8_t*)out, off);
+    return off;
+}
+
+// The xxHash32 of the SVG the last call wrote, for use as an ETag
+WASM_EXPORT
+uint32_t wasm_svg_hash(void) {
+    return svg_hash;
+}
+
+#ifndef TXT2SVG_BUILD_ID
+#define TXT2SVG_BUILD_ID 0u
+#endif
+
+// Digest of the sources, fonts and flags of this build (see the
+// Makefile), 0 if built without it. Output is a function of the build and
+// the request, so this and the request make an ETag.
+WASM_EXPORT
+uint32_t wasm_build_id(void) {
+    return TXT2SVG_BUILD_ID;
+}
+
+// A run of text set in one style. Its fonts are the font_refs
+// font..font+num_fonts-1 of the call, the first font falling back on the
+// rest for codepoints it lacks; size is the pixel height (0 for 64). In
+// WASM memory this is five 32-bit words.
+typedef struct {
+    const char *text;
+    uint32_t font;
+    uint32_t num_fonts;
+    const char *color;
+    uint32_t size;
+} text_span;
+
+#define MAX_FONTS 16
+#define MAX_SPANS 64
+
+#define ALIGN_LEFT   0
+#define ALIGN_CENTER 1
+#define ALIGN_RIGHT  2
+
+// Paragraph settings of a request; NULL or all zero for the text on as
+// many lines as it has newlines, left aligned. With a fit box, span sizes
+// only give the spans' proportions: the text is set as large as fits the
+// box and the SVG is exactly the box. In WASM memory this is five 32-bit
+// words.
+typedef struct {
+    uint32_t max_width;   // pixels to wrap lines at, 0 to not wrap
+    uint32_t align;       // ALIGN_LEFT, ALIGN_CENTER or ALIGN_RIGHT
+    uint32_t line_height; // percent of the fonts' line spacing, 0 for 100
+    uint32_t fit_width;   // pixels, 0 for no fit box
+    uint32_t fit_height;
+} text_options;
+
+// A glyph of laid out text. units and kern_units are its advance and the
+// kerning towards the next glyph, when that is set in the same span and
+// font, in font units; advance and kern are the same in whole pixels, as
+// the pen moves by them.
+typedef struct {
+    uint16_t glyph;
+    uint8_t font;  // index into the span's font chain
+    uint8_t span;
+    int32_t cp;    // first codepoint the glyph stands for
+    int32_t units, kern_units;
+    int32_t advance, kern;
+} run_glyph;
+
+// Text of one span between two line break opportunities: a word and the
+// spaces after it. width leaves out the last glyph's kern, trail is the
+// part of it the trailing spaces take up.
+typedef struct {
+    uint32_t first, count; // its glyphs
+    int32_t width, trail;
+    uint8_t span;
+    uint8_t brk;           // LB_NONE, LB_ALLOW or LB_MUST after it
+} text_segment;
+
+// Segment texts already shaped in this request, by text and style
+typedef struct {
+    const char *text;
+    uint32_t len, hash;
+    uint32_t seg; // index + 1 of the segment shaped from it, 0 if free
+} segment_memo;
+
+typedef struct {
+    uint32_t first, end;  // segments
+    int32_t width;        // without trailing spaces
+    int32_t ascent, descent, gap;
+} text_line;
+
+// Text broken into segments and shaped. Segments are measured once,
+// repeated words are copied from their first occurrence rather than
+// shaped again, and lines can then be broken at any width from the
+// segment widths alone. Changing the scales only takes a layout_measure.
+typedef struct {
+    const text_span *spans;
+    chain_font *fonts;
+    float (*scales)[MAX_FONT_CHAIN]; // per span and chain font
+    run_glyph *glyphs;
+    text_segment *segs;
+    uint32_t num_glyphs, num_segs;
+    segment_memo *memo;
+    uint32_t memo_mask;
+    // scratch for shaping one segment
+    uint16_t *sg;
+    int32_t *scp;
+    uint8_t *sf;
+} text_layout;
+
+// The precomputed ASCII glyph standing in for glyph, set for codepoint
+// cp, -1 if there is none
+static int glyph_ascii(const chain_font *cf, int glyph, int cp) {
+    const ascii_table *at = cf->ascii;
+    int a = cp - ASCII_FIRST;
+    return at && a >= 0 && a < ASCII_COUNT && at->glyphs[a] == glyph ? a : -1;
+}
+
+static int glyph_kern(const chain_font *cf, const run_glyph *a, const run_glyph *b) {
+    int aa = glyph_ascii(cf, a->glyph, a->cp), ba = glyph_ascii(cf, b->glyph, b->cp);
+    return aa >= 0 && ba >= 0 ? ascii_kern_advance(cf->ascii, aa, ba)
+                              : font_kern(&cf->face, a->glyph, b->glyph);
+}
+
+static int segment_text_eq(const char *a, const char *b, uint32_t n) {
+    while (n--) if (*a++ != *b++) return 0;
+    return 1;
+}
+
+// Appends the segment text[0..len) of span s: maps it to glyphs, shapes
+// each run set in one font through its GSUB plan and looks up advances
+// and kerning, unless the same text was already shaped in the same style.
+static void layout_segment(text_layout *l, uint32_t s, const char *text, uint32_t len) {
+    const text_span *span = &l->spans[s];
+    chain_font *chain = &l->fonts[span->font];
+    text_segment *seg = &l->segs[l->num_segs];
+    seg->first = l->num_glyphs;
+    seg->count = 0;
+    seg->width = seg->trail = 0;
+    seg->span = (uint8_t)s;
+    seg->brk = LB_NONE;
+    run_glyph *g = &l->glyphs[l->num_glyphs];
+
+    uint32_t h = hash_bytes((const uint8_t*)text, len) ^
+                 (span->font * 0x9E3779B1u + span->num_fonts * 0x85EBCA77u + span->size);
+    segment_memo *m = &l->memo[h & l->memo_mask];
+    for (; m->seg; m = &l->memo[(m - l->memo + 1) & l->memo_mask]) {
+        const text_segment *prev = &l->segs[m->seg - 1];
+        const text_span *ps = &l->spans[prev->span];
+        if (m->hash != h || m->len != len || ps->font != span->font ||
+            ps->num_fonts != span->num_fonts || ps->size != span->size ||
+            !segment_text_eq(m->text, text, len))
+            continue;
+        for (uint32_t i = 0; i < prev->count; i++) {
+            g[i] = l->glyphs[prev->first + i];
+            g[i].span = (uint8_t)s;
+        }
+        seg->count = prev->count;
+        l->num_glyphs += seg->count;
+        l->num_segs++;
+        return;
+    }
+    m->text = text;
+    m->len = len;
+    m->hash = h;
+    m->seg = l->num_segs + 1;
+
+    uint16_t *glyphs = l->sg;
+    int32_t *cps = l->scp;
+    uint8_t *fonts = l->sf;
+    const char *p = text, *end = text + len;
+    int n = (int)span->num_fonts, count = 0;
+    while (p < end) {
+        utf8_int32_t codepoint;
+        p = (const char*)utf8codepoint((const utf8_int8_t*)p, &codepoint);
+        int cls = lb_class(codepoint);
+        // newlines only break the line
+        if (cls == LB_BK || cls == LB_CR || cls == LB_LF) continue;
+        int fi = chain_pick(chain, n, codepoint);
+        const ascii_table *at = chain[fi].ascii;
+        int ascii = at && codepoint >= ASCII_FIRST && codepoint < ASCII_FIRST + ASCII_COUNT
+                  ? codepoint - ASCII_FIRST : -1;
+        glyphs[count] = (uint16_t)(ascii >= 0 ? at->glyphs[ascii] : font_glyph(&chain[fi].face, codepoint));
+        cps[count] = codepoint;
+        fonts[count++] = (uint8_t)fi;
+    }
+
+    // shape each run of one font, closing the gaps ligatures leave
+    int shaped = 0;
+    for (int r = 0; r < count; ) {
+        int e = r;
+        while (e < count && fonts[e] == fonts[r]) e++;
+        for (int i = r; i < e; i++) {
+            glyphs[shaped + i - r] = glyphs[i];
+            cps[shaped + i - r] = cps[i];
+            fonts[shaped + i - r] = fonts[r];
+        }
+        const gsub_plan *gsub = chain[fonts[r]].gsub;
+        shaped += gsub ? gsub_apply(gsub, glyphs + shaped, cps + shaped, e - r) : e - r;
+        r = e;
+    }
+
+    for (int i = 0; i < shaped; i++) {
+        run_glyph *rg = &g[i];
+        rg->glyph = glyphs[i];
+        rg->font = fonts[i];
+        rg->span = (uint8_t)s;
+        rg->cp = cps[i];
+        rg->kern_units = 0;
+    }
+    for (int i = 0; i < shaped; i++) {
+        run_glyph *rg = &g[i];
+        const chain_font *cf = &chain[rg->font];
+        int ascii = glyph_ascii(cf, rg->glyph, rg->cp);
+        rg->units = ascii >= 0 ? cf->ascii->advances[ascii] : font_advance(&cf->face, rg->glyph);
+        if (i + 1 < shaped && g[i + 1].font == rg->font)
+            rg->kern_units = glyph_kern(cf, rg, &g[i + 1]);
+    }
+    seg->count = (uint32_t)shaped;
+    l->num_glyphs += seg->count;
+    l->num_segs++;
+}
+
+// Sets glyph advances, kerning and segment widths in pixels at the
+// current scales.
+static void layout_measure(text_layout *l) {
+    for (uint32_t i = 0; i < l->num_segs; i++) {
+        text_segment *seg = &l->segs[i];
+        const float *scales = l->scales[seg->span];
+        int32_t width = 0, ink = 0;
+        for (uint32_t k = 0; k < seg->count; k++) {
+            run_glyph *g = &l->glyphs[seg->first + k];
+            float scale = scales[g->font];
+            g->advance = (int)(g->units * scale);
+            g->kern = (int)(scale * g->kern_units);
+            width += g->advance;
+            if (lb_class(g->cp) != LB_SP) ink = width;
+            if (k + 1 < seg->count) width += g->kern;
+        }
+        seg->width = width;
+        seg->trail = width - ink;
+    }
+}
+
+// Breaks every span into segments at line break opportunities, shapes
+// them, kerning across segments of one span, and measures them. Returns 0
+// when out of memory.
+static int layout_text(text_layout *l, const text_span *spans, uint32_t num_spans,
+                       chain_font *fonts, float (*scales)[MAX_FONT_CHAIN]) {
+    uint32_t total = 0, longest = 0;
+    for (uint32_t s = 0; s < num_spans; s++) {
+        uint32_t n = 0;
+        while (spans[s].text[n]) n++;
+        total += n;
+        if (n > longest) longest = n;
+    }
+    uint32_t memo_size = 16;
+    while (memo_size < total * 2) memo_size *= 2;
+
+    l->spans = spans;
+    l->fonts = fonts;
+    l->scales = scales;
+    l->num_glyphs = l->num_segs = 0;
+    l->memo_mask = memo_size - 1;
+    l->glyphs = (run_glyph*)STBTT_malloc(total * sizeof(run_glyph) + 1, 0);
+    l->segs = (text_segment*)STBTT_malloc(total * sizeof(text_segment) + 1, 0);
+    l->memo = (segment_memo*)STBTT_malloc(memo_size * sizeof(segment_memo), 0);
+    l->sg = (uint16_t*)STBTT_malloc(longest * 2 + 2, 0);
+    l->scp = (int32_t*)STBTT_malloc(longest * 4 + 4, 0);
+    l->sf = (uint8_t*)STBTT_malloc(longest + 1, 0);
+    if (!l->glyphs || !l->segs || !l->memo || !l->sg || !l->scp || !l->sf) return 0;
+    STBTT_memset(l->memo, 0, memo_size * sizeof(segment_memo));
+
+    int base = LB_AL, prev = LB_AL, started = 0;
+    for (uint32_t s = 0; s < num_spans; s++) {
+        const char *start = spans[s].text, *p = start;
+        while (*p) {
+            const char *at = p;
+            utf8_int32_t codepoint;
+            p = (const char*)utf8codepoint((const utf8_int8_t*)p, &codepoint);
+            int cls = lb_class(codepoint);
+            int attached = cls == LB_CM && prev != LB_SP && prev != LB_BK && prev != LB_CR &&
+                           prev != LB_LF && prev != LB_ZW;
+            if (cls == LB_CM && !attached) cls = LB_AL;
+            int brk = started ? lb_break(base, prev, cls) : LB_NONE;
+            started = 1;
+            if (brk != LB_NONE) {
+                if (at > start) layout_segment(l, s, start, (uint32_t)(at - start));
+                if (l->num_segs) l->segs[l->num_segs - 1].brk = (uint8_t)brk;
+                start = at;
+            }
+            if (attached) continue;
+            prev = cls;
+            if (cls != LB_SP) base = cls;
+        }
+        if (p > start) layout_segment(l, s, start, (uint32_t)(p - start));
+    }
+
+    for (uint32_t i = 1; i < l->num_segs; i++) {
+        const text_segment *a = &l->segs[i - 1], *b = &l->segs[i];
+        if (a->span != b->span || !a->count || !b->count) continue;
+        run_glyph *last = &l->glyphs[a->first + a->count - 1];
+        const run_glyph *next = &l->glyphs[b->first];
+        if (last->font == next->font)
+            last->kern_units = glyph_kern(&fonts[spans[a->span].font + last->font], last, next);
+    }
+    layout_measure(l);
+    return 1;
+}
+
+static void layout_free(text_layout *l) {
+    STBTT_free(l->glyphs, 0);
+    STBTT_free(l->segs, 0);
+    STBTT_free(l->memo, 0);
+    STBTT_free(l->sg, 0);
+    STBTT_free(l->scp, 0);
+    STBTT_free(l->sf, 0);
+}
+
+// A line's width and its ascent, descent and gap: the largest of the
+// spans on it
+static void layout_line_measure(const text_layout *l, text_line *line,
+                                const int32_t (*metrics)[3]) {
+    int32_t pen = 0;
+    line->width = 0;
+    line->ascent = line->descent = line->gap = 0;
+    for (uint32_t j = line->first; j < line->end; j++) {
+        const text_segment *seg = &l->segs[j];
+        line->width = pen + seg->width - seg->trail;
+        pen += seg->width;
+        if (seg->count) pen += l->glyphs[seg->first + seg->count - 1].kern;
+        const int32_t *m = metrics[seg->span];
+        if (m[0] > line->ascent) line->ascent = m[0];
+        if (m[1] > line->descent) line->descent = m[1];
+        if (m[2] > line->gap) line->gap = m[2];
+    }
+}
+
+// Breaks the laid out text into lines no wider than max_width (if not 0)
+// where it may, and wherever it must; a word wider than a line overflows
+// it. Returns the number of lines.
+static uint32_t layout_lines(const text_layout *l, int max_width, const int32_t (*metrics)[3],
+                             text_line *lines) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < l->num_segs; ) {
+        text_line *line = &lines[n++];
+        line->first = i;
+        line->end = i;
+        int32_t pen = 0;
+        for (uint32_t j = i; j < l->num_segs; j++) {
+            const text_segment *seg = &l->segs[j];
+            if (max_width && pen + seg->width - seg->trail > max_width && line->end > i) break;
+            pen += seg->width;
+            if (seg->count) pen += l->glyphs[seg->first + seg->count - 1].kern;
+            if (seg->brk != LB_NONE || j + 1 == l->num_segs) {
+                line->end = j + 1;
+                if (seg->brk == LB_MUST) break;
+            }
+        }
+        layout_line_measure(l, line, metrics);
+        i = line->end;
+    }
+    return n;
+}
+
+static int32_t lines_width(const text_line *lines, uint32_t n) {
+    int32_t w = 0;
+    for (uint32_t i = 0; i < n; i++)
+        if (lines[i].width > w) w = lines[i].width;
+    return w;
+}
+
+// Height of the lines as generate_svg stacks them, from the first one's
+// ascent to the last one's descent
+static int32_t lines_height(const text_line *lines, uint32_t n, int line_height) {
+    if (!n) return 0;
+    int32_t h = lines[0].ascent;
+    for (uint32_t i = 1; i < n; i++)
+        h += (lines[i - 1].descent + lines[i - 1].gap + lines[i].ascent) * line_height / 100;
+    return h + lines[n - 1].descent;
+}
+
+// Scales of every span's fonts at its size times mul, and the span's line
+// metrics from its first font
+static void span_scales(const text_span *spans, uint32_t num_spans, const chain_font *fonts,
+                        float mul, float (*scales)[MAX_FONT_CHAIN], int32_t (*metrics)[3]) {
+    for (uint32_t s = 0; s < num_spans; s++) {
+        const text_span *span = &spans[s];
+        float size = (span->size ? (float)span->size : 64) * mul;
+        for (uint32_t i = 0; i < span->num_fonts; i++)
+            scales[s][i] = font_scale_for_pixel_height(&fonts[span->font + i].face, size);
+        int ascent, descent, gap;
+        font_vmetrics(&fonts[span->font].face, &ascent, &descent, &gap);
+        metrics[s][0] = (int)(ascent * scales[s][0]);
+        metrics[s][1] = (int)(-descent * scales[s][0]);
+        metrics[s][2] = (int)(gap * scales[s][0]);
+    }
+}
+
+// Text is measured for a fit box at this many times its nominal size, so
+// that advances truncated to whole pixels lose next to nothing.
+#define FIT_OVERSAMPLE 64
+
+// The factor to scale the laid out text by to make it as large as fits
+// room_w x room_h pixels, leaving its lines broken for that size. Without
+// wrapping the text only scales and the factor follows from its extent.
+// With wrapping at wrap pixels, lines break earlier as the text grows;
+// the factor is then searched for, each step re-breaking lines from the
+// segment widths alone.
+static float fit_scale(const text_layout *l, const int32_t (*metrics)[3], int line_height,
+                       float room_w, float room_h, float wrap, text_line *lines,
+                       uint32_t *num_lines) {
+    uint32_t n = layout_lines(l, 0, metrics, lines);
+    float w = (float)lines_width(lines, n), h = (float)lines_height(lines, n, line_height);
+    float k = w > 0 && h > 0 ? (room_w / w < room_h / h ? room_w / w : room_h / h)
+            : h > 0 ? room_h / h : 1.0f / FIT_OVERSAMPLE;
+    *num_lines = n;
+    if (!wrap || !(h > 0)) return k;
+
+    // more lines only make the text taller, so room_h / h bounds the factor
+    float lo = 0, hi = room_h / h;
+    for (int iter = 0; iter < 24; iter++) {
+        float mid = (lo + hi) / 2;
+        float max_width = wrap / mid;
+        n = layout_lines(l, max_width < 1e9f ? (int)max_width : 1000000000, metrics, lines);
+        if (mid * lines_width(lines, n) <= room_w &&
+            mid * lines_height(lines, n, line_height) <= room_h)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (lo > 0) k = lo;
+    float max_width = wrap / k;
+    *num_lines = layout_lines(l, max_width < 1e9f ? (int)max_width : 1000000000, metrics, lines);
+    return k;
+}
+
+// A glyph placed by layout: its font as an index into the request's
+// font_refs, the span it belongs to, the codepoint it stands for (the
+// first of a ligature's) and its pen position on the baseline and scale
+// in pixels. In WASM memory this is seven 32-bit words.
+typedef struct {
+    uint32_t glyph;
+    uint32_t font;
+    uint32_t span;
+    int32_t cp;
+    int32_t x, y;
+    float scale;
+} placed_glyph;
+
+// Laid out text as wasm_layout_spans returns it: this header, then
+// num_glyphs placed_glyphs. width and height are the SVG's size for a fit
+// box, 0 to size it to the ink. In WASM memory this is three 32-bit words.
+typedef struct {
+    uint32_t num_glyphs;
+    uint32_t width, height;
+} glyph_run;
+
+#define SVG_PATHS  0 // a path per glyph
+#define SVG_MERGED 1 // a path per run of glyphs of one color
+#define SVG_WORDS  2 // a path per word, through the word cache
+
+// Binds the request's fonts; 0 if one of them can't be used
+static int chain_bind(chain_font *fonts, const font_ref *refs, uint32_t num_fonts) {
+    for (uint32_t i = 0; i < num_fonts; i++) {
+        chain_font *cf = &fonts[i];
+        if (!font_bind(&cf->face, refs[i].data, refs[i].len, (int)refs[i].face, refs[i].variations))
+            return 0;
+        cf->ascii = ascii_table_for(&cf->face);
+        cf->cov = NULL;
+        cf->gsub = gsub_plan_for(&cf->face);
+    }
+    return 1;
+}
+
+// Lays out all spans as one paragraph, spans following each other on a
+// shared pen and broken into lines at newlines and, given a max width,
+// wherever a line would overflow it. The first baseline sits below the
+// tallest ascent on the first line, and each next one a line's spacing
+// lower as given by the spans' fonts. With a fit box the text is shaped
+// once and scaled to fit. Places at most max glyphs in out; returns 0 if
+// the spans or options are invalid or memory runs out.
+static int layout_run(const text_span *spans, uint32_t num_spans, chain_font *fonts,
+                      uint32_t num_fonts, const text_options *opts,
+                      glyph_run *run, placed_glyph *out, uint32_t max) {
+    if (num_fonts < 1 || num_fonts > MAX_FONTS || num_spans < 1 || num_spans > MAX_SPANS)
+        return 0;
+    for (uint32_t s = 0; s < num_spans; s++) {
+        const text_span *span = &spans[s];
+        if (span->num_fonts < 1 || span->num_fonts > MAX_FONT_CHAIN ||
+            span->font >= num_fonts || span->num_fonts > num_fonts - span->font)
+            return 0;
+    }
+    text_options defaults = { 0, ALIGN_LEFT, 0, 0, 0 };
+    if (!opts) opts = &defaults;
+
+    // coverage is only needed to pick among several fonts
+    for (uint32_t s = 0; s < num_spans; s++)
+        if (spans[s].num_fonts > 1)
+            for (uint32_t i = spans[s].font; i < spans[s].font + spans[s].num_fonts; i++)
+                if (!fonts[i].cov) fonts[i].cov = coverage_for(&fonts[i].face);
+
+    int fit = opts->fit_width && opts->fit_height;
+    float scales[MAX_SPANS][MAX_FONT_CHAIN];
+    int32_t metrics[MAX_SPANS][3];
+    span_scales(spans, num_spans, fonts, fit ? FIT_OVERSAMPLE : 1, scales, metrics);
+
+    text_layout l;
+    text_line *lines = NULL;
+    if (!layout_text(&l, spans, num_spans, fonts, scales) ||
+        !(lines = (text_line*)STBTT_malloc(l.num_segs * sizeof(text_line) + 1, 0))) {
+        layout_free(&l);
+        return 0;
+    }
+    int line_height = opts->line_height ? (int)opts->line_height : 100;
+    int32_t box = (int32_t)opts->max_width;
+    uint32_t num_lines;
+    if (fit) {
+        // the box less the padding svg_finish adds; lines wrap at most at its width
+        float room_w = opts->fit_width > 21 ? opts->fit_width - 20.0f : 1;
+        float room_h = opts->fit_height > 21 ? opts->fit_height - 20.0f : 1;
+        if (box > room_w) box = (int32_t)room_w;
+        float k = fit_scale(&l, metrics, line_height, room_w, room_h, (float)box,
+                            lines, &num_lines);
+        span_scales(spans, num_spans, fonts, FIT_OVERSAMPLE * k, scales, metrics);
+        layout_measure(&l);
+        for (uint32_t i = 0; i < num_lines; i++)
+            layout_line_measure(&l, &lines[i], metrics);
+    } else {
+        num_lines = layout_lines(&l, box, metrics, lines);
+    }
+    if (!box) box = lines_width(lines, num_lines);
+
+    uint32_t n = 0;
+    int baseline = 0;
+    for (uint32_t i = 0; i < num_lines; i++) {
+        const text_line *line = &lines[i];
+        if (i) {
+            const text_line *above = &lines[i - 1];
+            baseline += (above->descent + above->gap + line->ascent) * line_height / 100;
+        } else {
+            baseline = line->ascent;
+        }
+        int pen_x = 10;
+        if (opts->align == ALIGN_CENTER) pen_x += (box - line->width) / 2;
+        else if (opts->align == ALIGN_RIGHT) pen_x += box - line->width;
+
+        for (uint32_t j = line->first; j < line->end; j++) {
+            const text_segment *seg = &l.segs[j];
+            for (uint32_t k = 0; k < seg->count; k++, n++) {
+                if (n >= max) continue;
+                const run_glyph *g = &l.glyphs[seg->first + k];
+                placed_glyph *p = &out[n];
+                p->glyph = g->glyph;
+                p->font = spans[seg->span].font + g->font;
+                p->span = seg->span;
+                p->cp = g->cp;
+                p->x = pen_x;
+                p->y = baseline;
+                p->scale = scales[seg->span][g->font];
+                pen_x += g->advance + g->kern;
+            }
+        }
+    }
+    layout_free(&l);
+    STBTT_free(lines, 0);
+    if (n > max) return 0;
+
+    run->num_glyphs = n;
+    run->width = fit ? opts->fit_width : 0;
+    run->height = fit ? opts->fit_height : 0;
+    return 1;
+}
+
+static int str_eq(const char *a, const char *b) {
+    while (*a && *a == *b) a++, b++;
+    return *a == *b;
+}
+
+// Writes a glyph as a path of its own
+static void svg_glyph(svg_pen *sp, const chain_font *cf, const placed_glyph *g, const char *color) {
+    const ascii_table *at = cf->ascii;
+    int ascii = glyph_ascii(cf, (int)g->glyph, g->cp);
+    float scale = sp->scale = g->scale;
+
+    // Start a new path for this character
+    if (sp->off + 20 < sp->cap) {
+        sp->off = write_str(sp->buf, sp->off, "<path fill='");
+        sp->off = write_str(sp->buf, sp->off, color);
+        sp->buf[sp->off++]='\'';
+    }
+
+    if (ascii >= 0) {
+        // Precomputed glyph: font-unit path data placed with a transform
+        const char *d = at->paths[ascii];
+        const int16_t *box = at->boxes[ascii];
+        if (*d) {
+            float x0 = g->x + box[0] * scale, x1 = g->x + box[2] * scale;
+            float y0 = g->y - box[3] * scale, y1 = g->y - box[1] * scale;
+            if (x0 < sp->min_x) sp->min_x = x0;
+            if (x1 > sp->max_x) sp->max_x = x1;
+            if (y0 < sp->min_y) sp->min_y = y0;
+            if (y1 > sp->max_y) sp->max_y = y1;
+
+            if (sp->off + 80 < sp->cap) {
+                sp->off = write_str(sp->buf, sp->off, " transform='matrix(");
+                sp->off = write_fixed(sp->buf, sp->off, scale, 6);
+                sp->off = write_str(sp->buf, sp->off, " 0 0 ");
+                sp->off = write_fixed(sp->buf, sp->off, -scale, 6);
+                sp->buf[sp->off++]=' ';
+                sp->off = write_int(sp->buf, sp->off, g->x);
+                sp->buf[sp->off++]=' ';
+                sp->off = write_int(sp->buf, sp->off, g->y);
+                sp->off = write_str(sp->buf, sp->off, ")'");
+            }
+        }
+        if (sp->off + 10 < sp->cap)
+            sp->off = write_str(sp->buf, sp->off, " d='");
+        while (*d && sp->off + 10 < sp->cap) sp->buf[sp->off++] = *d++;
+    } else {
+        if (sp->off + 10 < sp->cap)
+            sp->off = write_str(sp->buf, sp->off, " d='");
+        sp->ox = g->x;
+        sp->oy = g->y;
+        font_emit(&cf->face, g->glyph, &sp->pen);
+    }
+
+    // Close the current character's path
+    if (sp->off + 10 < sp->cap) {
+        sp->off = write_str(sp->buf, sp->off, "'/>");
+    }
+}
+
+// Number of glyphs from g on that make up a word: glyphs of one font,
+// span, scale and line, up to a space or WORD_MAX_GLYPHS. A space is a
+// word of its own.
+static uint32_t word_length(const placed_glyph *g, uint32_t left, const chain_font *fonts,
+                            uint32_t num_fonts) {
+    uint32_t n = 1;
+    if (lb_class(g->cp) == LB_SP) return n;
+    for (; n < left && n < WORD_MAX_GLYPHS; n++) {
+        const placed_glyph *h = &g[n];
+        if (h->font != g->font || h->span != g->span || h->scale != g->scale || h->y != g->y ||
+            lb_class(h->cp) == LB_SP || h->font >= num_fonts)
+            break;
+        const chain_font *cf = &fonts[h->font];
+        uint32_t num_glyphs = cf->face.pack ? cf->face.pack->num_glyphs : (uint32_t)cf->face.info.numGlyphs;
+        if (h->glyph >= num_glyphs) break;
+    }
+    return n;
+}
+
+// Writes n glyphs of a word as one path placed with a translate. The path
+// data is copied from the word cache, or built relative to the word's
+// origin and cached: ASCII glyphs from their precomputed outlines, others
+// by decoding them.
+static void svg_word(svg_pen *sp, const chain_font *cf, const placed_glyph *g, uint32_t n,
+                     const char *color) {
+    uint32_t key[2 * WORD_MAX_GLYPHS];
+    for (uint32_t k = 0; k < n; k++) {
+        key[2 * k] = g[k].glyph;
+        key[2 * k + 1] = (uint32_t)(g[k].x - g->x);
+    }
+    uint32_t font = cf->face.fingerprint;
+    uint32_t hash = word_hash(font, g->scale, sp->precision, key, n);
+    const word_entry *e = word_find(font, g->scale, sp->precision, key, n, hash);
+    if (e && !e->len) return;
+
+    uint32_t start = sp->off;
+    if (sp->off + 80 >= sp->cap) return;
+    sp->off = write_str(sp->buf, sp->off, "<path fill='");
+    sp->off = write_str(sp->buf, sp->off, color);
+    sp->off = write_str(sp->buf, sp->off, "' transform='translate(");
+    sp->off = write_int(sp->buf, sp->off, g->x);
+    sp->buf[sp->off++]=' ';
+    sp->off = write_int(sp->buf, sp->off, g->y);
+    sp->off = write_str(sp->buf, sp->off, ")' d='");
+
+    float box[4];
+    if (e) {
+        if (sp->off + e->len + 10 >= sp->cap) {
+            sp->off = start;
+            return;
+        }
+        STBTT_memcpy(sp->buf + sp->off, word_path(e), e->len);
+        sp->off += e->len;
+        for (int k = 0; k < 4; k++) box[k] = e->box[k];
+    } else {
+        svg_pen wp = { { svg_pen_emit }, sp->buf, sp->off, sp->cap, 0, 0, g->scale,
+                       1e30f, -1e30f, 1e30f, -1e30f, sp->precision };
+        for (uint32_t k = 0; k < n; k++) {
+            int ascii = glyph_ascii(cf, (int)g[k].glyph, g[k].cp);
+            wp.ox = (float)(int32_t)key[2 * k + 1];
+            if (ascii >= 0) ascii_outline_emit(cf->ascii, ascii, &wp.pen);
+            else font_emit(&cf->face, (int)g[k].glyph, &wp.pen);
+        }
+        box[0] = wp.min_x;
+        box[1] = wp.min_y;
+        box[2] = wp.max_x;
+        box[3] = wp.max_y;
+        // a word cut short by a full buffer isn't worth keeping
+        if (wp.off + 100 < wp.cap)
+            word_store(font, g->scale, sp->precision, key, n, hash,
+                       sp->buf + sp->off, wp.off - sp->off, box);
+        if (wp.off == sp->off) {
+            sp->off = start;
+            return;
+        }
+        sp->off = wp.off;
+    }
+
+    if (g->x + box[0] < sp->min_x) sp->min_x = g->x + box[0];
+    if (g->y + box[1] < sp->min_y) sp->min_y = g->y + box[1];
+    if (g->x + box[2] > sp->max_x) sp->max_x = g->x + box[2];
+    if (g->y + box[3] > sp->max_y) sp->max_y = g->y + box[3];
+    if (sp->off + 10 < sp->cap)
+        sp->off = write_str(sp->buf, sp->off, "'/>");
+}
+
+// Writes laid out glyphs as an SVG document. Glyphs of span s are filled
+// with colors[s], or the last color for spans past the end. Coordinates
+// have precision decimals. SVG_MERGED joins glyphs of one color into one
+// path, decoding every outline rather than placing precomputed ones.
+// SVG_WORDS writes a path per word and serves repeated words from the
+// word cache.
+static uint32_t serialize_run(const glyph_run *run, const placed_glyph *glyphs,
+                              const chain_font *fonts, uint32_t num_fonts,
+                              const char *const *colors, uint32_t num_colors,
+                              int precision, int mode, char *out, uint32_t out_max) {
+    if (num_colors < 1 || out_max < 512) return 0;
+    svg_pen sp = { { svg_pen_emit }, out + 256, 0, out_max - 256, 0, 0, 0,
+                   1e30f, -1e30f, 1e30f, -1e30f, precision < 0 ? 0 : precision > 6 ? 6 : precision };
+
+    const char *open = NULL;
+    for (uint32_t i = 0; i < run->num_glyphs; i++) {
+        const placed_glyph *g = &glyphs[i];
+        if (g->font >= num_fonts) continue;
+        const chain_font *cf = &fonts[g->font];
+        uint32_t num_glyphs = cf->face.pack ? cf->face.pack->num_glyphs : (uint32_t)cf->face.info.numGlyphs;
+        if (g->glyph >= num_glyphs) continue;
+        const char *color = colors[g->span < num_colors ? g->span : num_colors - 1];
+
+        if (mode == SVG_WORDS) {
+            uint32_t n = word_length(g, run->num_glyphs - i, fonts, num_fonts);
+            svg_word(&sp, cf, g, n, color);
+            i += n - 1;
+            continue;
+        }
+        if (mode != SVG_MERGED) {
+            svg_glyph(&sp, cf, g, color);
+            continue;
+        }
+        if (!open || !str_eq(open, color)) {
+            if (open && sp.off + 10 < sp.cap)
+                sp.off = write_str(sp.buf, sp.off, "'/>");
+            if (sp.off + 20 < sp.cap) {
+                sp.off = write_str(sp.buf, sp.off, "<path fill='");
+                sp.off = write_str(sp.buf, sp.off, color);
+                sp.off = write_str(sp.buf, sp.off, "' d='");
+            }
+            open = color;
+        }
+        sp.scale = g->scale;
+        sp.ox = g->x;
+        sp.oy = g->y;
+        font_emit(&cf->face, g->glyph, &sp.pen);
+    }
+    if (open && sp.off + 10 < sp.cap)
+        sp.off = write_str(sp.buf, sp.off, "'/>");
+
+    return svg_finish(&sp, run->width, run->height, out, out_max);
+}
+
+// Layout and serialization in one go, placing the glyphs in scratch
+static uint32_t generate_svg(const text_span *spans, uint32_t num_spans,
+                             const font_ref *refs, uint32_t num_fonts,
+                             const text_options *opts, char *out, uint32_t out_max) {
+    chain_font fonts[MAX_FONTS];
+    if (num_fonts < 1 || num_fonts > MAX_FONTS || num_spans < 1 || num_spans > MAX_SPANS ||
+        !chain_bind(fonts, refs, num_fonts))
+        return 0;
+    uint32_t max = 0;
+    const char *colors[MAX_SPANS];
+    for (uint32_t s = 0; s < num_spans; s++) {
+        for (const char *p = spans[s].text; *p; p++) max++;
+        colors[s] = spans[s].color;
+    }
+    placed_glyph *glyphs = (placed_glyph*)STBTT_malloc(max * sizeof(placed_glyph) + 1, 0);
+    glyph_run run;
+    uint32_t len = 0;
+    if (glyphs && layout_run(spans, num_spans, fonts, num_fonts, opts, &run, glyphs, max))
+        len = serialize_run(&run, glyphs, fonts, num_fonts, colors, num_spans, 3, SVG_WORDS,
+                            out, out_max);
+    STBTT_free(glyphs, 0);
+    return len;
+}
+
+// Renders text with fonts[0], falling back along fonts[1..num_fonts-1]
+// for codepoints it lacks. Every font is scaled to the same pixel height
+// and shares the first font's baseline. options_ptr points to a
+// text_options or is NULL.
+WASM_EXPORT
+uint32_t wasm_generate_svg(
+    void* text_ptr,
+    void* fonts_ptr,
+    uint32_t num_fonts,
+    void* color_ptr,
+    void* options_ptr,
+    void* out_ptr,
+    uint32_t out_max
+) {
+    if (num_fonts > MAX_FONT_CHAIN)
+        return 0;
+    text_span span = { (const char*)text_ptr, 0, num_fonts, (const char*)color_ptr, 64 };
+    return generate_svg(&span, 1, (const font_ref*)fonts_ptr, num_fonts,
+                        (const text_options*)options_ptr, (char*)out_ptr, out_max);
+}
+
+// Renders several spans, each in its own fonts, color and size, into one
+// SVG: spans follow each other on a shared pen position and baseline,
+// wrapping as one paragraph. fonts_ptr holds the font_refs the spans
+// index into.
+WASM_EXPORT
+uint32_t wasm_generate_svg_spans(
+    void* spans_ptr,
+    uint32_t num_spans,
+    void* fonts_ptr,
+    uint32_t num_fonts,
+    void* options_ptr,
+    void* out_ptr,
+    uint32_t out_max
+) {
+    return generate_svg((const text_span*)spans_ptr, num_spans, (const font_ref*)fonts_ptr,
+                        num_fonts, (const text_options*)options_ptr, (char*)out_ptr, out_max);
+}
+
+// Lays out spans as wasm_generate_svg_spans does but stops short of SVG:
+// writes a glyph_run and its placed_glyphs to run_ptr, which has room for
+// run_max bytes. Returns the bytes written, 0 on failure or if the run
+// doesn't fit. A run can be kept and serialized any number of times.
+WASM_EXPORT
+uint32_t wasm_layout_spans(
+    void* spans_ptr,
+    uint32_t num_spans,
+    void* fonts_ptr,
+    uint32_t num_fonts,
+    void* options_ptr,
+    void* run_ptr,
+    uint32_t run_max
+) {
+    chain_font fonts[MAX_FONTS];
+    glyph_run *run = (glyph_run*)run_ptr;
+    if (num_fonts < 1 || num_fonts > MAX_FONTS || run_max < sizeof(glyph_run) ||
+        !chain_bind(fonts, (const font_ref*)fonts_ptr, num_fonts))
+        return 0;
+    uint32_t max = (run_max - sizeof(glyph_run)) / sizeof(placed_glyph);
+    if (!layout_run((const text_span*)spans_ptr, num_spans, fonts, num_fonts,
+                    (const text_options*)options_ptr, run, (placed_glyph*)(run + 1), max))
+        return 0;
+    return sizeof(glyph_run) + run->num_glyphs * sizeof(placed_glyph);
+}
+
+// Writes a run from wasm_layout_spans as SVG. fonts_ptr holds the
+// font_refs it was laid out with, colors_ptr num_colors color strings
+// that span s takes the s-th of (the last for spans past the end).
+// precision is the number of decimals (0 to 6) of path coordinates and
+// mode SVG_PATHS, SVG_MERGED or SVG_WORDS.
+WASM_EXPORT
+uint32_t wasm_serialize_svg(
+    void* run_ptr,
+    void* fonts_ptr,
+    uint32_t num_fonts,
+    void* colors_ptr,
+    uint32_t num_colors,
+    uint32_t precision,
+    uint32_t mode,
+    void* out_ptr,
+    uint32_t out_max
+) {
+    chain_font fonts[MAX_FONTS];
+    const glyph_run *run = (const glyph_run*)run_ptr;
+    if (num_fonts < 1 || num_fonts > MAX_FONTS ||
+        !chain_bind(fonts, (const font_ref*)fonts_ptr, num_fonts))
+        return 0;
+    return serialize_run(run, (const placed_glyph*)(run + 1), fonts, num_fonts,
+                         (const char *const *)colors_ptr, num_colors, (int)precision, (int)mode,
+                         (char*)out_ptr, out_max);
+}
+
+// A glyph as positioned by an external shaper such as HarfBuzz, in font
+// units. In WASM memory this is four 32-bit words.
+typedef struct {
+    uint32_t glyph;
+    int32_t x_advance;
+    int32_t x_offset;
+    int32_t y_offset;
+} shaped_glyph;
+
+// Renders a pre-shaped glyph run in font (a single font_ref) at size
+// pixels (0 for 64). Glyphs are drawn where the shaper placed them, with
+// no cmap lookup or kerning; unknown glyph ids only advance the pen.
+WASM_EXPORT
+uint32_t wasm_generate_svg_glyphs(
+    void* glyphs_ptr,
+    uint32_t num_glyphs,
+    void* font_ptr,
+    void* color_ptr,
+    uint32_t size,
+    void* out_ptr,
+    uint32_t out_max
+) {
+    const shaped_glyph *glyphs = (const shaped_glyph*)glyphs_ptr;
+    const font_ref *ref = (const font_ref*)font_ptr;
+    char *color = (char*)color_ptr;
+    char *out = (char*)out_ptr;
+
+    font_face font;
+    if (out_max < 512 || !font_bind(&font, ref->data, ref->len, (int)ref->face, ref->variations))
+        return 0;
+    uint32_t font_glyphs = font.pack ? font.pack->num_glyphs : (uint32_t)font.info.numGlyphs;
+
+    float scale = font_scale_for_pixel_height(&font, size ? (float)size : 64);
+    int ascent, descent, gap;
+    font_vmetrics(&font, &ascent, &descent, &gap);
+    int baseline = (int)(ascent * scale);
+
+    svg_pen sp = { { svg_pen_emit }, out + 256, 0, out_max - 256, 0, baseline, scale,
+                   1e30f, -1e30f, 1e30f, -1e30f, 3 };
+
+    // the pen moves in font units so advances don't accumulate rounding
+    int32_t pen_x = 0;
+    for (uint32_t i = 0; i < num_glyphs; i++) {
+        const shaped_glyph *g = &glyphs[i];
+        if (g->glyph < font_glyphs) {
+            if (sp.off + 20 < sp.cap) {
+                sp.off = write_str(sp.buf, sp.off, "<path fill='");
+                sp.off = write_str(sp.buf, sp.off, color);
+                sp.off = write_str(sp.buf, sp.off, "' d='");
+            }
+            sp.ox = 10 + (pen_x + g->x_offset) * scale;
+            sp.oy = baseline - g->y_offset * scale;
+            font_emit(&font, (int)g->glyph, &sp.pen);
+            if (sp.off + 10 < sp.cap)
+                sp.off = write_str(sp.buf, sp.off, "'/>");
+        }
+        pen_x += g->x_advance;
+    }
+
+    return svg_finish(&sp, 0, 0, out, out_max);
+}
+
+// ---------------- sessions ----------------
+// Live editing re-renders text that mostly didn't change. A session keeps
+// the glyphs it last rendered with their path data relative to each
+// glyph's origin. The next render diffs the new glyph run against them:
+// the unchanged prefix and suffix copy their path data over, placed with
+// a translate, and only glyphs in between are decoded and formatted.
+// Sessions hold a fixed block of persistent memory each; a render whose
+// glyphs don't fit is still drawn but leaves nothing to reuse.
+
+#define MAX_SESSIONS 4
+#define SESSION_BYTES (256 * 1024)
+
+// A glyph a session drew: path data at off..off+len of the fragment bytes
+// and its bounding box, both relative to the glyph origin
+typedef struct {
+    uint32_t glyph;
+    uint32_t font; // fingerprint of the font instance
+    float scale;
+    float box[4];  // min x, min y, max x, max y
+    uint32_t off, len;
+} session_glyph;
+
+// mem holds num_glyphs session_glyphs followed by the fragment bytes
+typedef struct {
+    uint8_t *mem;
+    int open;
+    uint32_t num_glyphs;
+} render_session;
+
+static render_session sessions[MAX_SESSIONS];
+
+static int session_glyph_eq(const session_glyph *a, const session_glyph *b) {
+    return a->glyph == b->glyph && a->font == b->font && a->scale == b->scale;
+}
+
+// Opens a session, returning its handle, or 0 if all are in use or there
+// is no memory left for one
+WASM_EXPORT
+uint32_t wasm_session_open(void) {
+    for (uint32_t i = 0; i < MAX_SESSIONS; i++) {
+        render_session *s = &sessions[i];
+        if (s->open) continue;
+        if (!s->mem && !(s->mem = (uint8_t*)persist_alloc(SESSION_BYTES))) return 0;
+        s->open = 1;
+        s->num_glyphs = 0;
+        return i + 1;
+    }
+    return 0;
+}
+
+// Closes a session; its memory goes to the next one opened
+WASM_EXPORT
+void wasm_session_close(uint32_t id) {
+    if (id < 1 || id > MAX_SESSIONS) return;
+    sessions[id - 1].open = 0;
+    sessions[id - 1].num_glyphs = 0;
+}
+
+// Renders spans as wasm_generate_svg_spans does, reusing what session id
+// drew last time for the glyphs before and after the edit. Each glyph is
+// a path placed with a translate; spaces have none.
+WASM_EXPORT
+uint32_t wasm_session_render(
+    uint32_t id,
+    void* spans_ptr,
+    uint32_t num_spans,
+    void* fonts_ptr,
+    uint32_t num_fonts,
+    void* options_ptr,
+    void* out_ptr,
+    uint32_t out_max
+) {
+    const text_span *spans = (const text_span*)spans_ptr;
+    char *out = (char*)out_ptr;
+    chain_font fonts[MAX_FONTS];
+    if (id < 1 || id > MAX_SESSIONS || !sessions[id - 1].open || out_max < 512 ||
+        num_fonts < 1 || num_fonts > MAX_FONTS || num_spans < 1 || num_spans > MAX_SPANS ||
+        !chain_bind(fonts, (const font_ref*)fonts_ptr, num_fonts))
+        return 0;
+    render_session *session = &sessions[id - 1];
+
+    uint32_t max = 0;
+    for (uint32_t s = 0; s < num_spans; s++)
+        for (const char *p = spans[s].text; *p; p++) max++;
+    placed_glyph *placed = (placed_glyph*)STBTT_malloc(max * sizeof(placed_glyph) + 1, 0);
+    session_glyph *glyphs = (session_glyph*)STBTT_malloc(max * sizeof(session_glyph) + 1, 0);
+    uint32_t frag_max = out_max;
+    char *frags = (char*)STBTT_malloc(frag_max, 0);
+    glyph_run run;
+    if (!placed || !glyphs || !frags ||
+        !layout_run(spans, num_spans, fonts, num_fonts, (const text_options*)options_ptr,
+                    &run, placed, max)) {
+        STBTT_free(placed, 0);
+        STBTT_free(glyphs, 0);
+        STBTT_free(frags, 0);
+        return 0;
+    }
+
+    // the old and new runs agree on a prefix and a suffix
+    uint32_t n = run.num_glyphs;
+    const session_glyph *old = (const session_glyph*)session->mem;
+    const char *old_frags = (const char*)(old + session->num_glyphs);
+    uint32_t old_n = session->num_glyphs;
+    for (uint32_t i = 0; i < n; i++) {
+        session_glyph *g = &glyphs[i];
+        g->glyph = placed[i].glyph;
+        g->font = fonts[placed[i].font].face.fingerprint;
+        g->scale = placed[i].scale;
+    }
+    uint32_t prefix = 0, suffix = 0;
+    while (prefix < n && prefix < old_n && session_glyph_eq(&glyphs[prefix], &old[prefix]))
+        prefix++;
+    while (suffix < n - prefix && suffix < old_n - prefix &&
+           session_glyph_eq(&glyphs[n - 1 - suffix], &old[old_n - 1 - suffix]))
+        suffix++;
+
+    // path data for every glyph: copied where it can be, drawn at the
+    // origin where it changed. Path data that doesn't fit fails the render
+    // and leaves the session as it was, rather than keep a glyph with no
+    // outline for the next edit to copy.
+    svg_pen fp = { { svg_pen_emit }, frags, 0, frag_max, 0, 0, 0,
+                   1e30f, -1e30f, 1e30f, -1e30f, 3 };
+    int overflow = 0;
+    for (uint32_t i = 0; i < n && !overflow; i++) {
+        session_glyph *g = &glyphs[i];
+        const session_glyph *from = i < prefix ? &old[i]
+                                  : i >= n - suffix ? &old[i - n + old_n] : NULL;
+        g->off = fp.off;
+        if (from) {
+            if (fp.off + from->len >= fp.cap) {
+                overflow = 1;
+                break;
+            }
+            STBTT_memcpy(frags + fp.off, old_frags + from->off, from->len);
+            fp.off += from->len;
+            for (int k = 0; k < 4; k++) g->box[k] = from->box[k];
+        } else {
+            const chain_font *cf = &fonts[placed[i].font];
+            uint32_t num_glyphs = cf->face.pack ? cf->face.pack->num_glyphs
+                                                : (uint32_t)cf->face.info.numGlyphs;
+            fp.min_x = fp.min_y = 1e30f;
+            fp.max_x = fp.max_y = -1e30f;
+            fp.scale = g->scale;
+            if (g->glyph < num_glyphs) font_emit(&cf->face, g->glyph, &fp.pen);
+            g->box[0] = fp.min_x;
+            g->box[1] = fp.min_y;
+            g->box[2] = fp.max_x;
+            g->box[3] = fp.max_y;
+            // svg_pen_emit drops commands within 100 bytes of the end
+            overflow = fp.off + 100 >= fp.cap;
+        }
+        g->len = fp.off - g->off;
+    }
+    if (overflow) {
+        STBTT_free(placed, 0);
+        STBTT_free(glyphs, 0);
+        STBTT_free(frags, 0);
+        return 0;
+    }
+
+    svg_pen sp = { { svg_pen_emit }, out + 256, 0, out_max - 256, 0, 0, 0,
+                   1e30f, -1e30f, 1e30f, -1e30f, 3 };
+    for (uint32_t i = 0; i < n; i++) {
+        const session_glyph *g = &glyphs[i];
+        const placed_glyph *p = &placed[i];
+        if (!g->len) continue;
+        if (p->x + g->box[0] < sp.min_x) sp.min_x = p->x + g->box[0];
+        if (p->y + g->box[1] < sp.min_y) sp.min_y = p->y + g->box[1];
+        if (p->x + g->box[2] > sp.max_x) sp.max_x = p->x + g->box[2];
+        if (p->y + g->box[3] > sp.max_y) sp.max_y = p->y + g->box[3];
+        if (sp.off + g->len + 100 >= sp.cap) continue;
+        sp.off = write_str(sp.buf, sp.off, "<path fill='");
+        sp.off = write_str(sp.buf, sp.off, spans[p->span].color);
+        sp.off = write_str(sp.buf, sp.off, "' transform='translate(");
+        sp.off = write_int(sp.buf, sp.off, p->x);
+        sp.buf[sp.off++]=' ';
+        sp.off = write_int(sp.buf, sp.off, p->y);
+        sp.off = write_str(sp.buf, sp.off, ")' d='");
+        STBTT_memcpy(sp.buf + sp.off, frags + g->off, g->len);
+        sp.off += g->len;
+        sp.off = write_str(sp.buf, sp.off, "'/>");
+    }
+    uint32_t len = svg_finish(&sp, run.width, run.height, out, out_max);
+
+    // keep this render for the next one, if it fits
+    uint32_t size = n * sizeof(session_glyph) + fp.off;
+    if (fp.off + 1 < fp.cap && size <= SESSION_BYTES) {
+        STBTT_memcpy(session->mem, glyphs, n * sizeof(session_glyph));
+        STBTT_memcpy(session->mem + n * sizeof(session_glyph), frags, fp.off);
+        session->num_glyphs = n;
+    } else {
+        session->num_glyphs = 0;
+    }
+
+    STBTT_free(placed, 0);
+    STBTT_free(glyphs, 0);
+    STBTT_free(frags, 0);
+    return len;
+}
+
+#ifndef __wasm__
+#include <stdio.h>
+
+// ---------------- pack builder ----------------
+// Native only: used by the offline fontpack tool to turn a TTF into a pack
+// (see the pack section above for the layout).
+
+typedef struct {
+    uint8_t *data;
+    uint32_t len, cap;
+} pack_buf;
+
+// Appends n zeroed bytes at the next 4-byte boundary and returns their
+// offset. The buffer may move, so callers hold offsets, not pointers.
+static uint32_t pack_reserve(pack_buf *b, uint32_t n) {
+    uint32_t off = (b->len + 3) & ~3u;
+    if (off + n > b->cap) {
+        uint32_t cap = b->cap ? b->cap : 4096;
+        while (off + n > cap) cap *= 2;
+        b->data = realloc(b->data, cap);
+        memset(b->data + b->cap, 0, cap - b->cap);
+        b->cap = cap;
+    }
+    b->len = off + n;
+    return off;
+}
+
+uint8_t* pack_build(const uint8_t *ttf, uint32_t *out_len) {
+    stbtt_fontinfo font;
+    if (!stbtt_InitFont(&font, (unsigned char*)ttf, 0) || font.cff.size)
+        return NULL;
+    lazy_attach(&font);
+
+    uint32_t n = (uint32_t)font.numGlyphs;
+    pack_buf b = { 0 };
+    uint32_t hdr = pack_reserve(&b, sizeof(pack_header));
+    uint8_t *mapped = calloc(n, 1);
+
+    // cmap: direct table for Latin-1, runs of consecutive glyphs above it
+    uint32_t latin_off = pack_reserve(&b, 256 * sizeof(uint16_t));
+    for (int cp = 0; cp < 256; cp++) {
+        int g = stbtt_FindGlyphIndex(&font, cp);
+        ((uint16_t*)(b.data + latin_off))[cp] = (uint16_t)g;
+        if (g) mapped[g] = 1;
+    }
+
+    pack_range *ranges = NULL;
+    uint32_t num_ranges = 0, ranges_cap = 0;
+    for (int cp = 256; cp <= 0x10FFFF; cp++) {
+        int g = stbtt_FindGlyphIndex(&font, cp);
+        if (!g) continue;
+        mapped[g] = 1;
+        pack_range *last = num_ranges ? &ranges[num_ranges - 1] : NULL;
+        if (last && last->first + last->count == (uint32_t)cp &&
+            last->glyph + last->count == (uint32_t)g) {
+            last->count++;
+            continue;
+        }
+        if (num_ranges == ranges_cap) {
+            ranges_cap = ranges_cap ? ranges_cap * 2 : 256;
+            ranges = realloc(ranges, ranges_cap * sizeof(pack_range));
+        }
+        ranges[num_ranges++] = (pack_range){ (uint32_t)cp, 1, (uint32_t)g };
+    }
+    uint32_t ranges_off = pack_reserve(&b, num_ranges * sizeof(pack_range));
+    memcpy(b.data + ranges_off, ranges, num_ranges * sizeof(pack_range));
+    free(ranges);
+
+    uint32_t metrics_off = pack_reserve(&b, n * sizeof(pack_metric));
+    uint32_t boxes_off = pack_reserve(&b, n * sizeof(pack_box));
+    for (uint32_t g = 0; g < n; g++) {
+        int ax, lsb, x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+        stbtt_GetGlyphHMetrics(&font, g, &ax, &lsb);
+        stbtt_GetGlyphBox(&font, g, &x0, &y0, &x1, &y1);
+        ((pack_metric*)(b.data + metrics_off))[g] = (pack_metric){ (uint16_t)ax, (int16_t)lsb };
+        ((pack_box*)(b.data + boxes_off))[g] = (pack_box){ x0, y0, x1, y1 };
+    }
+
+    // Kerning is resolved (kern or GPOS) for every pair of glyphs reachable
+    // through the cmap; iterating in order keeps the table sorted.
+    uint32_t kerns_off = (b.len + 3) & ~3u, num_kerns = 0;
+    for (uint32_t g1 = 0; g1 < n; g1++) {
+        if (!mapped[g1] || (!font.kern && !font.gpos)) continue;
+        for (uint32_t g2 = 0; g2 < n; g2++) {
+            if (!mapped[g2]) continue;
+            int v = stbtt_GetGlyphKernAdvance(&font, g1, g2);
+            if (!v) continue;
+            uint32_t off = pack_reserve(&b, sizeof(pack_kern));
+            *(pack_kern*)(b.data + off) = (pack_kern){ g1 << 16 | g2, v };
+            num_kerns++;
+        }
+    }
+    free(mapped);
+
+    uint32_t outlines_off = pack_reserve(&b, (n + 1) * sizeof(uint32_t));
+    for (uint32_t g = 0; g < n; g++) {
+        outline_pen r = { { outline_pen_emit }, NULL, 0, 0 };
+        glyf_decode(&font, NULL, g, &r.pen, 0);
+        ((uint32_t*)(b.data + outlines_off))[g] = (b.len + 3) & ~3u;
+        if (!r.ncmds) continue;
+        if (r.ncmds > 0xFFFF || r.npts > 0xFFFF) {
+            free(b.data);
+            return NULL;
+        }
+        uint32_t off = pack_reserve(&b, outline_size(r.ncmds, r.npts));
+        r.o = (outline*)(b.data + off);
+        r.o->ncmds = (uint16_t)r.ncmds;
+        r.o->npts = (uint16_t)r.npts;
+        r.ncmds = r.npts = 0;
+        glyf_decode(&font, NULL, g, &r.pen, 0);
+    }
+    pack_reserve(&b, 0);
+    ((uint32_t*)(b.data + outlines_off))[n] = b.len;
+
+    int ascent, descent, gap;
+    stbtt_GetFontVMetrics(&font, &ascent, &descent, &gap);
+    pack_header *p = (pack_header*)(b.data + hdr);
+    p->magic = PACK_MAGIC;
+    p->version = PACK_VERSION;
+    p->size = b.len;
+    p->fingerprint = font_fingerprint(&font);
+    p->ascent = (int16_t)ascent;
+    p->descent = (int16_t)descent;
+    p->line_gap = (int16_t)gap;
+    p->units_per_em = (int16_t)ttUSHORT(font.data + font.head + 18);
+    p->num_glyphs = n;
+    p->num_ranges = num_ranges;
+    p->num_kerns = num_kerns;
+    p->latin_off = latin_off;
+    p->ranges_off = ranges_off;
+    p->metrics_off = metrics_off;
+    p->boxes_off = boxes_off;
+    p->kerns_off = kerns_off;
+    p->outlines_off = outlines_off;
+
+    *out_len = b.len;
+    return b.data;
+}
+// ---------------- ascii table generator ----------------
+// Native only: `fontpack -c` writes the ascii_tables.h consumed above.
+
+// Serializes an outline as font-unit path data and tracks the bounding
+// box of its on-curve points.
+typedef struct {
+    glyph_pen pen;
+    FILE *out;
+    int x0, y0, x1, y1;
+    int n;
+} c_path_pen;
+
+static void c_path_emit(glyph_pen *pen, int type, int x, int y, int cx, int cy) {
+    c_path_pen *c = (c_path_pen*)pen;
+    if (type == STBTT_vcurve)
+        fprintf(c->out, "Q%d %d %d %d", cx, cy, x, y);
+    else
+        fprintf(c->out, "%c%d %d", type == STBTT_vmove ? 'M' : 'L', x, y);
+    if (c->n++ == 0) {
+        c->x0 = c->x1 = x;
+        c->y0 = c->y1 = y;
+    }
+    if (x < c->x0) c->x0 = x;
+    if (x > c->x1) c->x1 = x;
+    if (y < c->y0) c->y0 = y;
+    if (y > c->y1) c->y1 = y;
+}
+
+// Fingerprint of the font's subset to ranges, or 0 if the subset fails or
+// maps some ASCII character to another glyph.
+static uint32_t ascii_subset_fingerprint(const uint8_t *ttf, uint32_t len, const char *ranges,
+    const int *glyphs) {
+    uint32_t max = len + 6 * 65536, fp = 0;
+    uint8_t *subset = (uint8_t*)malloc(max);
+    uint32_t size = subset ? wasm_subset_font((void*)ttf, len, 0, (void*)ranges, subset, max) : 0;
+    stbtt_fontinfo font;
+    if (size && stbtt_InitFont(&font, subset, 0)) {
+        lazy_attach(&font);
+        fp = font_fingerprint(&font);
+        for (int i = 0; i < ASCII_COUNT; i++)
+            if (stbtt_FindGlyphIndex(&font, ASCII_FIRST + i) != glyphs[i]) fp = 0;
+    }
+    free(subset);
+    return fp;
+}
+
+// Writes the tables for one font as `ascii_table_<name>`, also matching
+// its subset to ranges when that isn't NULL.
+int ascii_table_write(FILE *out, const uint8_t *ttf, uint32_t len, const char *name, const char *ranges) {
+    stbtt_fontinfo font;
+    if (!stbtt_InitFont(&font, (unsigned char*)ttf, 0) || font.cff.size)
+        return 0;
+    lazy_attach(&font);
+
+    int glyphs[ASCII_COUNT], boxes[ASCII_COUNT][4];
+    for (int i = 0; i < ASCII_COUNT; i++)
+        glyphs[i] = stbtt_FindGlyphIndex(&font, ASCII_FIRST + i);
+    uint32_t subset_fp = ranges ? ascii_subset_fingerprint(ttf, len, ranges, glyphs) : 0;
+    if (ranges && !subset_fp) return 0;
+
+    fprintf(out, "static const char *const ascii_%s_paths[%d] = {\n", name, ASCII_COUNT);
+    for (int i = 0; i < ASCII_COUNT; i++) {
+        c_path_pen c = { { c_path_emit }, out, 0, 0, 0, 0, 0 };
+        fprintf(out, "    \"");
+        glyf_decode(&font, NULL, glyphs[i], &c.pen, 0);
+        fprintf(out, "\",\n");
+        boxes[i][0] = c.x0; boxes[i][1] = c.y0;
+        boxes[i][2] = c.x1; boxes[i][3] = c.y1;
+    }
+    fprintf(out, "};\n");
+
+    fprintf(out, "static const int16_t ascii_%s_boxes[%d][4] = {\n", name, ASCII_COUNT);
+    for (int i = 0; i < ASCII_COUNT; i++)
+        fprintf(out, "    { %d, %d, %d, %d },\n", boxes[i][0], boxes[i][1], boxes[i][2], boxes[i][3]);
+    fprintf(out, "};\n");
+
+    fprintf(out, "static const uint16_t ascii_%s_advances[%d] = {", name, ASCII_COUNT);
+    for (int i = 0; i < ASCII_COUNT; i++) {
+        int ax;
+        stbtt_GetGlyphHMetrics(&font, glyphs[i], &ax, 0);
+        fprintf(out, "%s%d,", i % 16 ? " " : "\n    ", ax);
+    }
+    fprintf(out, "\n};\n");
+
+    fprintf(out, "static const uint16_t ascii_%s_glyphs[%d] = {", name, ASCII_COUNT);
+    for (int i = 0; i < ASCII_COUNT; i++)
+        fprintf(out, "%s%d,", i % 16 ? " " : "\n    ", glyphs[i]);
+    fprintf(out, "\n};\n");
+
+    int index[ASCII_COUNT + 1], num_kerns = 0;
+    fprintf(out, "static const ascii_kern ascii_%s_kerns[] = {\n", name);
+    for (int i = 0; i < ASCII_COUNT; i++) {
+        index[i] = num_kerns;
+        for (int j = 0; j < ASCII_COUNT; j++) {
+            int v = stbtt_GetGlyphKernAdvance(&font, glyphs[i], glyphs[j]);
+            if (!v) continue;
+            fprintf(out, "    { %d, %d },\n", j, v);
+            num_kerns++;
+        }
+    }
+    index[ASCII_COUNT] = num_kerns;
+    if (!num_kerns) fprintf(out, "    { 0, 0 },\n");
+    fprintf(out, "};\n");
+
+    fprintf(out, "static const uint16_t ascii_%s_kern_index[%d] = {", name, ASCII_COUNT + 1);
+    for (int i = 0; i <= ASCII_COUNT; i++)
+        fprintf(out, "%s%d,", i % 16 ? " " : "\n    ", index[i]);
+    fprintf(out, "\n};\n");
+
+    uint32_t points[ASCII_COUNT + 1], cmds[ASCII_COUNT + 1];
+    outline *outlines[ASCII_COUNT];
+    points[0] = cmds[0] = 0;
+    for (int i = 0; i < ASCII_COUNT; i++) {
+        outlines[i] = outline_build(&font, NULL, glyphs[i]);
+        if (!outlines[i]) return 0;
+        points[i + 1] = points[i] + outlines[i]->npts;
+        cmds[i + 1] = cmds[i] + outlines[i]->ncmds;
+    }
+    if (points[ASCII_COUNT] > 0xFFFF || cmds[ASCII_COUNT] > 0xFFFF) return 0;
+
+    fprintf(out, "static const int16_t ascii_%s_points[] = {\n", name);
+    for (int i = 0; i < ASCII_COUNT; i++) {
+        const int16_t *xs = outline_xs(outlines[i]);
+        fprintf(out, "   ");
+        for (uint32_t k = 0; k < 2u * outlines[i]->npts; k++) fprintf(out, " %d,", xs[k]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "    0,\n};\n");
+    fprintf(out, "static const uint8_t ascii_%s_cmds[] = {\n", name);
+    for (int i = 0; i < ASCII_COUNT; i++) {
+        const uint8_t *c = outline_cmds(outlines[i]);
+        fprintf(out, "   ");
+        for (uint32_t k = 0; k < outlines[i]->ncmds; k++) fprintf(out, " %d,", c[k]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "    0,\n};\n");
+    fprintf(out, "static const uint16_t ascii_%s_point_index[%d] = {", name, ASCII_COUNT + 1);
+    for (int i = 0; i <= ASCII_COUNT; i++)
+        fprintf(out, "%s%u,", i % 16 ? " " : "\n    ", points[i]);
+    fprintf(out, "\n};\n");
+    fprintf(out, "static const uint16_t ascii_%s_cmd_index[%d] = {", name, ASCII_COUNT + 1);
+    for (int i = 0; i <= ASCII_COUNT; i++)
+        fprintf(out, "%s%u,", i % 16 ? " " : "\n    ", cmds[i]);
+    fprintf(out, "\n};\n");
+    for (int i = 0; i < ASCII_COUNT; i++) free(outlines[i]);
+
+    fprintf(out, "static const ascii_table ascii_table_%s = {\n", name);
+    fprintf(out, "    0x%08xu, 0x%08xu, ascii_%s_paths, ascii_%s_boxes, ascii_%s_advances,\n",
+            font_fingerprint(&font), subset_fp, name, name, name);
+    fprintf(out, "    ascii_%s_glyphs, ascii_%s_kern_index, ascii_%s_kerns,\n", name, name, name);
+    fprintf(out, "    ascii_%s_points, ascii_%s_point_index, ascii_%s_cmds, ascii_%s_cmd_index,\n};\n\n",
+            name, name, name, name);
+    return 1;
+}
+#endif // __wasm__
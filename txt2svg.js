@@ -1,45 +1,191 @@
+// Font IDs of the fonts linked in with `make EMBED_FONTS=1`, by font key
+const BUILTIN_FONTS = {
+    roboto: 1,
+    wendyone: 2,
+    alfaslabone: 3,
+};
+
+// Random-access sources of lazily opened fonts, indexed by source id. A
+// source is { size, read(offset, length) } where read synchronously returns
+// a Uint8Array; WASM pulls tables and glyph records from it on demand.
+const lazySources = [];
+let lazyMem = null;
+
+// Host functions the module imports; pass them in the env object when
+// instantiating txt2svg.wasm
+export const imports = {
+    txt2svg_read(source, offset, length, dst) {
+        const src = lazySources[source];
+        if (!src || !lazyMem) return 0;
+        const bytes = src.read(offset, length).subarray(0, length);
+        lazyMem.set(bytes, dst);
+        return bytes.length;
+    },
+};
+
+// Wraps a buffer as a lazy font source
+export function bufferSource(buf) {
+    return { size: buf.length, read: (offset, length) => buf.subarray(offset, offset + length) };
+}
+
 export default function (wasm_module) {
-    const { memory, wasm_generate_svg, wasm_alloc, wasm_reset_heap } = wasm_module.exports;
+    const { memory, wasm_generate_svg, wasm_alloc, wasm_reset_heap,
+            wasm_builtin_font, wasm_builtin_font_len, wasm_subset_font,
+            wasm_lazy_font_open, wasm_lazy_font_len, wasm_font_face_index,
+            wasm_generate_svg_spans, wasm_generate_svg_glyphs,
+            wasm_layout_spans, wasm_serialize_svg,
+            wasm_session_open, wasm_session_close, wasm_session_render,
+            wasm_word_cache_stats, wasm_svg_hash, wasm_build_id } = wasm_module.exports;
     const mem = new Uint8Array(memory.buffer);
+    lazyMem = mem;
+
+    // the request heap shares linear memory with persistent caches and
+    // wasm_alloc returns 0 once the two would collide
+    function alloc(size) {
+        const p = wasm_alloc(size);
+        if (!p) throw new Error('txt2svg: out of WASM memory');
+        return p;
+    }
 
     function writeStr(str) {
         const encoder = new TextEncoder();
         const buf = encoder.encode(str + "\0");
-        const p = wasm_alloc(buf.length);
+        const p = alloc(buf.length);
         mem.set(buf, p);
         return p;
     }
     
     function writeBin(buf) {
-        const p = wasm_alloc(buf.length);
+        const p = alloc(buf.length);
         mem.set(buf, p);
         return p;
     }
     
-    this.generateSVG = (text, fontBuf, color) => {
-        // reset heap inside WASM so that stb_truetype allocations and
-        // our own buffers share a consistent allocator
+    // Returns the built-in font ID for a font key, or 0 when the module was
+    // built without embedded fonts
+    this.builtinFont = (key) => {
+        const id = BUILTIN_FONTS[key];
+        return id && wasm_builtin_font(id) ? id : 0;
+    }
+
+    // Resolves a face of a font collection (.ttc) given as an index or as a
+    // name such as "Noto Sans CJK JP Bold" against a font already in WASM
+    // memory; -1 if no face has that name
+    function faceIndex(fontPtr, fontLen, face) {
+        if (typeof face !== 'string') return face || 0;
+        return wasm_font_face_index(fontPtr, fontLen, writeStr(face));
+    }
+
+    // Builds a TTF holding only the glyphs for a range spec such as
+    // "U+0020-007E,U+00A0-00FF", from face `face` (index or name) when
+    // fontBuf is a collection. Returns a copy outside WASM memory, or null
+    // if the spec or the font is not supported.
+    this.subsetFont = (fontBuf, ranges, face = 0) => {
         wasm_reset_heap();
 
-        // if color does not start with '#' prepend it
-        if (!color.startsWith('#')) {
-            color = '#' + color;
-        }
-        
-        const textPtr = writeStr(text);
-        const colorPtr = writeStr(color);
         const fontPtr = writeBin(fontBuf);
-        const outPtr = wasm_alloc(64 * 1024);
-        
-        const resultLength = wasm_generate_svg(
-            textPtr,
-            fontPtr,
-            fontBuf.length,
-            colorPtr,
-            outPtr,
-            64 * 1024
-        );
-        
+        const rangesPtr = writeStr(ranges);
+        // only long loca offsets and glyph padding grow, at most 6 bytes
+        // per glyph
+        const outMax = fontBuf.length + 6 * 65536;
+        const outPtr = alloc(outMax);
+
+        const index = faceIndex(fontPtr, fontBuf.length, face);
+        if (index < 0) return null;
+        const len = wasm_subset_font(fontPtr, fontBuf.length, index, rangesPtr, outPtr, outMax);
+        return len ? mem.slice(outPtr, outPtr + len) : null;
+    }
+
+    // Opens a font without copying it into WASM memory: only the table
+    // directory and the tables layout needs are read up front, glyph
+    // outlines are fetched from the source as text uses them and cached
+    // for the isolate's lifetime. Returns a handle for generateSVG, or null
+    // if the font can't be opened lazily (CFF fonts, collections, no memory).
+    this.openLazyFont = (source) => {
+        let id = lazySources.indexOf(source);
+        const added = id < 0;
+        if (added) id = lazySources.push(source) - 1;
+        wasm_reset_heap();
+        const ptr = wasm_lazy_font_open(id, source.size);
+        if (ptr) return { ptr, length: wasm_lazy_font_len(ptr) };
+        // a source that failed to open is never read again
+        if (added) lazySources.pop();
+        return null;
+    }
+
+    // Places a font in WASM memory; built-in and lazy fonts already live
+    // there, nothing to copy, and a buffer already copied for this call is
+    // reused
+    function fontPtrLen(font, placed) {
+        if (typeof font === 'number')
+            return [wasm_builtin_font(font), wasm_builtin_font_len(font)];
+        if (font.ptr)
+            return [font.ptr, font.length];
+        if (!placed.has(font))
+            placed.set(font, writeBin(font));
+        return [placed.get(font), font.length];
+    }
+
+    // A font or an array of fallback fonts as a list of
+    // { font, face, variations }; face and variations default for the first
+    function fontChain(font, face, variations) {
+        return (Array.isArray(font) ? font : [font]).map((f, i) =>
+            f.font !== undefined ? f : { font: f, face: i ? 0 : face, variations: i ? '' : variations });
+    }
+
+    // Appends a font_ref { data, len, face, variations } per chain entry to
+    // refs; false if a face name matches no face of its collection
+    function pushFontRefs(refs, chain, placed) {
+        for (const { font, face, variations } of chain) {
+            const [fontPtr, fontLen] = fontPtrLen(font, placed);
+            const faceIdx = faceIndex(fontPtr, fontLen, face);
+            if (faceIdx < 0) return false;
+            refs.push(fontPtr, fontLen, faceIdx, writeStr(variations || ''));
+        }
+        return true;
+    }
+
+    function writeWords(words) {
+        return writeBin(new Uint8Array(new Uint32Array(words).buffer));
+    }
+
+    // Writes text_span records for spans and the font_refs they index
+    // into; null if a face name matches no face of its collection. chains
+    // lists every span's { font, face, variations } entries in font_ref
+    // order, enough to write the same font_refs again.
+    function writeSpans(spans) {
+        const refs = [];
+        const words = [];
+        const chains = [];
+        const placed = new Map();
+        for (const span of spans) {
+            const chain = fontChain(span.font, span.face || 0, span.variations || '');
+            const first = refs.length / 4;
+            if (!pushFontRefs(refs, chain, placed)) return null;
+            chains.push(...chain);
+            // text_span { text, font, num_fonts, color, size }
+            words.push(writeStr(span.text), first, chain.length,
+                       writeStr(colorStr(span.color || '#000000')), span.size || 64);
+        }
+        return { spansPtr: writeWords(words), fontsPtr: writeWords(refs), numFonts: refs.length / 4, chains };
+    }
+
+    // text_options { max_width, align, line_height, fit_width, fit_height }
+    // from { maxWidth, align, lineHeight, fit }, lineHeight as a multiple of
+    // the fonts' line spacing and fit as { width, height }
+    function writeOptions({ maxWidth = 0, align = 'left', lineHeight = 1, fit = null } = {}) {
+        const alignments = { left: 0, center: 1, right: 2 };
+        const px = (v) => Math.max(0, Math.round(v || 0));
+        return writeWords([px(maxWidth), alignments[align] || 0, px(lineHeight * 100),
+                           px(fit && fit.width), px(fit && fit.height)]);
+    }
+
+    // if color does not start with '#' prepend it
+    function colorStr(color) {
+        return color.startsWith('#') ? color : '#' + color;
+    }
+
+    function readSVG(outPtr, resultLength) {
         const decoder = new TextDecoder();
         const sliceStart = outPtr;
         const sliceEnd = mem.indexOf(0, outPtr);
@@ -57,4 +203,227 @@ export default function (wasm_module) {
         
         return result;
     }
-}
\ No newline at end of file
+
+    // font is either a built-in font ID, a handle from openLazyFont, or a
+    // buffer holding a TTF, TTC, WOFF/WOFF2 or a prebaked .pack from the
+    // fontpack tool; face picks a member of a collection by index or name.
+    // variations selects an instance of a variable font, either as axis
+    // settings ("wght=700,wdth=87.5") or by instance name ("Condensed Bold").
+    // font may also be an array of up to 8 fonts, each of them a font or a
+    // { font, face, variations } object: characters missing from the first
+    // are taken from the next font that has them. Newlines start a new
+    // line; options { maxWidth, align, lineHeight } wrap lines at maxWidth
+    // pixels, align them 'left', 'center' or 'right' and scale the line
+    // spacing. options.fit = { width, height } sets the text as large as
+    // fits that box, wrapping at the box width or maxWidth, the smaller,
+    // if maxWidth is set, and returns an SVG of exactly that size.
+    this.generateSVG = (text, font, color, face = 0, variations = '', options = {}) => {
+        // reset heap inside WASM so that stb_truetype allocations and
+        // our own buffers share a consistent allocator
+        wasm_reset_heap();
+
+        const textPtr = writeStr(text);
+        const colorPtr = writeStr(colorStr(color));
+        const chain = fontChain(font, face, variations);
+        const refs = [];
+        if (!pushFontRefs(refs, chain, new Map())) return '';
+        const fontsPtr = writeWords(refs);
+        const optionsPtr = writeOptions(options);
+        const outPtr = alloc(64 * 1024);
+        
+        const resultLength = wasm_generate_svg(
+            textPtr,
+            fontsPtr,
+            chain.length,
+            colorPtr,
+            optionsPtr,
+            outPtr,
+            64 * 1024
+        );
+        
+        return readSVG(outPtr, resultLength);
+    }
+
+    // Renders spans such as a bold colored prefix followed by body text in
+    // one SVG. Each span is { text, font, color, size, face, variations }
+    // with font and face as for generateSVG and size in pixels (default
+    // 64); spans follow each other on one baseline. Up to 64 spans and 16
+    // fonts in all. options are as for generateSVG and apply to the spans
+    // as one paragraph.
+    this.generateSpans = (spans, options = {}) => {
+        wasm_reset_heap();
+
+        const written = writeSpans(spans);
+        if (!written) return '';
+        const optionsPtr = writeOptions(options);
+        const outPtr = alloc(64 * 1024);
+
+        const resultLength = wasm_generate_svg_spans(
+            written.spansPtr,
+            spans.length,
+            written.fontsPtr,
+            written.numFonts,
+            optionsPtr,
+            outPtr,
+            64 * 1024
+        );
+
+        return readSVG(outPtr, resultLength);
+    }
+
+    // Lays out spans (as for generateSpans) without rendering them.
+    // Returns null on failure or a layout to pass to serialize, as often
+    // as needed: { run, chains, colors, glyphs } where glyphs is an
+    // Int32Array of seven words per glyph (glyph id, font index, span
+    // index, codepoint, x, y, and the pixel scale as float bits).
+    this.layout = (spans, options = {}) => {
+        wasm_reset_heap();
+
+        const written = writeSpans(spans);
+        if (!written) return null;
+        const optionsPtr = writeOptions(options);
+        // a glyph_run header, then at most one placed_glyph per text byte
+        let bytes = 0;
+        for (const span of spans) bytes += new TextEncoder().encode(span.text).length;
+        const runMax = 12 + 28 * bytes;
+        const runPtr = alloc(runMax);
+
+        const len = wasm_layout_spans(
+            written.spansPtr,
+            spans.length,
+            written.fontsPtr,
+            written.numFonts,
+            optionsPtr,
+            runPtr,
+            runMax
+        );
+        if (!len) return null;
+        const run = mem.slice(runPtr, runPtr + len);
+        return {
+            run,
+            chains: written.chains,
+            colors: spans.map((span) => colorStr(span.color || '#000000')),
+            glyphs: new Int32Array(run.buffer, 12, (len - 12) / 4),
+        };
+    }
+
+    // Writes a layout as SVG. colors is a color for all spans or an array
+    // with one per span (default: the spans' own), precision the decimals
+    // of path coordinates (0 to 6) and mode 'paths' for a path per glyph,
+    // 'merged' for one per color or 'words' for one per word, served from
+    // the word cache when the word was written before.
+    this.serialize = (layout, { colors = layout.colors, precision = 3, mode = 'paths' } = {}) => {
+        wasm_reset_heap();
+
+        const refs = [];
+        if (!pushFontRefs(refs, layout.chains, new Map())) return '';
+        const fontsPtr = writeWords(refs);
+        const colorList = (Array.isArray(colors) ? colors : [colors]).map((c) => writeStr(colorStr(c)));
+        const colorsPtr = writeWords(colorList);
+        const runPtr = writeBin(layout.run);
+        const outPtr = alloc(64 * 1024);
+
+        const resultLength = wasm_serialize_svg(
+            runPtr,
+            fontsPtr,
+            refs.length / 4,
+            colorsPtr,
+            colorList.length,
+            precision,
+            { merged: 1, words: 2 }[mode] || 0,
+            outPtr,
+            64 * 1024
+        );
+
+        return readSVG(outPtr, resultLength);
+    }
+
+    // Opens a session for re-rendering text as it is edited. Its render
+    // takes the same arguments as generateSpans and redraws only glyphs
+    // that changed since the last render, copying the rest. Sessions are
+    // few (four at once); close them when done. Returns null if none is
+    // free.
+    this.session = () => {
+        let id = wasm_session_open();
+        if (!id) return null;
+        return {
+            render(spans, options = {}) {
+                if (!id) return '';
+                wasm_reset_heap();
+
+                const written = writeSpans(spans);
+                if (!written) return '';
+                const optionsPtr = writeOptions(options);
+                const outPtr = alloc(64 * 1024);
+
+                const resultLength = wasm_session_render(
+                    id,
+                    written.spansPtr,
+                    spans.length,
+                    written.fontsPtr,
+                    written.numFonts,
+                    optionsPtr,
+                    outPtr,
+                    64 * 1024
+                );
+
+                return readSVG(outPtr, resultLength);
+            },
+            close() {
+                if (id) wasm_session_close(id);
+                id = 0;
+            },
+        };
+    }
+
+    // xxHash32 of the last SVG generated, as 8 hex digits: computed while
+    // the SVG was written out, it is a ready-made ETag
+    this.svgHash = () => (wasm_svg_hash() >>> 0).toString(16).padStart(8, '0');
+
+    // Digest of the module's build, as 8 hex digits: the same text,
+    // fonts and options render the same SVG for as long as it holds
+    this.buildId = () => (wasm_build_id() >>> 0).toString(16).padStart(8, '0');
+
+    // Counters of the word cache that generateSVG and generateSpans write
+    // words through: { hits, misses, evictions, rejected, entries, bytes }
+    this.wordCacheStats = () => {
+        wasm_reset_heap();
+        const p = alloc(24);
+        wasm_word_cache_stats(p);
+        const [hits, misses, evictions, rejected, entries, bytes] = new Uint32Array(memory.buffer, p, 6);
+        return { hits, misses, evictions, rejected, entries, bytes };
+    }
+
+    // Renders glyphs already shaped elsewhere, e.g. by HarfBuzz, skipping
+    // cmap lookup and kerning. glyphs is either HarfBuzz's JSON output
+    // ([{ g, ax, dx, dy }, ...] in font units) or an Int32Array of glyph id,
+    // x advance, x offset and y offset per glyph. font, face and variations
+    // are as for generateSVG but name a single font; size is in pixels.
+    this.generateGlyphs = (glyphs, font, color, size = 64, face = 0, variations = '') => {
+        wasm_reset_heap();
+
+        let words = glyphs;
+        if (!(glyphs instanceof Int32Array)) {
+            words = new Int32Array(glyphs.length * 4);
+            glyphs.forEach(({ g, ax, dx, dy }, i) => words.set([g, ax, dx || 0, dy || 0], i * 4));
+        }
+        const glyphsPtr = writeBin(new Uint8Array(words.buffer, words.byteOffset, words.byteLength));
+        const refs = [];
+        if (!pushFontRefs(refs, fontChain(font, face, variations).slice(0, 1), new Map())) return '';
+        const fontPtr = writeWords(refs);
+        const colorPtr = writeStr(colorStr(color));
+        const outPtr = alloc(64 * 1024);
+
+        const resultLength = wasm_generate_svg_glyphs(
+            glyphsPtr,
+            words.length / 4,
+            fontPtr,
+            colorPtr,
+            size,
+            outPtr,
+            64 * 1024
+        );
+
+        return readSVG(outPtr, resultLength);
+    }
+}
@@ -1,23 +1,157 @@
 import txt2svg_wasm from "./txt2svg.wasm";
+import TXT2SVG, { imports as txt2svg_imports, bufferSource } from "./txt2svg.js";
 const txt2svg_mod = await WebAssembly.instantiate(txt2svg_wasm, {
     env: {
-        memory: new WebAssembly.Memory({ initial: 128 }) // 8MB (128 * 64KB pages)
+        memory: new WebAssembly.Memory({ initial: 128 }), // 8MB (128 * 64KB pages)
+        ...txt2svg_imports,
     }
 });
-import TXT2SVG from "./txt2svg.js";
 
-async function loadFont(font, req, env) {
-    const fontsURLMap = {
-        roboto: 'Roboto.ttf',
-        wendyone: 'WendyOne.ttf',
-        alfaslabone: 'AlfaSlabOne.ttf',
+// Output is a function of the build (engine, Worker and fonts) and the
+// normalized request, so ETags are derived from the two before rendering
+const BUILD_ID = new TXT2SVG(txt2svg_mod).buildId();
+
+// 64-bit FNV-1a of a string's UTF-16 units, as 16 hex digits
+function digest(str) {
+    let lo = 0x84222325, hi = 0xcbf29ce4;
+    for (let i = 0; i < str.length; i++) {
+        lo = (lo ^ str.charCodeAt(i)) >>> 0;
+        // multiply by the FNV prime 2^40 + 0x1b3 in 32-bit halves
+        const a = lo * 0x1b3, b = hi * 0x1b3 + (lo << 8) + Math.floor(a / 0x100000000);
+        lo = a >>> 0;
+        hi = b >>> 0;
+    }
+    return hi.toString(16).padStart(8, '0') + lo.toString(16).padStart(8, '0');
+}
+
+const FONT_FILES = {
+    roboto: 'Roboto.ttf',
+    wendyone: 'WendyOne.ttf',
+    alfaslabone: 'AlfaSlabOne.ttf',
+};
+
+// Faces of each font file by index, named by family and style as
+// wasm_font_face_index matches them. The face parameter is resolved to an
+// index here before it reaches a cache key, so a request can only ever
+// name a face that exists.
+const FONT_FACES = {
+    roboto: ['Roboto Regular'],
+    wendyone: ['Wendy One Regular'],
+    alfaslabone: ['Alfa Slab One Regular'],
+};
+
+// Each font is subset to these ranges once per isolate. Requests whose
+// text is fully covered render from the subset, which needs no fetch and
+// is a fraction of the size to copy into WASM memory. The Makefile builds
+// the ASCII tables for these subsets from SUBSET_RANGES there; keep the
+// two in sync.
+const SUBSET_RANGES = [
+    [0x0020, 0x007E], [0x00A0, 0x017F], [0x2013, 0x2014],
+    [0x2018, 0x201E], [0x2022, 0x2022], [0x2026, 0x2026], [0x20AC, 0x20AC],
+];
+const SUBSET_SPEC = SUBSET_RANGES.map(([a, b]) => `U+${a.toString(16)}-${b.toString(16)}`).join(',');
+const subsetFonts = {};
+
+// Fonts larger than this are opened lazily once per isolate: only the
+// tables layout needs and the glyphs actually rendered are ever copied
+// into WASM memory. A font that fails to open is recorded as null, so
+// there is at most one entry per FONT_FILES key, and renders from its
+// buffer without trying again.
+const LAZY_FONT_BYTES = 1024 * 1024;
+const lazyFonts = {};
+
+// Rendered SVGs and their ETags by canonical request, least recently used
+// first. Repeat requests are answered from here without loading a font or
+// calling into WASM. Sizes count string lengths, keys included.
+const RESPONSE_CACHE_BYTES = 4 * 1024 * 1024;
+const responseCache = new Map();
+let responseCacheBytes = 0;
+
+function cachedSVG(key) {
+    const entry = responseCache.get(key);
+    if (entry === undefined) return undefined;
+    // re-inserting moves it to the most recently used end
+    responseCache.delete(key);
+    responseCache.set(key, entry);
+    return entry;
+}
+
+function cacheSVG(key, entry) {
+    const size = key.length + entry.svg.length;
+    if (size > RESPONSE_CACHE_BYTES / 4 || responseCache.has(key)) return;
+    responseCache.set(key, entry);
+    responseCacheBytes += size;
+    for (const [k, v] of responseCache) {
+        if (responseCacheBytes <= RESPONSE_CACHE_BYTES) break;
+        responseCache.delete(k);
+        responseCacheBytes -= k.length + v.svg.length;
     }
+}
 
-    if (typeof fontsURLMap[font] === 'undefined')
+// Renders in progress, by cache key, as promises of their results
+const inflight = new Map();
+
+// Longest text rendered, in UTF-8 bytes as WASM reads it, and the range
+// line heights are clamped to, so that every value outside it shares the
+// cache entry of the bound it renders as
+const MAX_TEXT_BYTES = 2048;
+const MIN_LINE_HEIGHT = 0.1, MAX_LINE_HEIGHT = 10;
+
+// True if the request's If-None-Match lists etag
+function notModified(req, etag) {
+    const header = req.headers.get('If-None-Match');
+    if (!header) return false;
+    return header.split(',').some((tag) => {
+        tag = tag.trim();
+        return tag === '*' || tag === etag || tag === 'W/' + etag;
+    });
+}
+
+function svgHeaders(etag) {
+    return {
+        'Content-Type': 'image/svg+xml',
+        'Access-Control-Allow-Origin': '*',
+        'Cache-Control': 'public, max-age=31536000', // Cache for 1 year
+        'ETag': etag,
+    };
+}
+
+// The SVG with its ETag, or an empty 304 if the client already has it.
+// HEAD gets the headers alone.
+function svgResponse(req, { svg, etag }) {
+    const headers = svgHeaders(etag);
+    if (notModified(req, etag)) return new Response(null, { status: 304, headers });
+    return new Response(req.method === 'HEAD' ? null : svg, { headers });
+}
+
+function requestError(message) {
+    return new Response(JSON.stringify({ error: message }), {
+        status: 400,
+        headers: { 'Content-Type': 'application/json' }
+    });
+}
+
+function fontError(key) {
+    return requestError(`Unsupported font: ${key}`);
+}
+
+function inSubset(text) {
+    for (const ch of text) {
+        const cp = ch.codePointAt(0);
+        // line breaks draw no glyph
+        if (cp === 0x0A || cp === 0x0D) continue;
+        if (!SUBSET_RANGES.some(([a, b]) => cp >= a && cp <= b))
+            return false;
+    }
+    return true;
+}
+
+async function loadFont(font, origin, assets) {
+    if (typeof FONT_FILES[font] === 'undefined')
         return null;
     
     try {
-        const fontResponse = await env.ASSETS.fetch(new Request(new URL('/fonts/'+fontsURLMap[font], req.url)));
+        const fontResponse = await assets.fetch(new Request(new URL('/fonts/'+FONT_FILES[font], origin)));
         const fontBuffer = await fontResponse.arrayBuffer();
         return new Uint8Array(fontBuffer);
     } catch (error) {
@@ -26,67 +160,177 @@ async function loadFont(font, req, env) {
     }
 }
 
+function renderError(message) {
+    return new Response(JSON.stringify({ error: message }), {
+        status: 500,
+        headers: { 'Content-Type': 'application/json' }
+    });
+}
+
+// Renders one normalized request. Concurrent identical requests share the
+// result, so it takes only the values the render needs, none of them tied
+// to the request that happened to start it. Resolves to { entry } with the
+// SVG and its ETag, plus { stored } while the edge cache is written, or to
+// { error } with a Response.
+async function render({ text, fontKeys, face, variations, color, options, cacheKey, etag, origin, assets }) {
+    // The edge cache is shared by the data center's isolates (wrangler dev
+    // simulates it locally) and outlives deploys, so its keys carry the
+    // build as the ETag does.
+    const edgeCache = globalThis.caches ? caches.default : null;
+    const edgeKey = new Request(`${origin}/service?build=${BUILD_ID}&${cacheKey}`);
+    const edgeHit = edgeCache && await edgeCache.match(edgeKey);
+    if (edgeHit) {
+        const entry = { svg: await edgeHit.text(), etag };
+        cacheSVG(cacheKey, entry);
+        return { entry };
+    }
+
+    // Initialize txt2svg
+    const txt2svg = new TXT2SVG(txt2svg_mod);
+
+    // fonts embedded in the module need no fetch, and neither
+    // does text covered by an already built subset or a font
+    // that is already open lazily. Subsets keep the font's glyph ids,
+    // GSUB and GPOS, so they render exactly as the font does. They hold a
+    // single face, so they are kept per font and face, and drop font
+    // variations. face and variation apply to the first font of the list.
+    // A font that fails to subset is recorded as null and not retried.
+    const resolveFont = async (key, face, variations) => {
+        const fontId = face === 0 ? key : `${key}:${face}`;
+        let font = txt2svg.builtinFont(key) || lazyFonts[key];
+        let fontFace = face;
+        const useSubset = () => {
+            if (!subsetFonts[fontId] || variations || !inSubset(text)) return false;
+            font = subsetFonts[fontId];
+            fontFace = 0;
+            return true;
+        };
+        if (!font && !useSubset()) {
+            font = await loadFont(key, origin, assets);
+            if (font && font.length > LAZY_FONT_BYTES) {
+                if (lazyFonts[key] === undefined)
+                    lazyFonts[key] = txt2svg.openLazyFont(bufferSource(font)) || null;
+                font = lazyFonts[key] || font;
+            } else if (font && subsetFonts[fontId] === undefined) {
+                subsetFonts[fontId] = txt2svg.subsetFont(font, SUBSET_SPEC, face) || null;
+                // the request that builds the subset renders
+                // from it too, as its ETag assumes
+                useSubset();
+            }
+        }
+        return font && { font, face: fontFace, variations };
+    };
+    const fonts = [];
+    for (const key of fontKeys) {
+        const font = await resolveFont(key, fonts.length ? 0 : face, fonts.length ? '' : variations);
+        if (!font) return { error: fontError(key) };
+        fonts.push(font);
+    }
+
+    let svg;
+    try {
+        // Generate SVG
+        svg = txt2svg.generateSVG(text, fonts, color, 0, '', options);
+    } catch (error) {
+        console.error('Error generating SVG:', error);
+        return { error: renderError('Internal server error') };
+    }
+    if (!svg || svg.length === 0)
+        return { error: renderError('Generated SVG is empty') };
+
+    const entry = { svg, etag };
+    cacheSVG(cacheKey, entry);
+    if (!edgeCache) return { entry };
+    const res = new Response(svg, { headers: svgHeaders(etag) });
+    const stored = edgeCache.put(edgeKey, res).catch((error) =>
+        console.error('Failed to cache SVG:', error));
+    return { entry, stored };
+}
+
 export default {
     async fetch(req, env, ctx) {
         const url = new URL(req.url);
         const path = url.pathname;
 
-        // Handle GET /
-        if (req.method === 'GET') {
+        // Handle GET / and HEAD /
+        if (req.method === 'GET' || req.method === 'HEAD') {
             if (path === '/service') {
                 
                 // execute the module and return generated SVG
                 const urlParams = url.searchParams;
                 const text = urlParams.get('text') || 'Hello World';
-                const fontKey = (urlParams.get('font') || 'roboto').toLowerCase();
-                const color = urlParams.get('color') || '#000000';
-
-                const fontBuffer = await loadFont(fontKey, req, env);
-
-                try {
-                    // Load font
-                    if (!fontBuffer) {
-                        return new Response(JSON.stringify({ error: `Unsupported font: ${fontKey}` }), {
-                            status: 400,
-                            headers: { 'Content-Type': 'application/json' }
-                        });
-                    }
-                    
-                    // Initialize txt2svg
-                    const txt2svg = new TXT2SVG(txt2svg_mod);
-                    
-                    // Generate SVG
-                    console.log('txt2svg debug:', {
-                        text,
-                        fontKey,
-                        fontLength: fontBuffer.length,
-                    });
-
-                    const svg = txt2svg.generateSVG(text, fontBuffer, color);
-
-                    console.log('txt2svg debug result length:', svg ? svg.length : 0);
-                    
-                    if (!svg || svg.length === 0) {
-                        return new Response(JSON.stringify({ error: 'Generated SVG is empty' }), {
-                            status: 500,
-                            headers: { 'Content-Type': 'application/json' }
-                        });
-                    }
-                    
-                    return new Response(svg, {
-                        headers: {
-                            'Content-Type': 'image/svg+xml',
-                            'Access-Control-Allow-Origin': '*',
-                            'Cache-Control': 'public, max-age=31536000' // Cache for 1 year
-                        }
-                    });
-                } catch (error) {
-                    console.error('Error generating SVG:', error);
-                    return new Response(JSON.stringify({ error: 'Internal server error' }), {
-                        status: 500,
-                        headers: { 'Content-Type': 'application/json' }
-                    });
+                if (new TextEncoder().encode(text).length > MAX_TEXT_BYTES)
+                    return requestError(`Text longer than ${MAX_TEXT_BYTES} bytes`);
+                // a comma separated list of fonts falls back from one to
+                // the next for characters a font lacks
+                const fontKeys = (urlParams.get('font') || 'roboto').toLowerCase().split(',').slice(0, 8);
+                // CSS colors are case insensitive; '#' is optional
+                const color = (urlParams.get('color') || '000000').toLowerCase().replace(/^#/, '');
+                const unknown = fontKeys.find((key) => typeof FONT_FILES[key] === 'undefined');
+                if (unknown !== undefined) return fontError(unknown);
+                // member of a font collection, by index or by name, of the
+                // first font of the list
+                const faceParam = urlParams.get('face') || '0';
+                const faces = FONT_FACES[fontKeys[0]];
+                const face = /^\d+$/.test(faceParam) ? Number(faceParam) : faces.indexOf(faceParam);
+                if (!(face >= 0 && face < faces.length))
+                    return requestError(`Unsupported face: ${faceParam}`);
+                // variable font instance: "wght:700,wdth:80" or an instance name
+                const variations = urlParams.get('variation') || '';
+                // paragraph layout: wrap width in pixels, alignment of the
+                // lines and line spacing as a multiple of the font's
+                const align = urlParams.get('align');
+                const lineHeight = parseFloat(urlParams.get('lineheight') || '1');
+                const options = {
+                    maxWidth: Math.max(0, parseInt(urlParams.get('width') || '0', 10) || 0),
+                    align: align === 'center' || align === 'right' ? align : 'left',
+                    // WASM takes line height in percent
+                    lineHeight: Number.isNaN(lineHeight) ? 1
+                        : Math.round(Math.min(Math.max(lineHeight, MIN_LINE_HEIGHT), MAX_LINE_HEIGHT) * 100) / 100,
+                };
+                // fit=WxH renders the text as large as fits a W by H box
+                const fit = /^(\d+)x(\d+)$/i.exec(urlParams.get('fit') || '');
+                if (fit) options.fit = { width: parseInt(fit[1], 10), height: parseInt(fit[2], 10) };
+
+                // every parameter above, normalized, with defaults filled in
+                // and sorted, so that requests rendering the same SVG share
+                // cache entries whichever way their URLs spell it
+                const cacheKey = new URLSearchParams([
+                    ['align', options.align],
+                    ['color', color],
+                    ['face', String(face)],
+                    ['fit', options.fit ? `${options.fit.width}x${options.fit.height}` : ''],
+                    ['font', fontKeys.join(',')],
+                    ['lineheight', String(options.lineHeight)],
+                    ['text', text],
+                    ['variation', variations],
+                    ['width', String(options.maxWidth)],
+                ]).toString();
+
+                // revalidation needs neither fonts nor a render: the ETag is
+                // only ever sent with a rendered SVG. HEAD answers as GET
+                // would, so it renders too, or reports why it can't.
+                const etag = `"${BUILD_ID}-${digest(cacheKey)}"`;
+                if (notModified(req, etag))
+                    return svgResponse(req, { svg: null, etag });
+                const cached = cachedSVG(cacheKey);
+                if (cached !== undefined) return svgResponse(req, cached);
+
+                // Concurrent identical requests share one render: the first
+                // starts it and every one of them answers from the result
+                let pending = inflight.get(cacheKey);
+                if (!pending) {
+                    pending = render({
+                        text, fontKeys, face, variations, color, options, cacheKey, etag,
+                        origin: url.origin, assets: env.ASSETS,
+                    }).finally(() => inflight.delete(cacheKey));
+                    inflight.set(cacheKey, pending);
                 }
+                const { entry, stored, error } = await pending;
+                // each request keeps itself alive until the edge cache
+                // has the SVG, whichever of them started the render
+                if (stored) ctx.waitUntil(stored);
+                return error ? error.clone() : svgResponse(req, entry);
             } else {
                 return env.ASSETS.fetch(req);
             }